@@ -0,0 +1,113 @@
+// packing of small textures into shared atlases
+#pragma once
+#include <external.hpp>
+
+namespace vtuto {
+
+/** textures up to this size on both sides are packed */
+const std::uint32_t atlas_tile_limit = 256;
+
+/**
+  side of an atlas. Texture coordinates are stored as
+  halves, which resolve a quarter texel of it
+ */
+const std::uint32_t atlas_size = 1024;
+
+/**
+  texels of edge repeated around every tile, a texel at the
+  coarsest of atlas_mip_levels, so filtering does not reach
+  the neighbor tiles
+ */
+const std::uint32_t atlas_gutter = 8;
+const std::uint32_t atlas_mip_levels = 4;
+
+/** texture placed in an atlas, from its first texel on */
+struct AtlasTile {
+  std::size_t texture = 0;
+  std::string source;
+  std::uint32_t x = 0;
+  std::uint32_t y = 0;
+  std::uint32_t width = 0;
+  std::uint32_t height = 0;
+};
+
+struct AtlasLayout {
+  std::uint32_t width = 0;
+  std::uint32_t height = 0;
+  std::vector<AtlasTile> tiles;
+
+  /** uv of a tile, offset in xy and scale in zw */
+  glm::vec4 uv_transform(const AtlasTile &tile) const {
+    return glm::vec4(float(tile.x) / width,
+                     float(tile.y) / height,
+                     float(tile.width) / width,
+                     float(tile.height) / height);
+  }
+};
+
+/**
+  Pack tiles into atlases on shelves, tallest first. Every
+  tile takes its size and a gutter on each side, rounded to
+  4 texels so tiles start on a block of compressed formats.
+  A tile that does not fit starts a new atlas.
+ */
+inline std::vector<AtlasLayout>
+pack_atlases(std::vector<AtlasTile> tiles) {
+  std::stable_sort(tiles.begin(), tiles.end(),
+                   [](const AtlasTile &a, const AtlasTile &b) {
+                     return a.height > b.height;
+                   });
+  auto cell = [](std::uint32_t size) {
+    return (size + 2 * atlas_gutter + 3) / 4 * 4;
+  };
+  std::vector<AtlasLayout> atlases;
+  std::uint32_t shelf_x = 0, shelf_y = 0, shelf_height = 0;
+  for (AtlasTile &tile : tiles) {
+    std::uint32_t w = cell(tile.width);
+    std::uint32_t h = cell(tile.height);
+    if (shelf_x + w > atlas_size) {
+      shelf_x = 0;
+      shelf_y += shelf_height;
+      shelf_height = 0;
+    }
+    if (atlases.empty() || shelf_y + h > atlas_size) {
+      atlases.emplace_back();
+      shelf_x = shelf_y = shelf_height = 0;
+    }
+    tile.x = shelf_x + atlas_gutter;
+    tile.y = shelf_y + atlas_gutter;
+    shelf_x += w;
+    shelf_height = std::max(shelf_height, h);
+
+    AtlasLayout &atlas = atlases.back();
+    atlas.tiles.push_back(tile);
+    atlas.width = std::max(atlas.width, shelf_x);
+    atlas.height = std::max(atlas.height, shelf_y + h);
+  }
+  return atlases;
+}
+
+/**
+  Copy an rgba8 image into its tile of an rgba8 atlas, the
+  gutter repeats the edge texels.
+ */
+inline void copy_tile(const AtlasTile &tile,
+                      const std::uint8_t *rgba,
+                      std::uint8_t *atlas,
+                      std::uint32_t atlas_width) {
+  auto gutter = static_cast<std::int64_t>(atlas_gutter);
+  auto width = static_cast<std::int64_t>(tile.width);
+  auto height = static_cast<std::int64_t>(tile.height);
+  for (std::int64_t y = -gutter; y < height + gutter; y++) {
+    std::int64_t sy = std::min(std::max(y, std::int64_t(0)),
+                               height - 1);
+    std::uint8_t *row =
+        atlas + ((tile.y + y) * atlas_width + tile.x) * 4;
+    for (std::int64_t x = -gutter; x < width + gutter; x++) {
+      std::int64_t sx = std::min(
+          std::max(x, std::int64_t(0)), width - 1);
+      std::memcpy(row + x * 4, rgba + (sy * width + sx) * 4, 4);
+    }
+  }
+}
+}
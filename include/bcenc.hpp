@@ -0,0 +1,415 @@
+// block compression of rgba8 textures
+#pragma once
+#include <cfloat>
+#include <cstring>
+#include <external.hpp>
+#include <mipmap.hpp>
+#include <threadpool.hpp>
+
+namespace vtuto {
+
+/** whether the block encoders below can write the format */
+inline bool is_block_format(VkFormat format) {
+  return format == VK_FORMAT_BC1_RGB_SRGB_BLOCK ||
+         format == VK_FORMAT_BC3_SRGB_BLOCK ||
+         format == VK_FORMAT_BC7_SRGB_BLOCK;
+}
+
+/** bytes of a 4x4 block of a block compressed format */
+inline std::size_t block_size(VkFormat format) {
+  switch (format) {
+  case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+    return 8;
+  case VK_FORMAT_BC3_SRGB_BLOCK:
+  case VK_FORMAT_BC7_SRGB_BLOCK:
+    return 16;
+  default:
+    throw std::runtime_error("unsupported block format");
+  }
+}
+
+/** bytes of a width x height image in a block format */
+inline VkDeviceSize compressed_size(VkFormat format,
+                                    std::uint32_t width,
+                                    std::uint32_t height) {
+  return VkDeviceSize((width + 3) / 4) * ((height + 3) / 4) *
+         block_size(format);
+}
+
+namespace detail {
+
+using texel_block = std::array<glm::vec4, 16>;
+
+/**
+  Texels of the block at (bx, by), rows first. Texels past
+  the edge of the image repeat the last row and column.
+ */
+inline void load_block(const std::uint8_t *rgba,
+                       std::uint32_t width,
+                       std::uint32_t height, std::uint32_t bx,
+                       std::uint32_t by, texel_block &block) {
+  for (std::uint32_t y = 0; y < 4; y++) {
+    std::uint32_t sy = std::min(by * 4 + y, height - 1);
+    for (std::uint32_t x = 0; x < 4; x++) {
+      std::uint32_t sx = std::min(bx * 4 + x, width - 1);
+      const std::uint8_t *p =
+          rgba + 4 * (std::size_t(sy) * width + sx);
+      block[4 * y + x] = glm::vec4(p[0], p[1], p[2], p[3]);
+    }
+  }
+}
+
+/**
+  Fit two endpoints and a palette index per texel to a
+  block.
+
+  The palette of the format interpolates the endpoints with
+  the given weights. The endpoints start at the extremes of
+  the block along its principal axis and are then refit by
+  least squares to the chosen indices; the best quantized
+  pair is kept. Only the channels set in mask count.
+
+  \param quantize nearest endpoint the format can store.
+
+  \return squared error of the block.
+ */
+template <std::size_t N, class Quantize>
+float fit_palette(const texel_block &block, glm::vec4 mask,
+                  const std::array<float, N> &weights,
+                  Quantize quantize, glm::vec4 &best0,
+                  glm::vec4 &best1,
+                  std::array<std::uint8_t, 16> &best_indices) {
+  // 1. extremes along the principal axis
+  glm::vec4 mean(0.0f);
+  glm::vec4 lo(255.0f);
+  glm::vec4 hi(0.0f);
+  for (const auto &c : block) {
+    mean += c * mask;
+    lo = glm::min(lo, c * mask);
+    hi = glm::max(hi, c * mask);
+  }
+  mean /= 16.0f;
+  glm::mat4 covariance(0.0f);
+  for (const auto &c : block) {
+    glm::vec4 d = c * mask - mean;
+    covariance += glm::outerProduct(d, d);
+  }
+  glm::vec4 axis = hi - lo;
+  for (int i = 0; i < 8; i++) {
+    glm::vec4 next = covariance * axis;
+    float len = glm::length(next);
+    if (len == 0.0f) {
+      break;
+    }
+    axis = next / len;
+  }
+  float t_lo = 0.0f;
+  float t_hi = 0.0f;
+  for (const auto &c : block) {
+    float t = glm::dot(c * mask - mean, axis);
+    t_lo = std::min(t_lo, t);
+    t_hi = std::max(t_hi, t);
+  }
+  glm::vec4 e0 = mean + axis * t_lo;
+  glm::vec4 e1 = mean + axis * t_hi;
+
+  // 2. alternate index choice and least squares refit
+  float best_error = FLT_MAX;
+  for (int pass = 0; pass < 3; pass++) {
+    glm::vec4 q0 = quantize(glm::clamp(e0, 0.0f, 255.0f));
+    glm::vec4 q1 = quantize(glm::clamp(e1, 0.0f, 255.0f));
+    std::array<glm::vec4, N> palette;
+    for (std::size_t k = 0; k < N; k++) {
+      palette[k] = glm::mix(q0, q1, weights[k]) * mask;
+    }
+    std::array<std::uint8_t, 16> indices;
+    float error = 0.0f;
+    for (std::size_t i = 0; i < 16; i++) {
+      glm::vec4 c = block[i] * mask;
+      float nearest = FLT_MAX;
+      for (std::size_t k = 0; k < N; k++) {
+        glm::vec4 d = palette[k] - c;
+        float distance = glm::dot(d, d);
+        if (distance < nearest) {
+          nearest = distance;
+          indices[i] = static_cast<std::uint8_t>(k);
+        }
+      }
+      error += nearest;
+    }
+    if (error < best_error) {
+      best_error = error;
+      best0 = q0;
+      best1 = q1;
+      best_indices = indices;
+    }
+    if (error == 0.0f) {
+      break;
+    }
+    float a = 0.0f, b = 0.0f, c = 0.0f;
+    glm::vec4 x(0.0f), y(0.0f);
+    for (std::size_t i = 0; i < 16; i++) {
+      float t = weights[indices[i]];
+      a += (1.0f - t) * (1.0f - t);
+      b += t * (1.0f - t);
+      c += t * t;
+      x += (1.0f - t) * block[i];
+      y += t * block[i];
+    }
+    float det = a * c - b * b;
+    if (std::abs(det) < 1e-6f) {
+      break;
+    }
+    e0 = (c * x - b * y) / det;
+    e1 = (a * y - b * x) / det;
+  }
+  return best_error;
+}
+
+/** least significant bit first writer of a block */
+struct bit_writer {
+  std::uint8_t *out;
+  std::size_t pos = 0;
+
+  void put(std::uint32_t value, std::size_t bits) {
+    for (std::size_t b = 0; b < bits; b++, pos++) {
+      if ((value >> b) & 1) {
+        out[pos / 8] |=
+            static_cast<std::uint8_t>(1 << (pos % 8));
+      }
+    }
+  }
+};
+
+/** 8 bit value to the nearest of levels + 1 values */
+inline std::uint32_t reduce_bits(float v, float levels) {
+  return static_cast<std::uint32_t>(
+      std::lround(v * levels / 255.0f));
+}
+
+/** nearest color with 5, 6 and 5 bits, decoded to 8 bits */
+inline glm::vec4 quantize_565(glm::vec4 c) {
+  std::uint32_t r = reduce_bits(c.x, 31.0f);
+  std::uint32_t g = reduce_bits(c.y, 63.0f);
+  std::uint32_t b = reduce_bits(c.z, 31.0f);
+  return glm::vec4((r << 3) | (r >> 2), (g << 2) | (g >> 4),
+                   (b << 3) | (b >> 2), 0.0f);
+}
+inline std::uint16_t pack_565(glm::vec4 c) {
+  return static_cast<std::uint16_t>(
+      (reduce_bits(c.x, 31.0f) << 11) |
+      (reduce_bits(c.y, 63.0f) << 5) | reduce_bits(c.z, 31.0f));
+}
+
+/**
+  BC1 color block, also the color half of BC3. Four color
+  mode needs the first endpoint to be the larger one.
+ */
+inline void encode_color_block(const texel_block &block,
+                               std::uint8_t *out) {
+  static const std::array<float, 4> weights = {
+      0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f};
+  glm::vec4 e0, e1;
+  std::array<std::uint8_t, 16> indices;
+  fit_palette(block, glm::vec4(1.0f, 1.0f, 1.0f, 0.0f),
+              weights, quantize_565, e0, e1, indices);
+  std::uint16_t c0 = pack_565(e0);
+  std::uint16_t c1 = pack_565(e1);
+  if (c0 < c1) {
+    static const std::uint8_t swapped[] = {1, 0, 3, 2};
+    std::swap(c0, c1);
+    for (auto &i : indices) {
+      i = swapped[i];
+    }
+  }
+  std::uint32_t bits = 0;
+  if (c0 != c1) {
+    for (std::size_t i = 0; i < 16; i++) {
+      bits |= std::uint32_t(indices[i]) << (2 * i);
+    }
+  }
+  out[0] = static_cast<std::uint8_t>(c0);
+  out[1] = static_cast<std::uint8_t>(c0 >> 8);
+  out[2] = static_cast<std::uint8_t>(c1);
+  out[3] = static_cast<std::uint8_t>(c1 >> 8);
+  for (std::size_t k = 0; k < 4; k++) {
+    out[4 + k] = static_cast<std::uint8_t>(bits >> (8 * k));
+  }
+}
+
+/**
+  BC4 alpha block of BC3, in the eight value mode that needs
+  the first endpoint to be the larger one.
+ */
+inline void encode_alpha_block(const texel_block &block,
+                               std::uint8_t *out) {
+  static const std::array<float, 8> weights = {
+      0.0f,        1.0f,        1.0f / 7.0f, 2.0f / 7.0f,
+      3.0f / 7.0f, 4.0f / 7.0f, 5.0f / 7.0f, 6.0f / 7.0f};
+  glm::vec4 e0, e1;
+  std::array<std::uint8_t, 16> indices;
+  fit_palette(
+      block, glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), weights,
+      [](glm::vec4 c) { return glm::round(c); }, e0, e1,
+      indices);
+  auto a0 = static_cast<std::uint8_t>(e0.w);
+  auto a1 = static_cast<std::uint8_t>(e1.w);
+  if (a0 < a1) {
+    std::swap(a0, a1);
+    for (auto &i : indices) {
+      i = i < 2 ? 1 - i : 9 - i;
+    }
+  }
+  std::uint64_t bits = 0;
+  if (a0 != a1) {
+    for (std::size_t i = 0; i < 16; i++) {
+      bits |= std::uint64_t(indices[i]) << (3 * i);
+    }
+  }
+  out[0] = a0;
+  out[1] = a1;
+  for (std::size_t k = 0; k < 6; k++) {
+    out[2 + k] = static_cast<std::uint8_t>(bits >> (8 * k));
+  }
+}
+
+/**
+  Nearest endpoint of BC7 mode 6: 7 bits per channel and a
+  low bit shared by the four channels.
+ */
+inline glm::vec4 quantize_rgba7p(glm::vec4 c) {
+  glm::vec4 best(0.0f);
+  float best_error = FLT_MAX;
+  for (float p = 0.0f; p < 2.0f; p += 1.0f) {
+    glm::vec4 q = glm::clamp(glm::round((c - p) * 0.5f), 0.0f,
+                             127.0f);
+    glm::vec4 v = q * 2.0f + p;
+    float error = glm::dot(v - c, v - c);
+    if (error < best_error) {
+      best_error = error;
+      best = v;
+    }
+  }
+  return best;
+}
+
+/**
+  BC7 block in mode 6: a single rgba endpoint pair with 16
+  palette entries. Its precision is enough for color and
+  alpha textures alike, the partitioned modes would only
+  help blocks with several distinct colors.
+ */
+inline void encode_bc7_block(const texel_block &block,
+                             std::uint8_t *out) {
+  static const std::array<float, 16> weights = {
+      0.0f / 64,  4.0f / 64,  9.0f / 64,  13.0f / 64,
+      17.0f / 64, 21.0f / 64, 26.0f / 64, 30.0f / 64,
+      34.0f / 64, 38.0f / 64, 43.0f / 64, 47.0f / 64,
+      51.0f / 64, 55.0f / 64, 60.0f / 64, 64.0f / 64};
+  glm::vec4 e0, e1;
+  std::array<std::uint8_t, 16> indices;
+  fit_palette(block, glm::vec4(1.0f), weights, quantize_rgba7p,
+              e0, e1, indices);
+  // the first index is stored without its high bit
+  if (indices[0] >= 8) {
+    std::swap(e0, e1);
+    for (auto &i : indices) {
+      i = static_cast<std::uint8_t>(15 - i);
+    }
+  }
+  std::memset(out, 0, 16);
+  bit_writer bits{out};
+  bits.put(1 << 6, 7);
+  for (int k = 0; k < 4; k++) {
+    bits.put(static_cast<std::uint32_t>(e0[k]) >> 1, 7);
+    bits.put(static_cast<std::uint32_t>(e1[k]) >> 1, 7);
+  }
+  bits.put(static_cast<std::uint32_t>(e0.x) & 1, 1);
+  bits.put(static_cast<std::uint32_t>(e1.x) & 1, 1);
+  bits.put(indices[0], 3);
+  for (std::size_t i = 1; i < 16; i++) {
+    bits.put(indices[i], 4);
+  }
+}
+}
+
+/**
+  Compress an rgba8 image to BC1, BC3 or BC7.
+
+  Rows of blocks are encoded in parallel on the pool. The
+  encoders work on the stored srgb values, like the texture
+  sampler interpolates them.
+
+  \param out room for compressed_size() bytes.
+ */
+inline void compress_image(VkFormat format,
+                           const std::uint8_t *rgba,
+                           std::uint32_t width,
+                           std::uint32_t height,
+                           std::uint8_t *out,
+                           thread_pool &pool) {
+  std::size_t size = block_size(format);
+  std::uint32_t blocks_x = (width + 3) / 4;
+  std::uint32_t blocks_y = (height + 3) / 4;
+  pool.parallel_for(blocks_y, [&](std::size_t y) {
+    auto by = static_cast<std::uint32_t>(y);
+    detail::texel_block block;
+    for (std::uint32_t bx = 0; bx < blocks_x; bx++) {
+      detail::load_block(rgba, width, height, bx, by, block);
+      // the encoders or bits into a zeroed block, out is
+      // only written once
+      std::array<std::uint8_t, 16> encoded{};
+      if (format == VK_FORMAT_BC1_RGB_SRGB_BLOCK) {
+        detail::encode_color_block(block, encoded.data());
+      } else if (format == VK_FORMAT_BC3_SRGB_BLOCK) {
+        detail::encode_alpha_block(block, encoded.data());
+        detail::encode_color_block(block, encoded.data() + 8);
+      } else {
+        detail::encode_bc7_block(block, encoded.data());
+      }
+      std::size_t block = std::size_t(by) * blocks_x + bx;
+      std::memcpy(out + block * size, encoded.data(), size);
+    }
+  });
+}
+
+/** layout of an rgba8 mip chain once compressed */
+inline std::vector<MipLevel>
+compressed_chain_layout(VkFormat format,
+                        const std::vector<MipLevel> &levels) {
+  std::vector<MipLevel> compressed;
+  VkDeviceSize offset = 0;
+  for (const auto &level : levels) {
+    compressed.push_back({offset, level.width, level.height});
+    offset +=
+        compressed_size(format, level.width, level.height);
+  }
+  return compressed;
+}
+
+/** bytes of a compressed mip chain */
+inline VkDeviceSize
+compressed_chain_size(VkFormat format,
+                      const std::vector<MipLevel> &compressed) {
+  const MipLevel &last = compressed.back();
+  return last.offset +
+         compressed_size(format, last.width, last.height);
+}
+
+/**
+  Compress every level of an rgba8 mip chain into out, laid
+  out as compressed. Every byte of out is written once and
+  never read, so it can be mapped staging memory.
+ */
+inline void
+compress_mip_chain(VkFormat format, const std::uint8_t *chain,
+                   const std::vector<MipLevel> &levels,
+                   const std::vector<MipLevel> &compressed,
+                   std::uint8_t *out, thread_pool &pool) {
+  for (std::size_t l = 0; l < levels.size(); l++) {
+    compress_image(format, chain + levels[l].offset,
+                   levels[l].width, levels[l].height,
+                   out + compressed[l].offset, pool);
+  }
+}
+}
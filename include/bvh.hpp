@@ -0,0 +1,567 @@
+// bounding volume hierarchy for ray and box queries on meshes
+#pragma once
+#include <cfloat>
+#include <external.hpp>
+#include <meshcache.hpp>
+#include <threadpool.hpp>
+#include <vertex.hpp>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace vtuto {
+
+/** axis aligned bounding box, empty until grown */
+struct Aabb {
+  glm::vec3 lo = glm::vec3(FLT_MAX);
+  glm::vec3 hi = glm::vec3(-FLT_MAX);
+
+  void grow(glm::vec3 p) {
+    lo = glm::min(lo, p);
+    hi = glm::max(hi, p);
+  }
+  void grow(const Aabb &b) {
+    lo = glm::min(lo, b.lo);
+    hi = glm::max(hi, b.hi);
+  }
+  /** half the surface area, enough to compare boxes */
+  float area() const {
+    glm::vec3 e = glm::max(hi - lo, glm::vec3(0.0f));
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+  }
+  bool overlaps(const Aabb &b) const {
+    return lo.x <= b.hi.x && b.lo.x <= hi.x && lo.y <= b.hi.y &&
+           b.lo.y <= hi.y && lo.z <= b.hi.z && b.lo.z <= hi.z;
+  }
+};
+
+/** ray p = origin + t * direction for t in [0, t_max] */
+struct Ray {
+  glm::vec3 origin;
+  glm::vec3 direction;
+  float t_max = FLT_MAX;
+};
+
+/** closest intersection of a ray with a mesh */
+struct RayHit {
+  float t = FLT_MAX;
+  /** triangle in the indexed range the bvh was built on */
+  std::uint32_t triangle = UINT32_MAX;
+  /** barycentric coordinates of the hit point */
+  float u = 0.0f;
+  float v = 0.0f;
+};
+
+/**
+  Node of a flattened bvh, two per 64 byte cache line. An
+  inner node has a count of 0 and its children at first and
+  first + 1, a leaf holds count triangles from first in the
+  leaf order of the bvh.
+ */
+struct BvhNode {
+  glm::vec3 lo;
+  std::uint32_t first;
+  glm::vec3 hi;
+  std::uint32_t count;
+};
+
+/** shape of a built bvh */
+struct BvhStats {
+  std::size_t triangle_count = 0;
+  std::size_t node_count = 0;
+  std::size_t leaf_count = 0;
+  std::size_t max_depth = 0;
+};
+
+inline std::ostream &operator<<(std::ostream &out,
+                                const BvhStats &s) {
+  return out << "bvh: " << s.triangle_count << " triangles, "
+             << s.node_count << " nodes, " << s.leaf_count
+             << " leaves, depth " << s.max_depth;
+}
+
+/**
+  Bounding volume hierarchy over the triangles of a mesh.
+
+  Nodes are split with the surface area heuristic over
+  binned centroids on all three axes. The top of the tree is
+  split on the calling thread until there are enough
+  subtrees to keep the pool busy, the subtrees are then
+  built in parallel and stitched into a single node array,
+  children pairs next to each other.
+
+  Triangle positions are copied in leaf order, so a leaf
+  reads consecutive memory and queries do not touch the
+  vertex or index arrays. Ray box tests use SSE when the
+  build targets it.
+ */
+class triangle_bvh {
+  static constexpr std::size_t bin_count = 12;
+  static constexpr std::size_t max_leaf_size = 4;
+  static constexpr std::size_t max_depth = 64;
+
+  std::vector<BvhNode> nodes;
+  /** vertices of the triangles in leaf order, three each */
+  std::vector<glm::vec3> positions;
+  /** triangle index of every triangle in leaf order */
+  std::vector<std::uint32_t> triangles;
+
+  struct build_input {
+    std::vector<Aabb> bounds;
+    std::vector<glm::vec3> centroids;
+    std::vector<std::uint32_t> order;
+  };
+  /** a subtree left for the parallel phase */
+  struct build_task {
+    std::uint32_t node;
+    std::size_t begin;
+    std::size_t end;
+    std::size_t depth;
+    std::vector<BvhNode> nodes;
+    std::size_t max_depth = 0;
+  };
+
+public:
+  BvhStats stats;
+
+public:
+  /**
+    Build the hierarchy over the triangles of the index
+    range [first_index, first_index + index_count) of mesh.
+   */
+  void build(const MeshView &mesh, std::size_t first_index,
+             std::size_t index_count, thread_pool &pool) {
+    std::size_t triangle_count = index_count / 3;
+    nodes.clear();
+    positions.assign(triangle_count * 3, glm::vec3(0.0f));
+    triangles.assign(triangle_count, 0);
+    stats = BvhStats{};
+    stats.triangle_count = triangle_count;
+    if (triangle_count == 0) {
+      return;
+    }
+    auto vertex = [&](std::size_t i) {
+      std::size_t v =
+          mesh.index_type == VK_INDEX_TYPE_UINT16
+              ? static_cast<const std::uint16_t *>(
+                    mesh.indices)[i]
+              : static_cast<const std::uint32_t *>(
+                    mesh.indices)[i];
+      return mesh.vertices[v].pos;
+    };
+
+    // 1. triangle bounds and centroids, in parallel blocks
+    build_input in;
+    in.bounds.resize(triangle_count);
+    in.centroids.resize(triangle_count);
+    in.order.resize(triangle_count);
+    std::size_t block_count = pool.size() * 4;
+    std::size_t block = triangle_count / block_count + 1;
+    pool.parallel_for(block_count, [&](std::size_t b) {
+      std::size_t end =
+          std::min(triangle_count, (b + 1) * block);
+      for (std::size_t t = b * block; t < end; t++) {
+        Aabb box;
+        for (std::size_t k = 0; k < 3; k++) {
+          box.grow(vertex(first_index + 3 * t + k));
+        }
+        in.bounds[t] = box;
+        in.centroids[t] = (box.lo + box.hi) * 0.5f;
+        in.order[t] = static_cast<std::uint32_t>(t);
+      }
+    });
+
+    // 2. split the top of the tree on this thread
+    std::vector<build_task> tasks;
+    std::size_t task_size =
+        std::max<std::size_t>(triangle_count / block_count,
+                              1024);
+    nodes.resize(1);
+    build_node(in, nodes, 0, 0, triangle_count, 0, task_size,
+               &tasks, stats.max_depth);
+
+    // 3. build the subtrees in parallel and stitch them
+    pool.parallel_for(tasks.size(), [&](std::size_t i) {
+      auto &task = tasks[i];
+      task.nodes.resize(1);
+      build_node(in, task.nodes, 0, task.begin, task.end,
+                 task.depth, SIZE_MAX, nullptr,
+                 task.max_depth);
+    });
+    for (auto &task : tasks) {
+      auto base = static_cast<std::uint32_t>(nodes.size());
+      for (std::size_t i = 0; i < task.nodes.size(); i++) {
+        BvhNode node = task.nodes[i];
+        if (node.count == 0) {
+          // local children start at 1
+          node.first += base - 1;
+        }
+        if (i == 0) {
+          nodes[task.node] = node;
+        } else {
+          nodes.push_back(node);
+        }
+      }
+      stats.max_depth =
+          std::max(stats.max_depth, task.max_depth);
+    }
+
+    // 4. copy the triangles in leaf order
+    for (std::size_t t = 0; t < triangle_count; t++) {
+      std::uint32_t source = in.order[t];
+      triangles[t] = source;
+      for (std::size_t k = 0; k < 3; k++) {
+        positions[3 * t + k] =
+            vertex(first_index + 3 * source + k);
+      }
+    }
+    stats.node_count = nodes.size();
+    for (const auto &node : nodes) {
+      stats.leaf_count += node.count > 0 ? 1 : 0;
+    }
+  }
+
+  bool empty() const { return nodes.empty(); }
+
+  /** whether the ray hits any triangle, for visibility tests */
+  bool raycast(const Ray &ray) const {
+    RayHit hit;
+    return traverse(ray, hit, true);
+  }
+
+  /** closest triangle hit by the ray */
+  bool closest_hit(const Ray &ray, RayHit &hit) const {
+    hit = RayHit{};
+    return traverse(ray, hit, false);
+  }
+
+  /**
+    Append the triangles whose bounds overlap the box.
+
+    \return number of triangles appended.
+   */
+  std::size_t
+  overlap(const Aabb &box,
+          std::vector<std::uint32_t> &result) const {
+    std::size_t before = result.size();
+    if (nodes.empty()) {
+      return 0;
+    }
+    std::array<std::uint32_t, 2 * max_depth + 2> stack;
+    std::size_t top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+      const BvhNode &node = nodes[stack[--top]];
+      if (!box.overlaps(Aabb{node.lo, node.hi})) {
+        continue;
+      }
+      if (node.count == 0) {
+        stack[top++] = node.first;
+        stack[top++] = node.first + 1;
+        continue;
+      }
+      for (std::uint32_t t = node.first;
+           t < node.first + node.count; t++) {
+        Aabb bounds;
+        for (std::size_t k = 0; k < 3; k++) {
+          bounds.grow(positions[3 * t + k]);
+        }
+        if (box.overlaps(bounds)) {
+          result.push_back(triangles[t]);
+        }
+      }
+    }
+    return result.size() - before;
+  }
+
+private:
+  /**
+    Fill nodes[index] with the subtree of order[begin, end).
+    Ranges smaller than task_size are left to tasks when it
+    is given.
+   */
+  static void build_node(build_input &in,
+                         std::vector<BvhNode> &nodes,
+                         std::size_t index, std::size_t begin,
+                         std::size_t end, std::size_t depth,
+                         std::size_t task_size,
+                         std::vector<build_task> *tasks,
+                         std::size_t &deepest) {
+    deepest = std::max(deepest, depth);
+    Aabb bounds, centroid_bounds;
+    for (std::size_t i = begin; i < end; i++) {
+      bounds.grow(in.bounds[in.order[i]]);
+      centroid_bounds.grow(in.centroids[in.order[i]]);
+    }
+    BvhNode &node = nodes[index];
+    node.lo = bounds.lo;
+    node.hi = bounds.hi;
+    std::size_t count = end - begin;
+    if (tasks != nullptr && count < task_size) {
+      tasks->push_back({static_cast<std::uint32_t>(index),
+                        begin, end, depth, {}, 0});
+      return;
+    }
+    std::size_t mid = split(in, begin, end, bounds,
+                            centroid_bounds, depth);
+    if (mid == begin || mid == end) {
+      node.first = static_cast<std::uint32_t>(begin);
+      node.count = static_cast<std::uint32_t>(count);
+      return;
+    }
+    auto left = static_cast<std::uint32_t>(nodes.size());
+    nodes[index].first = left;
+    nodes[index].count = 0;
+    nodes.resize(nodes.size() + 2);
+    build_node(in, nodes, left, begin, mid, depth + 1,
+               task_size, tasks, deepest);
+    build_node(in, nodes, left + 1, mid, end, depth + 1,
+               task_size, tasks, deepest);
+  }
+
+  /**
+    Partition order[begin, end) at the cheapest binned SAH
+    split.
+
+    \return the partition point, begin or end for a leaf.
+   */
+  static std::size_t split(build_input &in, std::size_t begin,
+                           std::size_t end, const Aabb &bounds,
+                           const Aabb &centroid_bounds,
+                           std::size_t depth) {
+    std::size_t count = end - begin;
+    if (count <= max_leaf_size || depth >= max_depth) {
+      return begin;
+    }
+    struct bin {
+      Aabb bounds;
+      std::size_t count = 0;
+    };
+    glm::vec3 extent = centroid_bounds.hi - centroid_bounds.lo;
+    glm::vec3 scale(0.0f);
+    for (int axis = 0; axis < 3; axis++) {
+      if (extent[axis] > 0.0f) {
+        scale[axis] = bin_count * 0.9999f / extent[axis];
+      }
+    }
+    // 1. bin the triangles on the three axes in one pass
+    std::array<std::array<bin, bin_count>, 3> bins;
+    for (std::size_t i = begin; i < end; i++) {
+      std::uint32_t t = in.order[i];
+      glm::vec3 b =
+          (in.centroids[t] - centroid_bounds.lo) * scale;
+      for (int axis = 0; axis < 3; axis++) {
+        auto &target = bins[axis][static_cast<int>(b[axis])];
+        target.bounds.grow(in.bounds[t]);
+        target.count++;
+      }
+    }
+    // 2. sweep from the right, then evaluate from the left
+    // cost in triangle tests, a node visit costs one
+    float best_cost = static_cast<float>(count);
+    int best_axis = -1;
+    int best_split = 0;
+    for (int axis = 0; axis < 3; axis++) {
+      if (extent[axis] <= 0.0f) {
+        continue;
+      }
+      std::array<float, bin_count> right_area{};
+      Aabb right;
+      for (std::size_t b = bin_count - 1; b > 0; b--) {
+        right.grow(bins[axis][b].bounds);
+        right_area[b] = right.area();
+      }
+      Aabb left;
+      std::size_t left_count = 0;
+      for (std::size_t b = 0; b + 1 < bin_count; b++) {
+        left.grow(bins[axis][b].bounds);
+        left_count += bins[axis][b].count;
+        std::size_t right_count = count - left_count;
+        if (left_count == 0 || right_count == 0) {
+          continue;
+        }
+        float cost = 1.0f + (left.area() * left_count +
+                             right_area[b + 1] * right_count) /
+                                bounds.area();
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_split = static_cast<int>(b + 1);
+        }
+      }
+    }
+    auto first = in.order.begin() + begin;
+    auto last = in.order.begin() + end;
+    if (best_axis < 0) {
+      if (count <= 4 * max_leaf_size) {
+        return begin;
+      }
+      // too large for a leaf: median split on the widest axis
+      int axis = extent.x >= extent.y && extent.x >= extent.z
+                     ? 0
+                     : extent.y >= extent.z ? 1 : 2;
+      auto mid = first + count / 2;
+      std::nth_element(first, mid, last,
+                       [&](std::uint32_t a, std::uint32_t b) {
+                         return in.centroids[a][axis] <
+                                in.centroids[b][axis];
+                       });
+      return begin + count / 2;
+    }
+    auto mid =
+        std::partition(first, last, [&](std::uint32_t t) {
+          return static_cast<int>(
+                     (in.centroids[t][best_axis] -
+                      centroid_bounds.lo[best_axis]) *
+                     scale[best_axis]) < best_split;
+        });
+    return begin + static_cast<std::size_t>(mid - first);
+  }
+
+  /**
+    Distance along the ray to the entry of the box of node,
+    or FLT_MAX if the ray misses it before t_max.
+   */
+#if defined(__SSE2__)
+  static float enter_box(const BvhNode &node, __m128 origin,
+                         __m128 inv_dir, float t_max) {
+    // lane 3 holds first and count, it is replaced by lane 0
+    __m128 t1 = _mm_mul_ps(
+        _mm_sub_ps(_mm_loadu_ps(&node.lo.x), origin), inv_dir);
+    __m128 t2 = _mm_mul_ps(
+        _mm_sub_ps(_mm_loadu_ps(&node.hi.x), origin), inv_dir);
+    __m128 entry = _mm_min_ps(t1, t2);
+    __m128 exit = _mm_max_ps(t1, t2);
+    const int xyzx = _MM_SHUFFLE(0, 2, 1, 0);
+    const int pairs = _MM_SHUFFLE(2, 3, 0, 1);
+    const int halves = _MM_SHUFFLE(1, 0, 3, 2);
+    entry = _mm_shuffle_ps(entry, entry, xyzx);
+    exit = _mm_shuffle_ps(exit, exit, xyzx);
+    // reduce the lanes: swap pairs, then halves
+    entry = _mm_max_ps(entry,
+                       _mm_shuffle_ps(entry, entry, pairs));
+    entry = _mm_max_ps(entry,
+                       _mm_shuffle_ps(entry, entry, halves));
+    exit = _mm_min_ps(exit, _mm_shuffle_ps(exit, exit, pairs));
+    exit = _mm_min_ps(exit, _mm_shuffle_ps(exit, exit, halves));
+    float t_near = std::max(_mm_cvtss_f32(entry), 0.0f);
+    float t_far = std::min(_mm_cvtss_f32(exit), t_max);
+    return t_near <= t_far ? t_near : FLT_MAX;
+  }
+#else
+  static float enter_box(const BvhNode &node, glm::vec3 origin,
+                         glm::vec3 inv_dir, float t_max) {
+    glm::vec3 t1 = (node.lo - origin) * inv_dir;
+    glm::vec3 t2 = (node.hi - origin) * inv_dir;
+    glm::vec3 entry = glm::min(t1, t2);
+    glm::vec3 exit = glm::max(t1, t2);
+    float t_near = std::max(std::max(entry.x, entry.y),
+                            std::max(entry.z, 0.0f));
+    float t_far = std::min(std::min(exit.x, exit.y),
+                           std::min(exit.z, t_max));
+    return t_near <= t_far ? t_near : FLT_MAX;
+  }
+#endif
+
+  /** Moller Trumbore ray triangle intersection */
+  bool intersect(const Ray &ray, std::uint32_t t,
+                 RayHit &hit) const {
+    const glm::vec3 *p = &positions[3 * t];
+    glm::vec3 e1 = p[1] - p[0];
+    glm::vec3 e2 = p[2] - p[0];
+    glm::vec3 q = glm::cross(ray.direction, e2);
+    float det = glm::dot(e1, q);
+    if (std::abs(det) < 1e-12f) {
+      return false;
+    }
+    float inv_det = 1.0f / det;
+    glm::vec3 s = ray.origin - p[0];
+    float u = glm::dot(s, q) * inv_det;
+    if (u < 0.0f || u > 1.0f) {
+      return false;
+    }
+    glm::vec3 r = glm::cross(s, e1);
+    float v = glm::dot(ray.direction, r) * inv_det;
+    if (v < 0.0f || u + v > 1.0f) {
+      return false;
+    }
+    float dist = glm::dot(e2, r) * inv_det;
+    if (dist < 0.0f || dist > std::min(hit.t, ray.t_max)) {
+      return false;
+    }
+    hit.t = dist;
+    hit.triangle = triangles[t];
+    hit.u = u;
+    hit.v = v;
+    return true;
+  }
+
+  /**
+    Front to back traversal, the nearer child is visited
+    first and boxes beyond the current hit are skipped.
+   */
+  bool traverse(const Ray &ray, RayHit &hit, bool any) const {
+    if (nodes.empty()) {
+      return false;
+    }
+    // avoid 0 * inf in the slab test of axis parallel rays
+    glm::vec3 inv_dir;
+    for (int k = 0; k < 3; k++) {
+      float d = ray.direction[k];
+      inv_dir[k] = 1.0f / (std::abs(d) < 1e-20f
+                               ? std::copysign(1e-20f, d)
+                               : d);
+    }
+#if defined(__SSE2__)
+    __m128 origin = _mm_setr_ps(ray.origin.x, ray.origin.y,
+                                ray.origin.z, 0.0f);
+    __m128 inv = _mm_setr_ps(inv_dir.x, inv_dir.y, inv_dir.z,
+                             0.0f);
+#else
+    glm::vec3 origin = ray.origin;
+    glm::vec3 inv = inv_dir;
+#endif
+    bool found = false;
+    std::array<std::uint32_t, 2 * max_depth + 2> stack;
+    std::size_t top = 0;
+    if (enter_box(nodes[0], origin, inv, ray.t_max) ==
+        FLT_MAX) {
+      return false;
+    }
+    stack[top++] = 0;
+    while (top > 0) {
+      const BvhNode &node = nodes[stack[--top]];
+      if (node.count > 0) {
+        for (std::uint32_t t = node.first;
+             t < node.first + node.count; t++) {
+          if (intersect(ray, t, hit)) {
+            found = true;
+            if (any) {
+              return true;
+            }
+          }
+        }
+        continue;
+      }
+      float t_max = std::min(hit.t, ray.t_max);
+      float near_left =
+          enter_box(nodes[node.first], origin, inv, t_max);
+      float near_right =
+          enter_box(nodes[node.first + 1], origin, inv, t_max);
+      std::uint32_t first = node.first;
+      std::uint32_t second = node.first + 1;
+      if (near_right < near_left) {
+        std::swap(near_left, near_right);
+        std::swap(first, second);
+      }
+      if (near_right != FLT_MAX) {
+        stack[top++] = second;
+      }
+      if (near_left != FLT_MAX) {
+        stack[top++] = first;
+      }
+    }
+    return found;
+  }
+};
+}
@@ -18,6 +18,19 @@ struct VkDrawInfo {
   uint32_t first_vertex_index;
   uint32_t first_instance_index;
 };
+/**
+  Draws that share a descriptor set, usually those of one
+  material. Without a draw buffer the index range is drawn
+  directly, otherwise draw_count indirect commands are read
+  from first_draw on.
+ */
+struct DrawBatch {
+  VkDescriptorSet descriptor_set;
+  uint32_t first_index;
+  uint32_t index_count;
+  uint32_t first_draw;
+  uint32_t draw_count;
+};
 class vk_command_pool {
 public:
   VkCommandPool pool;
@@ -29,7 +42,8 @@ public:
       vulkan_device<VkDevice> &logical_dev) {
     QueuFamilyIndices qfi =
         QueuFamilyIndices::find_family_indices(
-            physical_dev.pdevice, physical_dev.surface);
+            physical_dev.pdevice, physical_dev.surface,
+            physical_dev.capabilities.queue_families);
     VkCommandPoolCreateInfo commandPoolInfo{};
     commandPoolInfo.sType =
         VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
@@ -40,6 +54,20 @@ public:
                                  &pool),
              "failed to create command pool");
   }
+  /** pool of the given queue family */
+  vk_command_pool(vulkan_device<VkDevice> &logical_dev,
+                  uint32_t family,
+                  VkCommandPoolCreateFlags flags = 0) {
+    VkCommandPoolCreateInfo commandPoolInfo{};
+    commandPoolInfo.sType =
+        VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    commandPoolInfo.flags = flags;
+    commandPoolInfo.queueFamilyIndex = family;
+    CHECK_VK(vkCreateCommandPool(logical_dev.device(),
+                                 &commandPoolInfo, nullptr,
+                                 &pool),
+             "failed to create command pool");
+  }
   void destroy(vulkan_device<VkDevice> &logical_dev) {
     vkDestroyCommandPool(logical_dev.device(), pool,
                          nullptr);
@@ -58,9 +86,12 @@ public:
       VkRenderPass &render_pass,
       VkExtent2D swap_chain_extent,
       VkPipeline graphics_pipeline, VkBuffer vertex_buffer,
-      VkBuffer index_buffer, std::vector<uint32_t> indices,
-      VkDescriptorSet descriptor_set,
+      const std::vector<VkDeviceSize> &vertex_offsets,
+      VkBuffer index_buffer, VkIndexType index_type,
+      VkBuffer draw_buffer,
+      const std::vector<DrawBatch> &batches,
       VkPipelineLayout pipeline_layout,
+      uint32_t uniform_offset, uint32_t draws_per_call,
       int32_t render_offset_x = 0,
       int32_t render_offset_y = 0,
       VkClearValue clearColor = {0.0f, 0.0f, 0.0f, 1.0f},
@@ -71,18 +102,18 @@ public:
           VK_PIPELINE_BIND_POINT_GRAPHICS,
       uint32_t vertex_count = 3,
       uint32_t instance_count = 1,
-      uint32_t first_vertex_index = 0,
       uint32_t first_instance_index = 0)
       : buffer(loc) {
     mk_cmd_buffer(
         sc_framebuffer, render_pass, swap_chain_extent,
-        graphics_pipeline, vertex_buffer, index_buffer,
-        indices, descriptor_set, pipeline_layout,
-        render_offset_x, render_offset_y, clearColor,
-        clearValueCount, subpass_contents,
+        graphics_pipeline, vertex_buffer, vertex_offsets,
+        index_buffer, index_type, draw_buffer, batches,
+        pipeline_layout, uniform_offset, draws_per_call,
+        render_offset_x,
+        render_offset_y, clearColor, clearValueCount,
+        subpass_contents,
         graphics_pass_bind_point, vertex_count,
-        instance_count, first_vertex_index,
-        first_instance_index);
+        instance_count, first_instance_index);
   }
   vulkan_buffer(
       VkCommandBuffer loc,
@@ -90,8 +121,10 @@ public:
       VkRenderPass &render_pass,
       VkExtent2D swap_chain_extent,
       VkPipeline graphics_pipeline, VkBuffer vertex_buffer,
-      VkBuffer index_buffer, std::vector<uint32_t> indices,
-      VkDescriptorSet descriptor_set,
+      const std::vector<VkDeviceSize> &vertex_offsets,
+      VkBuffer index_buffer, VkIndexType index_type,
+      VkBuffer draw_buffer,
+      const std::vector<DrawBatch> &batches,
       VkPipelineLayout pipeline_layout,
       VkCommandBufferBeginInfo beginInfo,
       VkRenderPassBeginInfo renderPassInfo,
@@ -104,8 +137,9 @@ public:
     //
     // mk_cmd_buffer(
     //    sc_framebuffer, render_pass, swap_chain_extent,
-    //    graphics_pipeline, vertex_buffer, index_buffer,
-    //    indices, beginInfo, renderPassInfo, drawInfo,
+    //    graphics_pipeline, vertex_buffer, vertex_offsets,
+    //    index_buffer, index_type, draw_buffer, batches,
+    //    beginInfo, renderPassInfo, drawInfo,
     //    subpass_contents, graphics_pass_bind_point);
   }
   void mk_cmd_buffer(
@@ -113,9 +147,12 @@ public:
       VkRenderPass &render_pass,
       VkExtent2D swap_chain_extent,
       VkPipeline graphics_pipeline, VkBuffer vertex_buffer,
-      VkBuffer index_buffer, std::vector<uint32_t> indices,
-      VkDescriptorSet descriptor_set,
+      const std::vector<VkDeviceSize> &vertex_offsets,
+      VkBuffer index_buffer, VkIndexType index_type,
+      VkBuffer draw_buffer,
+      const std::vector<DrawBatch> &batches,
       VkPipelineLayout pipeline_layout,
+      uint32_t uniform_offset, uint32_t draws_per_call,
       int32_t render_offset_x = 0,
       int32_t render_offset_y = 0,
       VkClearValue clearColor = {0.0f, 0.0f, 0.0f, 1.0f},
@@ -126,7 +163,6 @@ public:
           VK_PIPELINE_BIND_POINT_GRAPHICS,
       uint32_t vertex_count = 3,
       uint32_t instance_count = 1,
-      uint32_t first_vertex_index = 0,
       uint32_t first_instance_index = 0) {
 
     // 1. create command buffer info
@@ -162,25 +198,46 @@ public:
     vkCmdBindPipeline(buffer, graphics_pass_bind_point,
                       graphics_pipeline);
 
-    // 5. bind vertex buffer to command buffer
-    VkBuffer vertex_buffers[] = {vertex_buffer};
-    VkDeviceSize vertex_offsets[] = {0};
-    vkCmdBindVertexBuffers(buffer, 0, 1, vertex_buffers,
-                           vertex_offsets);
+    // 5. bind every vertex stream of the vertex buffer
+    std::vector<VkBuffer> vertex_buffers(vertex_offsets.size(),
+                                         vertex_buffer);
+    vkCmdBindVertexBuffers(
+        buffer, 0, static_cast<uint32_t>(vertex_buffers.size()),
+        vertex_buffers.data(), vertex_offsets.data());
     // 6. bind index buffer to command buffer
     vkCmdBindIndexBuffer(buffer, index_buffer, 0,
-                         VK_INDEX_TYPE_UINT32);
-
-    // 7. bind descriptor set
-    vkCmdBindDescriptorSets(
-        buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-        pipeline_layout, 0, 1, &descriptor_set, 0, nullptr);
+                         index_type);
 
-    // 7. draw given command buffer with indices
-    vkCmdDrawIndexed(buffer,
-                     static_cast<uint32_t>(indices.size()),
-                     instance_count, first_vertex_index,
-                     first_instance_index, 0);
+    // 7. bind the descriptor set of every batch once, with
+    // the uniforms of the frame at uniform_offset, and draw
+    // its indices, either directly or from the indirect
+    // commands of draw_buffer, draws_per_call at a time.
+    // More than one needs the multiDrawIndirect feature.
+    VkDescriptorSet bound_set = VK_NULL_HANDLE;
+    for (const auto &batch : batches) {
+      if (batch.descriptor_set != bound_set) {
+        bound_set = batch.descriptor_set;
+        vkCmdBindDescriptorSets(
+            buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+            pipeline_layout, 0, 1, &bound_set, 1,
+            &uniform_offset);
+      }
+      if (draw_buffer == VK_NULL_HANDLE) {
+        vkCmdDrawIndexed(buffer, batch.index_count,
+                         instance_count, batch.first_index, 0,
+                         first_instance_index);
+        continue;
+      }
+      for (uint32_t i = 0; i < batch.draw_count;
+           i += draws_per_call) {
+        vkCmdDrawIndexedIndirect(
+            buffer, draw_buffer,
+            (batch.first_draw + i) *
+                sizeof(VkDrawIndexedIndirectCommand),
+            std::min(draws_per_call, batch.draw_count - i),
+            sizeof(VkDrawIndexedIndirectCommand));
+      }
+    }
 
     vkCmdEndRenderPass(buffer);
     CHECK_VK(vkEndCommandBuffer(buffer),
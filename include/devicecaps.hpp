@@ -0,0 +1,209 @@
+// capabilities of the physical device, queried once
+#pragma once
+#include <external.hpp>
+#include <iomanip>
+
+namespace vtuto {
+
+/** formats of the core api, VK_FORMAT_UNDEFINED included */
+const std::uint32_t core_format_count =
+    VK_FORMAT_ASTC_12x12_SRGB_BLOCK + 1;
+
+/**
+  Snapshot of what a physical device reports: properties
+  and limits, features, memory types, queue families and the
+  features of every core format.
+
+  It is taken once when the device is picked, lookups index
+  its tables. Formats of extensions are not in the table and
+  read as unsupported. write() prints one line per value, so
+  the snapshots of two machines can be diffed.
+ */
+struct DeviceCapabilities {
+  VkPhysicalDeviceProperties properties{};
+  VkPhysicalDeviceFeatures features{};
+  VkPhysicalDeviceMemoryProperties memory{};
+  std::vector<VkQueueFamilyProperties> queue_families;
+  /** indexed by the format */
+  std::vector<VkFormatProperties> formats;
+  /**
+    memory types having all of a set of property flags, a
+    bit per type, indexed by the flags
+   */
+  std::array<std::uint32_t, 512> memory_types_with{};
+
+  static DeviceCapabilities query(VkPhysicalDevice pdev) {
+    DeviceCapabilities caps;
+    vkGetPhysicalDeviceProperties(pdev, &caps.properties);
+    vkGetPhysicalDeviceFeatures(pdev, &caps.features);
+    vkGetPhysicalDeviceMemoryProperties(pdev, &caps.memory);
+
+    uint32_t family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(
+        pdev, &family_count, nullptr);
+    caps.queue_families.resize(family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(
+        pdev, &family_count, caps.queue_families.data());
+
+    caps.formats.resize(core_format_count);
+    for (uint32_t f = 0; f < core_format_count; f++) {
+      vkGetPhysicalDeviceFormatProperties(
+          pdev, static_cast<VkFormat>(f), &caps.formats[f]);
+    }
+
+    for (uint32_t flags = 0;
+         flags < caps.memory_types_with.size(); flags++) {
+      caps.memory_types_with[flags] =
+          caps.scanMemoryTypes(flags);
+    }
+    return caps;
+  }
+
+  const VkPhysicalDeviceLimits &limits() const {
+    return properties.limits;
+  }
+
+  /** memory types having all the flags, a bit per type */
+  std::uint32_t
+  memory_types(VkMemoryPropertyFlags flags) const {
+    if (flags < memory_types_with.size()) {
+      return memory_types_with[flags];
+    }
+    return scanMemoryTypes(flags);
+  }
+
+  VkFormatProperties format(VkFormat f) const {
+    auto index = static_cast<std::size_t>(f);
+    return index < formats.size() ? formats[index]
+                                  : VkFormatProperties{};
+  }
+  bool supports(VkFormat f, VkImageTiling tiling,
+                VkFormatFeatureFlags wanted) const {
+    VkFormatProperties props = format(f);
+    VkFormatFeatureFlags available =
+        tiling == VK_IMAGE_TILING_LINEAR
+            ? props.linearTilingFeatures
+            : props.optimalTilingFeatures;
+    return (available & wanted) == wanted;
+  }
+
+  /** print the snapshot as key value lines, in fixed order */
+  void write(std::ostream &out) const {
+    const VkPhysicalDeviceProperties &p = properties;
+    out << std::setfill('0');
+    // 1. properties
+    out << "device.api_version " << version(p.apiVersion)
+        << "\n";
+    out << "device.driver_version 0x" << std::hex
+        << p.driverVersion << "\n";
+    out << "device.id 0x" << p.deviceID << "\n";
+    out << "device.name " << p.deviceName << "\n";
+    out << "device.pipeline_cache_uuid ";
+    for (uint32_t i = 0; i < VK_UUID_SIZE; i++) {
+      out << std::setw(2) << uint32_t(p.pipelineCacheUUID[i]);
+    }
+    out << "\n";
+    out << "device.type " << std::dec << p.deviceType << "\n";
+    out << "device.vendor_id 0x" << std::hex << p.vendorID
+        << "\n"
+        << std::dec;
+
+    // 2. features and limits used by the renderer
+#define VTUTO_CAPS_LINE(prefix, s, field)                  \
+  out << prefix #field " " << s.field << "\n"
+    const VkPhysicalDeviceFeatures &f = features;
+    VTUTO_CAPS_LINE("feature.", f, multiDrawIndirect);
+    VTUTO_CAPS_LINE("feature.", f, samplerAnisotropy);
+    VTUTO_CAPS_LINE("feature.", f, textureCompressionASTC_LDR);
+    VTUTO_CAPS_LINE("feature.", f, textureCompressionBC);
+    VTUTO_CAPS_LINE("feature.", f, textureCompressionETC2);
+    const VkPhysicalDeviceLimits &l = p.limits;
+    VTUTO_CAPS_LINE("limit.", l, bufferImageGranularity);
+    VTUTO_CAPS_LINE("limit.", l,
+                    maxDescriptorSetUniformBuffersDynamic);
+    VTUTO_CAPS_LINE("limit.", l, maxDrawIndirectCount);
+    VTUTO_CAPS_LINE("limit.", l, maxImageDimension2D);
+    VTUTO_CAPS_LINE("limit.", l, maxMemoryAllocationCount);
+    VTUTO_CAPS_LINE("limit.", l, maxPushConstantsSize);
+    VTUTO_CAPS_LINE("limit.", l, maxSamplerAnisotropy);
+    VTUTO_CAPS_LINE("limit.", l, maxUniformBufferRange);
+    VTUTO_CAPS_LINE("limit.", l, minMemoryMapAlignment);
+    VTUTO_CAPS_LINE("limit.", l,
+                    minUniformBufferOffsetAlignment);
+    VTUTO_CAPS_LINE("limit.", l, nonCoherentAtomSize);
+    VTUTO_CAPS_LINE("limit.", l,
+                    optimalBufferCopyOffsetAlignment);
+    VTUTO_CAPS_LINE("limit.", l,
+                    optimalBufferCopyRowPitchAlignment);
+#undef VTUTO_CAPS_LINE
+
+    // 3. formats with any feature, by number
+    for (uint32_t i = 0; i < formats.size(); i++) {
+      const VkFormatProperties &fp = formats[i];
+      if (fp.linearTilingFeatures == 0 &&
+          fp.optimalTilingFeatures == 0 &&
+          fp.bufferFeatures == 0) {
+        continue;
+      }
+      out << "format." << std::setw(3) << i << std::hex
+          << " linear 0x" << std::setw(8)
+          << fp.linearTilingFeatures << " optimal 0x"
+          << std::setw(8) << fp.optimalTilingFeatures
+          << " buffer 0x" << std::setw(8) << fp.bufferFeatures
+          << "\n"
+          << std::dec;
+    }
+
+    // 4. memory heaps and types
+    for (uint32_t h = 0; h < memory.memoryHeapCount; h++) {
+      out << "memory.heap." << std::setw(2) << h << " "
+          << (memory.memoryHeaps[h].size >> 20)
+          << " MiB flags 0x" << std::hex
+          << memory.memoryHeaps[h].flags << "\n"
+          << std::dec;
+    }
+    for (uint32_t t = 0; t < memory.memoryTypeCount; t++) {
+      out << "memory.type." << std::setw(2) << t << " heap "
+          << memory.memoryTypes[t].heapIndex << " flags 0x"
+          << std::hex << memory.memoryTypes[t].propertyFlags
+          << "\n"
+          << std::dec;
+    }
+
+    // 5. queue families
+    for (uint32_t q = 0; q < queue_families.size(); q++) {
+      const VkQueueFamilyProperties &qf = queue_families[q];
+      out << "queue." << std::setw(2) << q << " flags 0x"
+          << std::hex << qf.queueFlags << std::dec << " count "
+          << qf.queueCount << " timestamp_bits "
+          << qf.timestampValidBits << "\n";
+    }
+    out << std::setfill(' ');
+  }
+
+  /** write the snapshot to a file, false if it failed */
+  bool save(const std::string &path) const {
+    std::ofstream out(path);
+    write(out);
+    return static_cast<bool>(out);
+  }
+
+private:
+  std::uint32_t
+  scanMemoryTypes(VkMemoryPropertyFlags flags) const {
+    std::uint32_t types = 0;
+    for (uint32_t t = 0; t < memory.memoryTypeCount; t++) {
+      if ((memory.memoryTypes[t].propertyFlags & flags) ==
+          flags) {
+        types |= 1u << t;
+      }
+    }
+    return types;
+  }
+  static std::string version(uint32_t v) {
+    return std::to_string(v >> 22) + "." +
+           std::to_string((v >> 12) & 0x3ff) + "." +
+           std::to_string(v & 0xfff);
+  }
+};
+}
@@ -15,6 +15,10 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <thirdparty/stb_image.h>
 //
+// stb image resize
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+#include <thirdparty/stb_image_resize.h>
+//
 // tiny obj loader
 #define TINYOBJLOADER_IMPLEMENTATION
 #include <thirdparty/tiny_obj_loader.h>
@@ -0,0 +1,188 @@
+// view frustum and vectorized culling of bounding spheres
+#pragma once
+#include <external.hpp>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace vtuto {
+
+/** view frustum planes, inside is dot(n, p) + d >= 0 */
+struct Frustum {
+  std::array<glm::vec4, 6> planes;
+
+  /**
+    Extract the planes of a [0, 1] depth clip space matrix
+    (Gribb, Hartmann). With a model view projection matrix
+    the planes are in model space.
+   */
+  static Frustum from_matrix(const glm::mat4 &m) {
+    auto row = [&m](int i) {
+      return glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+    };
+    Frustum f;
+    f.planes = {row(3) + row(0), row(3) - row(0),
+                row(3) + row(1), row(3) - row(1), row(2),
+                row(3) - row(2)};
+    for (auto &p : f.planes) {
+      p = p / glm::length(glm::vec3(p));
+    }
+    return f;
+  }
+  bool intersects(glm::vec3 center, float radius) const {
+    for (const auto &p : planes) {
+      if (glm::dot(glm::vec3(p), center) + p.w < -radius) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+/** spheres tested per iteration by cull_spheres() */
+#if defined(__AVX__)
+const std::size_t sphere_batch_size = 8;
+#elif defined(__SSE2__)
+const std::size_t sphere_batch_size = 4;
+#else
+const std::size_t sphere_batch_size = 1;
+#endif
+
+/**
+  Bounding spheres in structure of arrays layout, so that a
+  batch of spheres is tested with one load per component.
+  The arrays are padded by a batch, so a batch starting at
+  any sphere can be loaded.
+ */
+class SphereSet {
+  std::vector<float> xs, ys, zs, radii;
+  std::size_t count = 0;
+
+public:
+  void push_back(glm::vec3 center, float radius) {
+    xs.resize(count + sphere_batch_size, 0.0f);
+    ys.resize(count + sphere_batch_size, 0.0f);
+    zs.resize(count + sphere_batch_size, 0.0f);
+    radii.resize(count + sphere_batch_size, 0.0f);
+    xs[count] = center.x;
+    ys[count] = center.y;
+    zs[count] = center.z;
+    radii[count] = radius;
+    count++;
+  }
+  void clear() {
+    xs.clear();
+    ys.clear();
+    zs.clear();
+    radii.clear();
+    count = 0;
+  }
+  std::size_t size() const { return count; }
+  glm::vec3 center(std::size_t i) const {
+    return glm::vec3(xs[i], ys[i], zs[i]);
+  }
+  float radius(std::size_t i) const { return radii[i]; }
+  const float *x() const { return xs.data(); }
+  const float *y() const { return ys.data(); }
+  const float *z() const { return zs.data(); }
+  const float *r() const { return radii.data(); }
+};
+
+/**
+  Scalar reference of cull_spheres(), one sphere at a time.
+ */
+inline std::size_t
+cull_spheres_scalar(const Frustum &frustum,
+                    const SphereSet &spheres, std::size_t first,
+                    std::size_t count, std::uint32_t *visible) {
+  std::size_t visible_count = 0;
+  for (std::size_t i = first; i < first + count; i++) {
+    if (frustum.intersects(spheres.center(i),
+                           spheres.radius(i))) {
+      visible[visible_count++] = static_cast<std::uint32_t>(i);
+    }
+  }
+  return visible_count;
+}
+
+/**
+  Test the spheres [first, first + count) against the
+  frustum and write the indices of those that intersect it
+  to visible, which needs room for count indices.
+
+  Spheres are tested sphere_batch_size at a time with AVX or
+  SSE when the build targets them, every plane costing three
+  multiply adds and a compare for the whole batch; other
+  targets use the scalar loop.
+
+  \return number of visible spheres.
+ */
+inline std::size_t cull_spheres(const Frustum &frustum,
+                                const SphereSet &spheres,
+                                std::size_t first,
+                                std::size_t count,
+                                std::uint32_t *visible) {
+#if defined(__AVX__) || defined(__SSE2__)
+  std::size_t visible_count = 0;
+  std::size_t end = first + count;
+  for (std::size_t i = first; i < end;
+       i += sphere_batch_size) {
+#if defined(__AVX__)
+    __m256 x = _mm256_loadu_ps(spheres.x() + i);
+    __m256 y = _mm256_loadu_ps(spheres.y() + i);
+    __m256 z = _mm256_loadu_ps(spheres.z() + i);
+    __m256 neg_r =
+        _mm256_sub_ps(_mm256_setzero_ps(),
+                      _mm256_loadu_ps(spheres.r() + i));
+    __m256 inside =
+        _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    for (const auto &p : frustum.planes) {
+      __m256 d = _mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(p.x)),
+                        _mm256_mul_ps(y, _mm256_set1_ps(p.y))),
+          _mm256_add_ps(_mm256_mul_ps(z, _mm256_set1_ps(p.z)),
+                        _mm256_set1_ps(p.w)));
+      inside = _mm256_and_ps(
+          inside, _mm256_cmp_ps(d, neg_r, _CMP_GE_OQ));
+    }
+    auto mask =
+        static_cast<std::uint32_t>(_mm256_movemask_ps(inside));
+#else
+    __m128 x = _mm_loadu_ps(spheres.x() + i);
+    __m128 y = _mm_loadu_ps(spheres.y() + i);
+    __m128 z = _mm_loadu_ps(spheres.z() + i);
+    __m128 neg_r = _mm_sub_ps(_mm_setzero_ps(),
+                              _mm_loadu_ps(spheres.r() + i));
+    __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    for (const auto &p : frustum.planes) {
+      __m128 d = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(p.x)),
+                     _mm_mul_ps(y, _mm_set1_ps(p.y))),
+          _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(p.z)),
+                     _mm_set1_ps(p.w)));
+      inside = _mm_and_ps(inside, _mm_cmpge_ps(d, neg_r));
+    }
+    auto mask =
+        static_cast<std::uint32_t>(_mm_movemask_ps(inside));
+#endif
+    // drop the lanes past the end of the range
+    if (end - i < sphere_batch_size) {
+      mask &= (1u << (end - i)) - 1;
+    }
+    while (mask != 0) {
+      auto lane =
+          static_cast<std::uint32_t>(__builtin_ctz(mask));
+      visible[visible_count++] =
+          static_cast<std::uint32_t>(i) + lane;
+      mask &= mask - 1;
+    }
+  }
+  return visible_count;
+#else
+  return cull_spheres_scalar(frustum, spheres, first, count,
+                             visible);
+#endif
+}
+}
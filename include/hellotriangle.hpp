@@ -1,17 +1,36 @@
 #pragma once
+#include <atlas.hpp>
+#include <bvh.hpp>
 #include <commandbuffer.hpp>
 #include <cstdint>
 #include <debug.hpp>
 #include <external.hpp>
 #include <framebuffer.hpp>
+#include <frustum.hpp>
 #include <imageview.hpp>
 #include <ldevice.hpp>
+#include <memoryallocator.hpp>
+#include <meshcache.hpp>
+#include <meshlet.hpp>
+#include <meshopt.hpp>
+#include <mipmap.hpp>
+#include <objloader.hpp>
+#include <objstream.hpp>
 #include <pdevice.hpp>
+#include <simplify.hpp>
+#include <stagingring.hpp>
 #include <support.hpp>
 #include <swapchain.hpp>
+#include <texturecache.hpp>
+#include <textureresidency.hpp>
+#include <texturestream.hpp>
+#include <threadpool.hpp>
 #include <triangle.hpp>
+#include <ubo.hpp>
 #include <utils.hpp>
 #include <vertex.hpp>
+#include <vertexformat.hpp>
+#include <vertexweld.hpp>
 
 using namespace vtuto;
 
@@ -31,6 +50,22 @@ public:
   uint32_t win_width = WIDTH;
   uint32_t win_height = HEIGHT;
 
+  /** device memory the textures may take, set before run() */
+  VkDeviceSize texture_budget = VkDeviceSize(256) << 20;
+
+  /**
+    print the picked triangles, set from the VTUTO_VERBOSE
+    environment variable by main()
+   */
+  bool verbose = false;
+
+  /**
+    file the capabilities of the device are written to, to
+    diff between machines, none if empty. main() takes it
+    from the VTUTO_DEVICE_CAPS environment variable
+   */
+  std::string device_capabilities_path;
+
   /** instance of the vulkan application */
   VkInstance instance;
 
@@ -43,6 +78,9 @@ public:
   /** logical device pointer */
   vulkan_device<VkDevice> logical_dev;
 
+  /** sub-allocates the memory of every buffer and image */
+  memory_allocator allocator;
+
   /** swapchain for handling frame rate*/
   swapchain swap_chain;
 
@@ -59,6 +97,11 @@ public:
   /** descriptor pool*/
   VkDescriptorPool descriptor_pool;
 
+  /**
+    one descriptor set per texture, material m draws with
+    descriptor_sets[material_textures[m]] and the uniforms
+    of the image at their dynamic offset
+   */
   std::vector<VkDescriptorSet> descriptor_sets;
 
   /** graphics pipeline layout*/
@@ -71,14 +114,47 @@ public:
   vk_command_pool command_pool;
   vulkan_buffers<VkCommandBuffer> cmd_buffers;
 
-  /** texture staging buffer */
-  VkBuffer staging_buffer;
-  VkDeviceMemory stage_buffer_memory;
-  VkImage texture_image;
-  VkDeviceMemory texture_image_memory;
+  /** command pool of the transfer queue family */
+  vk_command_pool transfer_pool;
+
+  /** staging memory of every upload, persistently mapped */
+  VkBuffer staging_ring_buffer;
+  MemoryAllocation staging_ring_memory;
+  staging_ring staging;
+
+  /**
+    textures of the model, one per distinct path, null until
+    they are resident
+   */
+  std::vector<VkImage> texture_images;
+  std::vector<MemoryAllocation> texture_image_memories;
+  /** format and mip levels of every texture */
+  std::vector<VkFormat> texture_formats;
+  std::vector<std::uint32_t> texture_mip_levels;
+
+  /** texture image views */
+  std::vector<VkImageView> texture_image_views;
 
-  /** texture image view */
-  VkImageView texture_image_view;
+  /** texture of every material, atlases after the others */
+  std::vector<std::size_t> material_textures;
+
+  /**
+    offset and scale of the texture coordinates of every
+    vertex into its atlas tile, empty without atlases. Only
+    kept until the vertex buffer is packed.
+   */
+  std::vector<glm::vec4> vertex_uv_transforms;
+
+  /** upload state of every texture */
+  std::vector<TextureStream> texture_streams;
+
+  /** levels of the textures kept within texture_budget */
+  texture_residency residency;
+
+  /** sampled by materials whose texture is not resident */
+  VkImage placeholder_image;
+  MemoryAllocation placeholder_image_memory;
+  VkImageView placeholder_image_view;
 
   /** texture sampler */
   VkSampler texture_sampler;
@@ -86,23 +162,99 @@ public:
   /** depth image related*/
   VkImage depth_image;
   VkImageView depth_image_view;
-  VkDeviceMemory depth_image_memory;
+  MemoryAllocation depth_image_memory;
 
   /** vertices per scene and indices per scene*/
   std::vector<Vertex> vertices;
   std::vector<std::uint32_t> indices;
 
-  /** vertex buffer*/
+  /**
+    16 bit copy of indices, used instead of it when the
+    model has at most 65536 vertices
+   */
+  std::vector<std::uint16_t> short_indices;
+
+  /** levels of detail stored one after the other in indices*/
+  std::vector<MeshLod> lods;
+
+  /** draw range of every level of detail and material */
+  std::vector<Submesh> submeshes;
+  std::vector<MeshMaterial> materials;
+
+  /** deduplication statistics of the loaded model */
+  VertexWeldStats vertex_weld_stats;
+
+  /** mapped binary cache of the model, if it was valid */
+  mesh_cache model_cache;
+
+  /** model space transform of the packed vertex positions */
+  VertexQuantization vertex_quantization;
+
+  /** vertex buffer, holds the ModelVertex streams*/
   VkBuffer vertex_buffer;
-  VkDeviceMemory vertex_buffer_memory;
+  /** offset of every vertex stream, in binding order */
+  std::vector<VkDeviceSize> vertex_buffer_offsets;
+  MemoryAllocation vertex_buffer_memory;
 
   /** index buffer*/
   VkBuffer index_buffer;
-  VkDeviceMemory index_buffer_memory;
+  MemoryAllocation index_buffer_memory;
 
-  /** uniform buffer*/
-  std::vector<VkBuffer> uniform_buffers;
-  std::vector<VkDeviceMemory> uniform_buffer_memories;
+  /** meshlets of the model and their device copy */
+  std::vector<Meshlet> meshlets;
+  std::vector<MeshletRange> submesh_meshlets;
+
+  /**
+    bounding spheres of the meshlets and of every submesh,
+    with the scratch lists of the spheres that survive
+    frustum culling
+   */
+  SphereSet meshlet_spheres;
+  SphereSet submesh_spheres;
+  std::vector<std::uint32_t> visible_meshlets;
+  std::vector<std::uint32_t> visible_submeshes;
+  VkBuffer meshlet_buffer;
+  MemoryAllocation meshlet_buffer_memory;
+
+  /**
+    indirect draws of the meshlets surviving culling, one host
+    visible buffer per swapchain image
+   */
+  std::vector<VkBuffer> draw_buffers;
+  std::vector<MemoryAllocation> draw_buffer_memories;
+
+  /**
+    draw buffer range of every material, large enough for
+    its meshlets at any level of detail
+   */
+  std::vector<DrawBatch> material_draws;
+  std::size_t draw_capacity = 0;
+
+  /** bounding sphere of the model, for picking the lod */
+  glm::vec3 model_center;
+  float model_radius = 0.0f;
+
+  /**
+    bvh over the triangles of the finest level, for picking,
+    and the model to clip space transform of the last frame
+   */
+  triangle_bvh model_bvh;
+  glm::mat4 clip_from_model = glm::mat4(1.0f);
+  /** hit of the last pick, empty if it missed */
+  std::optional<RayHit> last_pick;
+
+  /**
+    uniform buffer, a slice of uniform_stride bytes per
+    swapchain image bound as a dynamic uniform buffer
+   */
+  VkBuffer uniform_buffer;
+  MemoryAllocation uniform_buffer_memory;
+  VkDeviceSize uniform_stride = 0;
+  /**
+    uniforms of every swapchain image, mapped for the life
+    of the buffer. Written whole, never read back.
+   */
+  std::vector<UniformBufferObject *> uniform_data;
 
   /** vk semaphore to hold available and rendered images */
   std::vector<VkSemaphore> image_available_semaphores;
@@ -116,9 +268,24 @@ public:
   /** maximum frames in flight*/
   const int MAX_FRAMES_IN_FLIGHT = 2;
 
+  /**
+    size of the staging ring, buffers upload in chunks of
+    half of it and larger textures stage on their own
+   */
+  const VkDeviceSize staging_ring_size = 64 << 20;
+
   /** check framebuffer state*/
   bool framebuffer_resized = false;
 
+  /** worker threads for cpu side loading work */
+  thread_pool workers;
+
+  /**
+    background thread decoding the streamed textures, apart
+    from workers since a decode waits for jobs on them
+   */
+  thread_pool texture_loader{1};
+
 public:
   HelloTriangle() {}
   HelloTriangle(std::string wTitle, const uint32_t &w,
@@ -147,6 +314,20 @@ private:
         glfwGetWindowUserPointer(win));
     app->framebuffer_resized = true;
   }
+  /** left click picks the triangle under the cursor */
+  static void mouse_button_callback(GLFWwindow *win,
+                                    int button, int action,
+                                    int /*mods*/) {
+    if (button != GLFW_MOUSE_BUTTON_LEFT ||
+        action != GLFW_PRESS) {
+      return;
+    }
+    auto app = reinterpret_cast<HelloTriangle *>(
+        glfwGetWindowUserPointer(win));
+    double x, y;
+    glfwGetCursorPos(win, &x, &y);
+    app->pickTriangle(x, y);
+  }
   /**
     Initialize vulkan.
 
@@ -309,50 +490,87 @@ number of indices for given device family.
   void createDescriptorSetLayout();
   void createDescriptorPool();
   void createDescriptorSets();
+  void updateDescriptorSets();
   void createFramebuffers();
   uint32_t findMemoryType(uint32_t filter,
-                          VkMemoryPropertyFlags flags);
+                          VkMemoryPropertyFlags flags,
+                          VkMemoryPropertyFlags preferred = 0);
   VkFormat findSupportedFormat(
       const std::vector<VkFormat> &candidates,
       VkImageTiling tiling, VkFormatFeatureFlags features);
   VkFormat findDepthFormat();
+  VkFormat findTextureFormat(bool alpha);
   bool hasStencilSupport(VkFormat format);
   void loadModel();
+  MeshView modelMesh() const;
+  void createModelBvh();
+  void pickTriangle(double x, double y);
   void createVertexBuffer();
   void createIndexBuffer();
+  void createMeshletBuffer();
+  void createDrawBuffers();
+  void destroyDrawBuffers();
   void createUniformBuffer();
-  void copyBuffer(VkBuffer src, VkBuffer dst,
-                  VkDeviceSize size);
+  void createStagingRing();
+  void uploadBuffer(
+      VkBuffer dst, VkDeviceSize dst_offset, VkDeviceSize size,
+      VkDeviceSize element_size,
+      const std::function<void(void *, VkDeviceSize,
+                               VkDeviceSize)> &fill);
   void createBuffer(VkDeviceSize size,
                     VkBufferUsageFlags usage,
                     VkMemoryPropertyFlags mem_flags,
                     VkBuffer &buffer,
-                    VkDeviceMemory &buffer_memory);
+                    MemoryAllocation &buffer_memory,
+                    VkMemoryPropertyFlags preferred_flags = 0);
   void createCommandPool();
   void createCommandBuffers();
   void createSyncObjects();
   void recreateSwapchain();
   void createDepthRessources();
   void createTextureImage();
+  void createPlaceholderTexture();
+  std::vector<AtlasLayout>
+  packTextureAtlases(std::vector<std::string> &paths);
+  void decodeTexture(TextureStream &stream);
+  void *createStagingBuffer(TextureStream &stream,
+                            VkDeviceSize size);
+  void submitTextureUpload(TextureStream &stream);
+  void freeTextureUpload(TextureStream &stream);
+  void finishTextureUpload(std::size_t texture);
+  void destroyTexture(std::size_t texture);
+  void trimTexture(std::size_t texture, uint32_t first_level);
+  void updateTextureStreams();
+  void destroyTextureStreams();
+  bool supportsLinearBlit(VkFormat format);
+  void generateMipmaps(VkCommandBuffer cbuffer, VkImage image,
+                       const std::vector<MipLevel> &levels);
   void createTextureSampler();
   VkImageView
   createImageView(VkImage image, VkFormat image_format,
-                  VkImageAspectFlags aspect_flags);
-  void createTextureImageView();
+                  VkImageAspectFlags aspect_flags,
+                  uint32_t mip_levels = 1);
   void createImage(uint32_t imw, uint32_t imh,
                    VkFormat format, VkImageTiling tiling,
                    VkImageUsageFlags imusage,
                    VkMemoryPropertyFlags improps,
                    VkImage &vimage,
-                   VkDeviceMemory &vimage_memory);
+                   MemoryAllocation &vimage_memory,
+                   uint32_t mip_levels = 1);
   void updateUniformBuffer(uint32_t image_index);
   void draw();
   VkCommandBuffer beginSignalCommand();
   void endSignalCommand(VkCommandBuffer cbuffer);
   void transitionImageLayout(VkImage image, VkFormat format,
                              VkImageLayout old_layout,
-                             VkImageLayout new_layout);
+                             VkImageLayout new_layout,
+                             uint32_t mip_levels = 1);
   void copyBufferToImage(VkBuffer buffer, VkImage image,
-                         uint32_t width, uint32_t height);
+                         const std::vector<MipLevel> &levels,
+                         VkDeviceSize buffer_offset = 0);
+  void copyBufferToImage(VkCommandBuffer cbuffer,
+                         VkBuffer buffer, VkImage image,
+                         const std::vector<MipLevel> &levels,
+                         VkDeviceSize buffer_offset = 0);
 };
 }
@@ -21,6 +21,15 @@ public:
   /** window surface queue*/
   VkQueue present_queue;
 
+  /**
+    upload queue, the graphics queue when the device has no
+    transfer family
+   */
+  VkQueue transfer_queue;
+
+  /** families the queues are taken from */
+  QueuFamilyIndices families;
+
 public:
   vulkan_device() {}
   vulkan_device(
@@ -28,7 +37,9 @@ public:
       const vulkan_device<VkPhysicalDevice> &physical_dev) {
     QueuFamilyIndices indices =
         QueuFamilyIndices::find_family_indices(
-            physical_dev.pdevice, physical_dev.surface);
+            physical_dev.pdevice, physical_dev.surface,
+            physical_dev.capabilities.queue_families);
+    families = indices;
 
     /**
       VkDeviceQueueCreateInfo
@@ -38,6 +49,10 @@ public:
     std::set<uint32_t> uniqueQueueFamilies = {
         indices.graphics_family.value(),
         indices.present_family.value()};
+    if (indices.transfer_family.has_value()) {
+      uniqueQueueFamilies.insert(
+          indices.transfer_family.value());
+    }
 
     float queuePriority = 1.0f;
     for (uint32_t qfamily : uniqueQueueFamilies) {
@@ -53,6 +68,13 @@ public:
     //
     VkPhysicalDeviceFeatures deviceFeature{};
     deviceFeature.samplerAnisotropy = VK_TRUE;
+    // block compressed textures when the device samples them
+    deviceFeature.textureCompressionBC =
+        physical_dev.capabilities.features
+            .textureCompressionBC;
+    // a batch of indirect draws in one command
+    deviceFeature.multiDrawIndirect =
+        physical_dev.capabilities.features.multiDrawIndirect;
 
     //
     VkDeviceCreateInfo createInfo{};
@@ -90,6 +112,21 @@ public:
     vkGetDeviceQueue(ldevice,
                      indices.present_family.value(), 0,
                      &present_queue);
+    transfer_queue = graphics_queue;
+    if (indices.transfer_family.has_value()) {
+      vkGetDeviceQueue(ldevice,
+                       indices.transfer_family.value(), 0,
+                       &transfer_queue);
+    }
+  }
+  /** whether uploads have their own queue family */
+  bool has_transfer_queue() const {
+    return families.transfer_family.has_value();
+  }
+  /** family of transfer_queue */
+  uint32_t transfer_family() const {
+    return families.transfer_family.value_or(
+        families.graphics_family.value());
   }
   void destroy() { vkDestroyDevice(ldevice, nullptr); }
   VkDevice device() { return ldevice; }
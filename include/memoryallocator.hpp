@@ -0,0 +1,328 @@
+// sub-allocation of device memory from large blocks
+#pragma once
+#include <devicecaps.hpp>
+#include <external.hpp>
+#include <mutex>
+#include <set>
+#include <utils.hpp>
+
+namespace vtuto {
+
+/** range of a memory block bound to a buffer or an image */
+struct MemoryAllocation {
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  VkDeviceSize offset = 0;
+  /** size of the range, a power of two unless dedicated */
+  VkDeviceSize size = 0;
+  /** host address of the range in host visible memory */
+  void *data = nullptr;
+  /** pool and block the range was taken from */
+  std::uint32_t pool = 0;
+  std::uint32_t block = 0;
+  /** the range is a memory allocation of its own */
+  bool dedicated = false;
+};
+
+/** usage of a memory heap */
+struct MemoryHeapStats {
+  VkDeviceSize heap_size = 0;
+  /** device memory allocations, blocks and dedicated ones */
+  std::size_t block_count = 0;
+  VkDeviceSize block_bytes = 0;
+  std::size_t allocation_count = 0;
+  /** bytes of the ranges handed out */
+  VkDeviceSize used_bytes = 0;
+  VkDeviceSize peak_bytes = 0;
+};
+
+inline std::ostream &operator<<(std::ostream &out,
+                                const MemoryHeapStats &s) {
+  return out << s.block_count << " blocks of "
+             << (s.block_bytes >> 10) << " KiB in "
+             << (s.heap_size >> 20) << " MiB, "
+             << s.allocation_count << " allocations using "
+             << (s.used_bytes >> 10) << " KiB, peak "
+             << (s.peak_bytes >> 10) << " KiB";
+}
+
+/**
+  Buddy allocator of device memory.
+
+  Every memory type has a pool of blocks allocated from the
+  device, mapped once when host visible. A block is split in
+  halves down to the power of two range that holds a
+  resource, which keeps the range aligned to its size, and a
+  freed range merges with its free buddy. Resources larger
+  than a block get a memory allocation of their own.
+
+  When bufferImageGranularity exceeds the smallest range,
+  linear and optimal resources take blocks of different
+  pools so they never share a page. An empty block is given
+  back unless it is the last of its pool. The allocator is
+  shared with the texture loader thread and locks.
+ */
+class memory_allocator {
+  struct Block {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    std::uint8_t *data = nullptr;
+    /** offsets of the free ranges of every order */
+    std::vector<std::set<VkDeviceSize>> free_ranges;
+    std::size_t allocation_count = 0;
+  };
+  struct Pool {
+    std::uint32_t type = 0;
+    /** ranges of order k are min_range << k bytes */
+    std::uint32_t order_count = 0;
+    /** released blocks keep their slot with a null memory */
+    std::vector<Block> blocks;
+  };
+  VkDevice device = VK_NULL_HANDLE;
+  VkPhysicalDeviceMemoryProperties properties{};
+  bool split_linear = false;
+  std::vector<Pool> pools;
+  std::vector<MemoryHeapStats> heaps;
+  std::mutex mutex;
+
+public:
+  /** smallest range handed out */
+  static const VkDeviceSize min_range = 256;
+
+  /**
+    \param block_size largest block, a power of two. Blocks
+    of small heaps take an eighth of the heap.
+   */
+  void init(const DeviceCapabilities &capabilities,
+            VkDevice logical_device,
+            VkDeviceSize block_size = VkDeviceSize(64) << 20) {
+    device = logical_device;
+    properties = capabilities.memory;
+    split_linear =
+        capabilities.limits().bufferImageGranularity >
+        min_range;
+
+    heaps.assign(properties.memoryHeapCount,
+                 MemoryHeapStats{});
+    for (uint32_t h = 0; h < properties.memoryHeapCount;
+         h++) {
+      heaps[h].heap_size = properties.memoryHeaps[h].size;
+    }
+    // a linear and an optimal pool per memory type
+    pools.assign(properties.memoryTypeCount * 2, Pool{});
+    for (uint32_t t = 0; t < properties.memoryTypeCount;
+         t++) {
+      uint32_t heap = properties.memoryTypes[t].heapIndex;
+      VkDeviceSize size = std::min(
+          block_size, properties.memoryHeaps[heap].size / 8);
+      uint32_t orders = 1;
+      while ((min_range << orders) <= size) {
+        orders++;
+      }
+      pools[2 * t].type = pools[2 * t + 1].type = t;
+      pools[2 * t].order_count =
+          pools[2 * t + 1].order_count = orders;
+    }
+  }
+
+  /**
+    Take a range of memory type for a resource.
+    \param linear a buffer or a linear image.
+   */
+  MemoryAllocation allocate(const VkMemoryRequirements &req,
+                            uint32_t type, bool linear) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Pool &pool = pools[2 * type + (split_linear && !linear)];
+    VkDeviceSize size = std::max(req.size, req.alignment);
+    uint32_t order = 0;
+    while ((min_range << order) < size) {
+      order++;
+    }
+    if (order >= pool.order_count) {
+      return allocateDedicated(req.size, type);
+    }
+
+    // 1. the block with the smallest free range that fits
+    std::size_t best = pool.blocks.size();
+    uint32_t best_order = pool.order_count;
+    for (std::size_t b = 0; b < pool.blocks.size(); b++) {
+      const Block &block = pool.blocks[b];
+      for (uint32_t k = order;
+           block.memory != VK_NULL_HANDLE && k < best_order;
+           k++) {
+        if (!block.free_ranges[k].empty()) {
+          best = b;
+          best_order = k;
+        }
+      }
+    }
+    if (best == pool.blocks.size()) {
+      best = createBlock(pool);
+      best_order = pool.order_count - 1;
+    }
+
+    // 2. split it down to the order of the resource
+    Block &block = pool.blocks[best];
+    auto first = block.free_ranges[best_order].begin();
+    VkDeviceSize offset = *first;
+    block.free_ranges[best_order].erase(first);
+    for (uint32_t k = best_order; k > order; k--) {
+      block.free_ranges[k - 1].insert(offset +
+                                      (min_range << (k - 1)));
+    }
+    block.allocation_count++;
+
+    MemoryAllocation allocation;
+    allocation.memory = block.memory;
+    allocation.offset = offset;
+    allocation.size = min_range << order;
+    allocation.data =
+        block.data ? block.data + offset : nullptr;
+    allocation.pool = static_cast<uint32_t>(&pool - &pools[0]);
+    allocation.block = static_cast<uint32_t>(best);
+    count(type, allocation.size, true);
+    return allocation;
+  }
+
+  /** give a range back, null ranges are ignored */
+  void free(MemoryAllocation &allocation) {
+    if (allocation.memory == VK_NULL_HANDLE) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    Pool &pool = pools[allocation.pool];
+    count(pool.type, allocation.size, false);
+    if (allocation.dedicated) {
+      vkFreeMemory(device, allocation.memory, nullptr);
+      release(pool.type, allocation.size);
+      allocation = MemoryAllocation{};
+      return;
+    }
+
+    // merge with the free buddies
+    Block &block = pool.blocks[allocation.block];
+    VkDeviceSize offset = allocation.offset;
+    uint32_t order = 0;
+    while ((min_range << order) < allocation.size) {
+      order++;
+    }
+    for (; order + 1 < pool.order_count; order++) {
+      auto buddy = block.free_ranges[order].find(
+          offset ^ (min_range << order));
+      if (buddy == block.free_ranges[order].end()) {
+        break;
+      }
+      block.free_ranges[order].erase(buddy);
+      offset &= ~(min_range << order);
+    }
+    block.free_ranges[order].insert(offset);
+    allocation = MemoryAllocation{};
+
+    // the last block of a pool is kept for the next one
+    if (--block.allocation_count == 0) {
+      std::size_t live = 0;
+      for (const Block &b : pool.blocks) {
+        live += b.memory != VK_NULL_HANDLE;
+      }
+      if (live > 1) {
+        vkFreeMemory(device, block.memory, nullptr);
+        release(pool.type, min_range
+                               << (pool.order_count - 1));
+        block = Block{};
+      }
+    }
+  }
+
+  /** free the blocks, the resources are destroyed */
+  void destroy() {
+    for (Pool &pool : pools) {
+      for (Block &block : pool.blocks) {
+        if (block.memory != VK_NULL_HANDLE) {
+          vkFreeMemory(device, block.memory, nullptr);
+        }
+      }
+      pool.blocks.clear();
+    }
+  }
+
+  std::vector<MemoryHeapStats> stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return heaps;
+  }
+
+private:
+  std::size_t createBlock(Pool &pool) {
+    VkDeviceSize size = min_range << (pool.order_count - 1);
+    Block block;
+    block.memory = allocateMemory(size, pool.type, block.data);
+    block.free_ranges.resize(pool.order_count);
+    block.free_ranges.back().insert(0);
+    // reuse the slot of a released block
+    for (std::size_t b = 0; b < pool.blocks.size(); b++) {
+      if (pool.blocks[b].memory == VK_NULL_HANDLE) {
+        pool.blocks[b] = std::move(block);
+        return b;
+      }
+    }
+    pool.blocks.push_back(std::move(block));
+    return pool.blocks.size() - 1;
+  }
+  MemoryAllocation allocateDedicated(VkDeviceSize size,
+                                     uint32_t type) {
+    MemoryAllocation allocation;
+    std::uint8_t *data;
+    allocation.memory = allocateMemory(size, type, data);
+    allocation.size = size;
+    allocation.data = data;
+    allocation.pool = 2 * type;
+    allocation.dedicated = true;
+    count(type, size, true);
+    return allocation;
+  }
+  /** allocate and map device memory, counted in its heap */
+  VkDeviceMemory allocateMemory(VkDeviceSize size,
+                                uint32_t type,
+                                std::uint8_t *&data) {
+    VkMemoryAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = type;
+    VkDeviceMemory memory;
+    CHECK_VK(
+        vkAllocateMemory(device, &allocInfo, nullptr, &memory),
+        "failed to allocate memory from logical device");
+    data = nullptr;
+    if (properties.memoryTypes[type].propertyFlags &
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+      void *mapped;
+      CHECK_VK(vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0,
+                           &mapped),
+               "failed to map memory block");
+      data = static_cast<std::uint8_t *>(mapped);
+    }
+    MemoryHeapStats &heap =
+        heaps[properties.memoryTypes[type].heapIndex];
+    heap.block_count++;
+    heap.block_bytes += size;
+    return memory;
+  }
+  void release(uint32_t type, VkDeviceSize size) {
+    MemoryHeapStats &heap =
+        heaps[properties.memoryTypes[type].heapIndex];
+    heap.block_count--;
+    heap.block_bytes -= size;
+  }
+  /** count a range taken or given back */
+  void count(uint32_t type, VkDeviceSize size, bool taken) {
+    MemoryHeapStats &heap =
+        heaps[properties.memoryTypes[type].heapIndex];
+    if (taken) {
+      heap.allocation_count++;
+      heap.used_bytes += size;
+    } else {
+      heap.allocation_count--;
+      heap.used_bytes -= size;
+    }
+    heap.peak_bytes =
+        std::max(heap.peak_bytes, heap.used_bytes);
+  }
+};
+}
@@ -0,0 +1,491 @@
+// memory mapped binary cache of loaded meshes
+#pragma once
+#include <cstring>
+#include <external.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vertex.hpp>
+
+namespace vtuto {
+
+/**
+  Level of detail of a mesh: a range of the shared index
+  buffer and its simplification error in model units.
+ */
+struct MeshLod {
+  std::uint32_t first_index;
+  std::uint32_t index_count;
+  float error;
+};
+
+/**
+  Range of the index buffer drawn with one material. Shapes
+  that share a material are merged into one range.
+ */
+struct Submesh {
+  std::uint32_t first_index;
+  std::uint32_t index_count;
+  std::uint32_t material;
+};
+
+/**
+  Material of a mesh. The diffuse texture path is stored
+  inline so that the material table can be mapped like the
+  other arrays; an empty path selects the default texture.
+ */
+struct MeshMaterial {
+  char texture[256];
+};
+
+inline MeshMaterial make_material(const std::string &texture) {
+  MeshMaterial material{};
+  if (texture.size() >= sizeof(material.texture)) {
+    throw std::runtime_error("texture path is too long: " +
+                             texture);
+  }
+  std::memcpy(material.texture, texture.data(),
+              texture.size());
+  return material;
+}
+
+/** non owning view of mesh data ready for upload */
+struct MeshView {
+  const Vertex *vertices = nullptr;
+  std::size_t vertex_count = 0;
+  /** 16 or 32 bit indices, as given by index_type */
+  const void *indices = nullptr;
+  std::size_t index_count = 0;
+  VkIndexType index_type = VK_INDEX_TYPE_UINT32;
+
+  /** levels of detail, finest first */
+  const MeshLod *lods = nullptr;
+  std::size_t lod_count = 0;
+
+  /**
+    draw ranges sorted by material, level of detail l draws
+    material m with submeshes[l * material_count + m]
+   */
+  const Submesh *submeshes = nullptr;
+  std::size_t submesh_count = 0;
+  const MeshMaterial *materials = nullptr;
+  std::size_t material_count = 0;
+
+  std::size_t index_size() const {
+    return index_type == VK_INDEX_TYPE_UINT16
+               ? sizeof(std::uint16_t)
+               : sizeof(std::uint32_t);
+  }
+  VkDeviceSize vertex_bytes() const {
+    return static_cast<VkDeviceSize>(vertex_count *
+                                     sizeof(Vertex));
+  }
+  VkDeviceSize index_bytes() const {
+    return static_cast<VkDeviceSize>(index_count *
+                                     index_size());
+  }
+};
+
+/**
+  Header of a mesh cache file.
+
+  The source path follows the header, the vertex and index
+  arrays follow at the given offsets, then the tables of
+  levels of detail, submeshes and materials. The index stride is 2 or 4 bytes, as
+  chosen when the model was loaded. A cache file is only
+  used if every key field matches the source file and the
+  layout of the running binary.
+ */
+struct MeshCacheHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t vertex_stride;
+  std::uint32_t index_stride;
+  std::uint32_t path_length;
+  std::uint64_t source_size;
+  std::int64_t source_mtime_ns;
+  std::uint64_t vertex_count;
+  std::uint64_t index_count;
+  std::uint64_t vertex_offset;
+  std::uint64_t index_offset;
+  std::uint64_t lod_count;
+  std::uint64_t lod_offset;
+  std::uint64_t submesh_count;
+  std::uint64_t submesh_offset;
+  std::uint64_t material_count;
+  std::uint64_t material_offset;
+};
+
+/** read only memory mapping of a whole file */
+class mapped_file {
+  int fd = -1;
+  void *ptr = nullptr;
+  std::size_t length = 0;
+
+public:
+  mapped_file() {}
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+  ~mapped_file() { close(); }
+
+  /** map the file, returns false if it can not be mapped */
+  bool open(const std::string &path) {
+    close();
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+      close();
+      return false;
+    }
+    length = static_cast<std::size_t>(st.st_size);
+    ptr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED) {
+      ptr = nullptr;
+      close();
+      return false;
+    }
+    madvise(ptr, length, MADV_WILLNEED);
+    return true;
+  }
+  void close() {
+    if (ptr != nullptr) {
+      munmap(ptr, length);
+      ptr = nullptr;
+    }
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+    length = 0;
+  }
+  bool is_open() const { return ptr != nullptr; }
+  const char *data() const {
+    return static_cast<const char *>(ptr);
+  }
+  std::size_t size() const { return length; }
+};
+
+/**
+  Binary cache of a parsed model.
+
+  The cache file lives next to the source model. It is keyed
+  by the source path, size and modification time, and by the
+  vertex layout, so editing the model or changing Vertex
+  invalidates it. A valid cache is memory mapped and its
+  arrays are handed out as a MeshView, which lets the buffer
+  creation copy straight from the page cache into the staging
+  memory without parsing anything.
+ */
+class mesh_cache {
+  static constexpr std::uint32_t format_version = 6;
+  static constexpr std::uint64_t data_alignment = 16;
+
+  mapped_file file;
+  MeshView view;
+
+public:
+  static std::string cache_path(const std::string &source) {
+    return source + ".vtmesh";
+  }
+
+  /**
+    Map the cache of the given source model.
+
+    \return false if there is no cache or if it is stale.
+   */
+  bool open(const std::string &source) {
+    close();
+    MeshCacheHeader expected{};
+    if (!make_header(source, MeshView{}, expected)) {
+      return false;
+    }
+    if (!file.open(cache_path(source))) {
+      return false;
+    }
+    MeshCacheHeader header;
+    if (file.size() < sizeof(header)) {
+      close();
+      return false;
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    bool matches =
+        std::memcmp(header.magic, expected.magic,
+                    sizeof(header.magic)) == 0 &&
+        header.version == expected.version &&
+        header.vertex_stride == expected.vertex_stride &&
+        (header.index_stride == sizeof(std::uint16_t) ||
+         header.index_stride == sizeof(std::uint32_t)) &&
+        header.path_length == expected.path_length &&
+        header.source_size == expected.source_size &&
+        header.source_mtime_ns == expected.source_mtime_ns &&
+        sizeof(header) + header.path_length <= file.size() &&
+        std::memcmp(file.data() + sizeof(header),
+                    source.data(), source.size()) == 0;
+    std::uint64_t vertex_end =
+        header.vertex_offset +
+        header.vertex_count * header.vertex_stride;
+    std::uint64_t index_end =
+        header.index_offset +
+        header.index_count * header.index_stride;
+    std::uint64_t lod_end =
+        header.lod_offset + header.lod_count * sizeof(MeshLod);
+    std::uint64_t submesh_end =
+        header.submesh_offset +
+        header.submesh_count * sizeof(Submesh);
+    std::uint64_t material_end =
+        header.material_offset +
+        header.material_count * sizeof(MeshMaterial);
+    if (!matches || vertex_end > file.size() ||
+        index_end > file.size() || lod_end > file.size() ||
+        submesh_end > file.size() ||
+        material_end > file.size() ||
+        header.submesh_count !=
+            header.lod_count * header.material_count) {
+      close();
+      return false;
+    }
+    view.vertices = reinterpret_cast<const Vertex *>(
+        file.data() + header.vertex_offset);
+    view.vertex_count = header.vertex_count;
+    view.indices = file.data() + header.index_offset;
+    view.index_count = header.index_count;
+    view.index_type = header.index_stride == sizeof(std::uint16_t)
+                          ? VK_INDEX_TYPE_UINT16
+                          : VK_INDEX_TYPE_UINT32;
+    view.lods = reinterpret_cast<const MeshLod *>(
+        file.data() + header.lod_offset);
+    view.lod_count = header.lod_count;
+    view.submeshes = reinterpret_cast<const Submesh *>(
+        file.data() + header.submesh_offset);
+    view.submesh_count = header.submesh_count;
+    view.materials = reinterpret_cast<const MeshMaterial *>(
+        file.data() + header.material_offset);
+    view.material_count = header.material_count;
+    return true;
+  }
+  void close() {
+    file.close();
+    view = MeshView{};
+  }
+  bool is_open() const { return file.is_open(); }
+  MeshView mesh() const { return view; }
+
+  /**
+    Write the cache of the given source model.
+
+    The file is written under a temporary name and renamed,
+    so a reader never maps a half written cache.
+   */
+  static void write(const std::string &source,
+                    const MeshView &mesh) {
+    MeshCacheHeader header{};
+    if (!make_header(source, mesh, header)) {
+      throw std::runtime_error(
+          "mesh cache: can not stat source " + source);
+    }
+    std::string tmp_path = cache_path(source) + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary);
+    if (!out.is_open()) {
+      throw std::runtime_error(
+          "mesh cache: can not open " + tmp_path);
+    }
+    out.write(reinterpret_cast<const char *>(&header),
+              sizeof(header));
+    out.write(source.data(),
+              static_cast<std::streamsize>(source.size()));
+    pad_to(out, header.vertex_offset);
+    out.write(reinterpret_cast<const char *>(mesh.vertices),
+              static_cast<std::streamsize>(mesh.vertex_bytes()));
+    pad_to(out, header.index_offset);
+    out.write(reinterpret_cast<const char *>(mesh.indices),
+              static_cast<std::streamsize>(mesh.index_bytes()));
+    pad_to(out, header.lod_offset);
+    out.write(reinterpret_cast<const char *>(mesh.lods),
+              static_cast<std::streamsize>(mesh.lod_count *
+                                           sizeof(MeshLod)));
+    pad_to(out, header.submesh_offset);
+    out.write(reinterpret_cast<const char *>(mesh.submeshes),
+              static_cast<std::streamsize>(mesh.submesh_count *
+                                           sizeof(Submesh)));
+    pad_to(out, header.material_offset);
+    out.write(
+        reinterpret_cast<const char *>(mesh.materials),
+        static_cast<std::streamsize>(mesh.material_count *
+                                     sizeof(MeshMaterial)));
+    out.close();
+    if (!out) {
+      std::remove(tmp_path.c_str());
+      throw std::runtime_error(
+          "mesh cache: failed to write " + tmp_path);
+    }
+    if (std::rename(tmp_path.c_str(),
+                    cache_path(source).c_str()) != 0) {
+      std::remove(tmp_path.c_str());
+      throw std::runtime_error(
+          "mesh cache: failed to rename " + tmp_path);
+    }
+  }
+
+  /**
+    Incremental cache writer for models that do not fit in
+    memory.
+
+    Indices are appended while the model is parsed and go
+    straight to disk, in front of the vertices. The vertices
+    and a single level of detail drawn with the default
+    texture are written by finish(), which also fills in the
+    header and renames the file.
+   */
+  class stream_writer {
+    std::string source;
+    std::string tmp_path;
+    std::ofstream out;
+    MeshCacheHeader header{};
+
+  public:
+    explicit stream_writer(const std::string &src)
+        : source(src), tmp_path(cache_path(src) + ".tmp") {
+      if (!make_header(source, MeshView{}, header)) {
+        throw std::runtime_error(
+            "mesh cache: can not stat source " + source);
+      }
+      out.open(tmp_path, std::ios::binary);
+      if (!out.is_open()) {
+        throw std::runtime_error(
+            "mesh cache: can not open " + tmp_path);
+      }
+      // the header is rewritten once the counts are known
+      out.write(reinterpret_cast<const char *>(&header),
+                sizeof(header));
+      out.write(source.data(),
+                static_cast<std::streamsize>(source.size()));
+      header.index_offset =
+          align_up(sizeof(header) + header.path_length);
+      pad_to(out, header.index_offset);
+    }
+    stream_writer(const stream_writer &) = delete;
+    stream_writer &operator=(const stream_writer &) = delete;
+    ~stream_writer() {
+      if (out.is_open()) {
+        out.close();
+        std::remove(tmp_path.c_str());
+      }
+    }
+
+    void append_indices(const std::uint32_t *indices,
+                        std::size_t count) {
+      out.write(reinterpret_cast<const char *>(indices),
+                static_cast<std::streamsize>(
+                    count * sizeof(std::uint32_t)));
+      header.index_count += count;
+    }
+    void finish(const std::vector<Vertex> &vertices) {
+      // draw ranges count their indices in 32 bits
+      if (header.index_count > UINT32_MAX) {
+        throw std::runtime_error(
+            "mesh cache: too many indices for a draw range");
+      }
+      header.vertex_count = vertices.size();
+      header.vertex_offset = align_up(
+          header.index_offset +
+          header.index_count * sizeof(std::uint32_t));
+      pad_to(out, header.vertex_offset);
+      out.write(reinterpret_cast<const char *>(vertices.data()),
+                static_cast<std::streamsize>(vertices.size() *
+                                             sizeof(Vertex)));
+      MeshLod lod{0,
+                  static_cast<std::uint32_t>(header.index_count),
+                  0.0f};
+      header.lod_count = 1;
+      header.lod_offset =
+          align_up(header.vertex_offset +
+                   header.vertex_count * sizeof(Vertex));
+      pad_to(out, header.lod_offset);
+      out.write(reinterpret_cast<const char *>(&lod),
+                sizeof(lod));
+      Submesh submesh{0, lod.index_count, 0};
+      header.submesh_count = 1;
+      header.submesh_offset =
+          align_up(header.lod_offset + sizeof(lod));
+      pad_to(out, header.submesh_offset);
+      out.write(reinterpret_cast<const char *>(&submesh),
+                sizeof(submesh));
+      MeshMaterial material{};
+      header.material_count = 1;
+      header.material_offset =
+          align_up(header.submesh_offset + sizeof(submesh));
+      pad_to(out, header.material_offset);
+      out.write(reinterpret_cast<const char *>(&material),
+                sizeof(material));
+      out.seekp(0);
+      out.write(reinterpret_cast<const char *>(&header),
+                sizeof(header));
+      out.close();
+      if (!out) {
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error(
+            "mesh cache: failed to write " + tmp_path);
+      }
+      if (std::rename(tmp_path.c_str(),
+                      cache_path(source).c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error(
+            "mesh cache: failed to rename " + tmp_path);
+      }
+    }
+  };
+
+private:
+  static std::uint64_t align_up(std::uint64_t v) {
+    return (v + data_alignment - 1) & ~(data_alignment - 1);
+  }
+  static void pad_to(std::ofstream &out,
+                     std::uint64_t offset) {
+    while (static_cast<std::uint64_t>(out.tellp()) < offset) {
+      out.put('\0');
+    }
+  }
+  static bool make_header(const std::string &source,
+                          const MeshView &mesh,
+                          MeshCacheHeader &header) {
+    struct stat st;
+    if (stat(source.c_str(), &st) != 0) {
+      return false;
+    }
+    std::memcpy(header.magic, "VTMESH\0\0",
+                sizeof(header.magic));
+    header.version = format_version;
+    header.vertex_stride = sizeof(Vertex);
+    header.index_stride =
+        static_cast<std::uint32_t>(mesh.index_size());
+    header.path_length =
+        static_cast<std::uint32_t>(source.size());
+    header.source_size = static_cast<std::uint64_t>(st.st_size);
+    header.source_mtime_ns =
+        static_cast<std::int64_t>(st.st_mtim.tv_sec) *
+            1000000000 +
+        st.st_mtim.tv_nsec;
+    header.vertex_count = mesh.vertex_count;
+    header.index_count = mesh.index_count;
+    header.lod_count = mesh.lod_count;
+    header.vertex_offset =
+        align_up(sizeof(header) + header.path_length);
+    header.index_offset = align_up(
+        header.vertex_offset + mesh.vertex_bytes());
+    header.lod_offset =
+        align_up(header.index_offset + mesh.index_bytes());
+    header.submesh_count = mesh.submesh_count;
+    header.submesh_offset = align_up(
+        header.lod_offset + mesh.lod_count * sizeof(MeshLod));
+    header.material_count = mesh.material_count;
+    header.material_offset =
+        align_up(header.submesh_offset +
+                 mesh.submesh_count * sizeof(Submesh));
+    return true;
+  }
+};
+}
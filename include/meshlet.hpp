@@ -0,0 +1,256 @@
+// meshlet clustering and per meshlet culling
+#pragma once
+#include <external.hpp>
+#include <frustum.hpp>
+#include <meshcache.hpp>
+#include <vertex.hpp>
+
+namespace vtuto {
+
+/** meshlet limits, chosen to fit mesh shader workgroups */
+const std::size_t meshlet_max_vertices = 64;
+const std::size_t meshlet_max_triangles = 124;
+
+/**
+  A cluster of consecutive triangles of the index buffer with
+  its culling data. The layout follows std430, so the array
+  can be read as is from a storage buffer.
+ */
+struct Meshlet {
+  /** bounding sphere in model space */
+  glm::vec3 center;
+  float radius;
+
+  /**
+    normal cone: the meshlet is back facing for every camera
+    position p with
+    dot(center - p, cone_axis) >= cone_cutoff *
+    length(center - p) + radius
+   */
+  glm::vec3 cone_axis;
+  float cone_cutoff;
+
+  /** triangle range in the index buffer */
+  std::uint32_t first_index;
+  std::uint32_t index_count;
+  std::uint32_t vertex_count;
+  std::uint32_t padding;
+};
+
+/** meshlets of one draw range */
+struct MeshletRange {
+  std::uint32_t first;
+  std::uint32_t count;
+};
+
+namespace detail {
+/**
+  \param owner meshlet that last used a vertex, to count
+  unique ones. Meshlet ids only grow, so it is shared by all
+  the ranges of a mesh.
+ */
+template <class Index>
+void build_meshlets(const Vertex *vertices,
+                    const Index *indices, std::size_t begin,
+                    std::size_t end,
+                    std::vector<std::uint32_t> &owner,
+                    std::vector<Meshlet> &meshlets) {
+  std::vector<std::uint32_t> used;
+  used.reserve(meshlet_max_vertices);
+  std::size_t first = begin;
+
+  auto finish = [&](std::size_t stop) {
+    Meshlet m{};
+    m.first_index = static_cast<std::uint32_t>(first);
+    m.index_count = static_cast<std::uint32_t>(stop - first);
+    m.vertex_count = static_cast<std::uint32_t>(used.size());
+
+    // 1. sphere around the bounding box center
+    glm::vec3 lo = vertices[used[0]].pos;
+    glm::vec3 hi = lo;
+    for (std::uint32_t v : used) {
+      lo = glm::min(lo, vertices[v].pos);
+      hi = glm::max(hi, vertices[v].pos);
+    }
+    m.center = (lo + hi) * 0.5f;
+    for (std::uint32_t v : used) {
+      m.radius = std::max(
+          m.radius, glm::distance(m.center, vertices[v].pos));
+    }
+
+    // 2. cone around the mean triangle normal
+    std::vector<glm::vec3> normals;
+    glm::vec3 axis(0.0f);
+    for (std::size_t i = first; i < stop; i += 3) {
+      glm::vec3 a = vertices[indices[i]].pos;
+      glm::vec3 b = vertices[indices[i + 1]].pos;
+      glm::vec3 c = vertices[indices[i + 2]].pos;
+      glm::vec3 n = glm::cross(b - a, c - a);
+      float len = glm::length(n);
+      if (len > 0.0f) {
+        normals.push_back(n / len);
+        axis += n / len;
+      }
+    }
+    float axis_len = glm::length(axis);
+    float min_dot = 1.0f;
+    if (axis_len > 0.0f) {
+      axis /= axis_len;
+      for (const auto &n : normals) {
+        min_dot = std::min(min_dot, glm::dot(axis, n));
+      }
+    }
+    m.cone_axis = axis;
+    // a cone wider than ~84 degrees is never back facing
+    m.cone_cutoff = axis_len == 0.0f || min_dot <= 0.1f
+                        ? 1.0f
+                        : std::sqrt(1.0f - min_dot * min_dot);
+    meshlets.push_back(m);
+    used.clear();
+    first = stop;
+  };
+
+  for (std::size_t i = begin; i + 2 < end; i += 3) {
+    auto id = static_cast<std::uint32_t>(meshlets.size());
+    std::size_t added = 0;
+    for (std::size_t k = 0; k < 3; k++) {
+      added += owner[indices[i + k]] != id ? 1 : 0;
+    }
+    if (used.size() + added > meshlet_max_vertices ||
+        (i - first) / 3 == meshlet_max_triangles) {
+      finish(i);
+      id++;
+    }
+    for (std::size_t k = 0; k < 3; k++) {
+      std::uint32_t v = indices[i + k];
+      if (owner[v] != id) {
+        owner[v] = id;
+        used.push_back(v);
+      }
+    }
+  }
+  if (!used.empty()) {
+    finish(end - (end - begin) % 3);
+  }
+}
+}
+
+/**
+  Split the index buffer of a mesh into meshlets.
+
+  Every draw range is split on its own and gets its range of
+  meshlets in range_meshlets, in the order of the submesh
+  table; a mesh without submeshes is split per level of
+  detail, and a mesh without levels as a single range.
+  Triangles are taken greedily in index buffer order, so the
+  meshlets are consecutive index ranges, the post transform
+  cache order is kept and no index is rewritten.
+ */
+inline std::vector<Meshlet>
+build_meshlets(const MeshView &mesh,
+               std::vector<MeshletRange> &range_meshlets) {
+  std::vector<Meshlet> meshlets;
+  range_meshlets.clear();
+  std::vector<Submesh> ranges(mesh.submeshes,
+                              mesh.submeshes + mesh.submesh_count);
+  if (ranges.empty()) {
+    for (std::size_t l = 0; l < mesh.lod_count; l++) {
+      ranges.push_back(
+          {mesh.lods[l].first_index, mesh.lods[l].index_count, 0});
+    }
+  }
+  if (ranges.empty()) {
+    ranges.push_back(
+        {0, static_cast<std::uint32_t>(mesh.index_count), 0});
+  }
+  std::vector<std::uint32_t> owner(mesh.vertex_count,
+                                   UINT32_MAX);
+  for (const auto &range : ranges) {
+    std::size_t begin = range.first_index;
+    std::size_t end = begin + range.index_count;
+    auto first = static_cast<std::uint32_t>(meshlets.size());
+    if (mesh.index_type == VK_INDEX_TYPE_UINT16) {
+      detail::build_meshlets(
+          mesh.vertices,
+          static_cast<const std::uint16_t *>(mesh.indices),
+          begin, end, owner, meshlets);
+    } else {
+      detail::build_meshlets(
+          mesh.vertices,
+          static_cast<const std::uint32_t *>(mesh.indices),
+          begin, end, owner, meshlets);
+    }
+    range_meshlets.push_back(
+        {first, static_cast<std::uint32_t>(meshlets.size()) -
+                    first});
+  }
+  return meshlets;
+}
+
+/** bounding spheres of the meshlets, for cull_meshlets() */
+inline SphereSet
+meshlet_bounds(const std::vector<Meshlet> &meshlets) {
+  SphereSet bounds;
+  for (const auto &m : meshlets) {
+    bounds.push_back(m.center, m.radius);
+  }
+  return bounds;
+}
+
+/**
+  Cull meshlets against the frustum and their normal cones.
+
+  Only the meshlets of the given range are considered. The
+  frustum test runs in batches over the bounding spheres and
+  only the survivors get the cone test. Surviving meshlets
+  that are adjacent in the index buffer are merged into one
+  draw. All draw_capacity commands are written, unused ones
+  draw nothing.
+
+  \param camera camera position in model space.
+
+  \param visible scratch space, kept between calls to avoid
+  reallocating it every frame.
+
+  \return number of visible meshlets.
+ */
+inline std::size_t
+cull_meshlets(const std::vector<Meshlet> &meshlets,
+              const SphereSet &bounds, MeshletRange range,
+              const Frustum &frustum, glm::vec3 camera,
+              std::vector<std::uint32_t> &visible,
+              VkDrawIndexedIndirectCommand *draws,
+              std::size_t draw_capacity) {
+  visible.resize(std::max<std::size_t>(visible.size(),
+                                       range.count));
+  std::size_t candidate_count =
+      cull_spheres(frustum, bounds, range.first, range.count,
+                   visible.data());
+  std::size_t visible_count = 0;
+  std::size_t draw_count = 0;
+  for (std::size_t c = 0; c < candidate_count; c++) {
+    const Meshlet &m = meshlets[visible[c]];
+    glm::vec3 to_center = m.center - camera;
+    bool back_facing =
+        glm::dot(to_center, m.cone_axis) >=
+        m.cone_cutoff * glm::length(to_center) + m.radius;
+    if (back_facing) {
+      continue;
+    }
+    visible_count++;
+    if (draw_count > 0) {
+      auto &last = draws[draw_count - 1];
+      if (last.firstIndex + last.indexCount == m.first_index) {
+        last.indexCount += m.index_count;
+        continue;
+      }
+    }
+    draws[draw_count++] = {m.index_count, 1, m.first_index, 0,
+                           0};
+  }
+  for (std::size_t i = draw_count; i < draw_capacity; i++) {
+    draws[i] = {0, 0, 0, 0, 0};
+  }
+  return visible_count;
+}
+}
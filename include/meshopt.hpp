@@ -0,0 +1,304 @@
+// load time optimization passes over indexed triangle meshes
+#pragma once
+#include <external.hpp>
+#include <meshcache.hpp>
+
+namespace vtuto {
+
+/** default size of the simulated post transform cache */
+const std::size_t post_transform_cache_size = 16;
+
+/** line size and line count of the simulated vertex fetch cache */
+const std::size_t vertex_fetch_line_size = 64;
+const std::size_t vertex_fetch_cache_lines = 128;
+
+/** post transform cache efficiency of an index buffer */
+struct VertexCacheStats {
+  /** number of simulated cache misses (shader invocations)*/
+  std::size_t miss_count = 0;
+  std::size_t triangle_count = 0;
+
+  /** number of distinct vertices referenced */
+  std::size_t vertex_count = 0;
+
+  /** average cache miss ratio: misses per triangle */
+  double acmr() const {
+    return triangle_count == 0
+               ? 0.0
+               : static_cast<double>(miss_count) /
+                     static_cast<double>(triangle_count);
+  }
+  /** average transformed vertex ratio: misses per vertex */
+  double atvr() const {
+    return vertex_count == 0
+               ? 0.0
+               : static_cast<double>(miss_count) /
+                     static_cast<double>(vertex_count);
+  }
+};
+
+inline std::ostream &operator<<(std::ostream &out,
+                                const VertexCacheStats &s) {
+  return out << "ACMR: " << s.acmr() << " ATVR: " << s.atvr()
+             << " (" << s.miss_count << " vertex shader runs)";
+}
+
+/**
+  Simulate a FIFO post transform cache over the index buffer.
+ */
+inline VertexCacheStats analyze_vertex_cache(
+    const std::vector<std::uint32_t> &indices,
+    std::size_t vertex_count,
+    std::size_t cache_size = post_transform_cache_size) {
+  VertexCacheStats stats;
+  stats.triangle_count = indices.size() / 3;
+  // a vertex is cached if it entered the cache less than
+  // cache_size misses ago
+  std::vector<std::size_t> entered(vertex_count, 0);
+  std::vector<bool> seen(vertex_count, false);
+  for (std::uint32_t v : indices) {
+    if (!seen[v]) {
+      seen[v] = true;
+      stats.vertex_count++;
+    } else if (stats.miss_count - entered[v] < cache_size) {
+      continue;
+    }
+    entered[v] = stats.miss_count;
+    stats.miss_count++;
+  }
+  return stats;
+}
+
+/**
+  Reorder triangles for post transform cache reuse.
+
+  Implements Tipsify (Sander, Nehab, Barczak: Fast Triangle
+  Reordering for Vertex Locality and Reduced Overdraw, 2007).
+  Triangles are emitted as fans around a current vertex; the
+  next fan vertex is the oldest candidate whose remaining
+  fan still fits in the cache, with a dead end stack and a
+  linear cursor as fallbacks. It runs in linear time, which
+  matters for multi million triangle meshes where Forsyth's
+  scoring would be much slower.
+
+  Triangles are only reordered, never changed, so winding is
+  preserved.
+ */
+inline void optimize_vertex_cache(
+    std::vector<std::uint32_t> &indices,
+    std::size_t vertex_count,
+    std::size_t cache_size = post_transform_cache_size) {
+  std::size_t triangle_count = indices.size() / 3;
+  if (triangle_count == 0 || vertex_count == 0) {
+    return;
+  }
+  // 1. vertex to triangle adjacency in compressed rows
+  std::vector<std::uint32_t> live(vertex_count, 0);
+  for (std::uint32_t v : indices) {
+    live[v]++;
+  }
+  std::vector<std::size_t> offsets(vertex_count + 1, 0);
+  for (std::size_t v = 0; v < vertex_count; v++) {
+    offsets[v + 1] = offsets[v] + live[v];
+  }
+  std::vector<std::uint32_t> adjacency(indices.size());
+  {
+    std::vector<std::size_t> fill(offsets.begin(),
+                                  offsets.end() - 1);
+    for (std::size_t t = 0; t < triangle_count; t++) {
+      for (std::size_t k = 0; k < 3; k++) {
+        adjacency[fill[indices[3 * t + k]]++] =
+            static_cast<std::uint32_t>(t);
+      }
+    }
+  }
+
+  // 2. emit fans
+  std::vector<std::size_t> cache_time(vertex_count, 0);
+  std::vector<bool> emitted(triangle_count, false);
+  std::vector<std::uint32_t> dead_ends;
+  std::vector<std::uint32_t> candidates;
+  std::vector<std::uint32_t> result;
+  result.reserve(indices.size());
+  std::size_t time = cache_size + 1;
+  std::size_t cursor = 0;
+  std::int64_t fan = indices[0];
+
+  while (fan >= 0) {
+    candidates.clear();
+    auto f = static_cast<std::size_t>(fan);
+    for (std::size_t a = offsets[f]; a < offsets[f + 1]; a++) {
+      std::uint32_t t = adjacency[a];
+      if (emitted[t]) {
+        continue;
+      }
+      for (std::size_t k = 0; k < 3; k++) {
+        std::uint32_t v = indices[3 * t + k];
+        result.push_back(v);
+        dead_ends.push_back(v);
+        candidates.push_back(v);
+        live[v]--;
+        if (time - cache_time[v] > cache_size) {
+          cache_time[v] = time;
+          time++;
+        }
+      }
+      emitted[t] = true;
+    }
+
+    // 3. pick the next fan vertex
+    fan = -1;
+    std::int64_t best_priority = -1;
+    for (std::uint32_t v : candidates) {
+      if (live[v] == 0) {
+        continue;
+      }
+      std::int64_t priority = 0;
+      if (time - cache_time[v] + 2 * live[v] <= cache_size) {
+        priority =
+            static_cast<std::int64_t>(time - cache_time[v]);
+      }
+      if (priority > best_priority) {
+        best_priority = priority;
+        fan = v;
+      }
+    }
+    while (fan < 0 && !dead_ends.empty()) {
+      std::uint32_t v = dead_ends.back();
+      dead_ends.pop_back();
+      if (live[v] > 0) {
+        fan = v;
+      }
+    }
+    while (fan < 0 && cursor < vertex_count) {
+      if (live[cursor] > 0) {
+        fan = static_cast<std::int64_t>(cursor);
+      }
+      cursor++;
+    }
+  }
+  indices.swap(result);
+}
+
+/**
+  Optimize every draw range on its own, so that no triangle
+  moves to another range.
+ */
+inline void optimize_vertex_cache(
+    std::vector<std::uint32_t> &indices,
+    const std::vector<Submesh> &submeshes,
+    std::size_t vertex_count,
+    std::size_t cache_size = post_transform_cache_size) {
+  std::vector<std::uint32_t> range;
+  for (const auto &submesh : submeshes) {
+    auto first = indices.begin() + submesh.first_index;
+    range.assign(first, first + submesh.index_count);
+    optimize_vertex_cache(range, vertex_count, cache_size);
+    std::copy(range.begin(), range.end(), first);
+  }
+}
+
+/** memory traffic caused by fetching the vertices of a mesh */
+struct VertexFetchStats {
+  /** bytes loaded from the vertex buffer, in whole lines */
+  std::size_t bytes_fetched = 0;
+
+  /** size of the referenced vertices */
+  std::size_t vertex_bytes = 0;
+
+  /** bytes fetched per referenced vertex byte, 1 is ideal */
+  double overfetch() const {
+    return vertex_bytes == 0
+               ? 0.0
+               : static_cast<double>(bytes_fetched) /
+                     static_cast<double>(vertex_bytes);
+  }
+};
+
+inline std::ostream &operator<<(std::ostream &out,
+                                const VertexFetchStats &s) {
+  return out << "overfetch: " << s.overfetch() << " ("
+             << s.bytes_fetched << " bytes for "
+             << s.vertex_bytes << " vertex bytes)";
+}
+
+/**
+  Simulate a FIFO cache of memory lines over the vertex
+  fetches made by the index buffer.
+
+  \param vertex_size stride of the vertex buffer.
+ */
+inline VertexFetchStats analyze_vertex_fetch(
+    const std::vector<std::uint32_t> &indices,
+    std::size_t vertex_count, std::size_t vertex_size) {
+  VertexFetchStats stats;
+  std::size_t line_count =
+      (vertex_count * vertex_size + vertex_fetch_line_size - 1) /
+      vertex_fetch_line_size;
+  std::size_t miss_count = 0;
+  std::vector<std::size_t> entered(line_count, 0);
+  std::vector<bool> line_seen(line_count, false);
+  std::vector<bool> vertex_seen(vertex_count, false);
+  for (std::uint32_t v : indices) {
+    if (!vertex_seen[v]) {
+      vertex_seen[v] = true;
+      stats.vertex_bytes += vertex_size;
+    }
+    std::size_t first = v * vertex_size / vertex_fetch_line_size;
+    std::size_t last = ((v + 1) * vertex_size - 1) /
+                       vertex_fetch_line_size;
+    for (std::size_t line = first; line <= last; line++) {
+      if (line_seen[line] &&
+          miss_count - entered[line] < vertex_fetch_cache_lines) {
+        continue;
+      }
+      line_seen[line] = true;
+      entered[line] = miss_count;
+      miss_count++;
+    }
+  }
+  stats.bytes_fetched = miss_count * vertex_fetch_line_size;
+  return stats;
+}
+
+/**
+  Reorder vertices in the order the index buffer first uses
+  them and remap the indices to match.
+
+  Run after optimize_vertex_cache(), so that consecutive
+  triangles read neighbouring vertices. Only the order of the
+  vertices changes, their layout does not, so the attribute
+  descriptions stay valid. Vertices that are not referenced
+  by any index are dropped.
+ */
+template <class V>
+void optimize_vertex_fetch(std::vector<V> &vertices,
+                           std::vector<std::uint32_t> &indices) {
+  std::vector<std::uint32_t> remap(vertices.size(), UINT32_MAX);
+  std::vector<V> result;
+  result.reserve(vertices.size());
+  for (std::uint32_t &v : indices) {
+    if (remap[v] == UINT32_MAX) {
+      remap[v] = static_cast<std::uint32_t>(result.size());
+      result.push_back(vertices[v]);
+    }
+    v = remap[v];
+  }
+  vertices.swap(result);
+}
+
+/** true if every index of the mesh fits in 16 bits */
+inline bool fits_short_indices(std::size_t vertex_count) {
+  return vertex_count <= std::size_t(UINT16_MAX) + 1;
+}
+
+/**
+  Copy 32 bit indices into 16 bit ones, the caller checks
+  fits_short_indices() first.
+ */
+inline std::vector<std::uint16_t>
+narrow_indices(const std::vector<std::uint32_t> &indices) {
+  return std::vector<std::uint16_t>(indices.begin(),
+                                    indices.end());
+}
+}
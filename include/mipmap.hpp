@@ -0,0 +1,75 @@
+// mip chains of rgba8 textures
+#pragma once
+#include <external.hpp>
+
+namespace vtuto {
+
+/** levels of a full mip chain, down to 1x1 */
+inline std::uint32_t mip_level_count(std::uint32_t width,
+                                     std::uint32_t height) {
+  std::uint32_t count = 1;
+  for (std::uint32_t size = std::max(width, height); size > 1;
+       size /= 2) {
+    count++;
+  }
+  return count;
+}
+
+/** level of a mip chain stored in a single buffer */
+struct MipLevel {
+  VkDeviceSize offset;
+  std::uint32_t width;
+  std::uint32_t height;
+};
+
+/**
+  Levels of the mip chain of a width x height rgba8 image,
+  stored one after the other from the largest. The size of
+  a level is half the size of the previous one, rounded down
+  and at least 1.
+ */
+inline std::vector<MipLevel>
+mip_chain_layout(std::uint32_t width, std::uint32_t height,
+                 std::uint32_t level_count) {
+  std::vector<MipLevel> levels;
+  VkDeviceSize offset = 0;
+  for (std::uint32_t l = 0; l < level_count; l++) {
+    levels.push_back({offset, width, height});
+    offset += VkDeviceSize(width) * height * 4;
+    width = std::max(width / 2, 1u);
+    height = std::max(height / 2, 1u);
+  }
+  return levels;
+}
+
+/** bytes of a mip chain */
+inline VkDeviceSize
+mip_chain_size(const std::vector<MipLevel> &levels) {
+  const MipLevel &last = levels.back();
+  return last.offset +
+         VkDeviceSize(last.width) * last.height * 4;
+}
+
+/**
+  Fill the levels of an srgb rgba8 mip chain from its first
+  level on the cpu, for formats that can not be blitted with
+  linear filtering. Every level is filtered from the previous
+  one in linear color space, alpha is kept linear.
+ */
+inline void
+build_mip_chain(std::uint8_t *chain,
+                const std::vector<MipLevel> &levels) {
+  for (std::size_t l = 1; l < levels.size(); l++) {
+    const MipLevel &src = levels[l - 1];
+    const MipLevel &dst = levels[l];
+    int done = stbir_resize_uint8_srgb(
+        chain + src.offset, static_cast<int>(src.width),
+        static_cast<int>(src.height), 0, chain + dst.offset,
+        static_cast<int>(dst.width),
+        static_cast<int>(dst.height), 0, 4, 3, 0);
+    if (done == 0) {
+      throw std::runtime_error("mip level can not be resized");
+    }
+  }
+}
+}
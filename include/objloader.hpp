@@ -0,0 +1,590 @@
+// multi threaded wavefront obj loader
+#pragma once
+#include <external.hpp>
+#include <meshcache.hpp>
+#include <threadpool.hpp>
+#include <vertex.hpp>
+#include <vertexweld.hpp>
+
+namespace vtuto {
+
+/** line level parsing shared by the obj loaders */
+struct obj_syntax {
+  static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+  }
+  static const char *skip_space(const char *p,
+                                const char *end) {
+    while (p < end && is_space(*p)) {
+      p++;
+    }
+    return p;
+  }
+  static const char *next_line(const char *p,
+                               const char *end) {
+    while (p < end && *p != '\n') {
+      p++;
+    }
+    return p < end ? p + 1 : end;
+  }
+  static float parse_float(const char *&p, const char *end) {
+    p = skip_space(p, end);
+    if (p == end || *p == '\n') {
+      return 0.0f;
+    }
+    char *stop = nullptr;
+    float value = std::strtof(p, &stop);
+    if (stop == p) {
+      return 0.0f;
+    }
+    p = stop;
+    return value;
+  }
+  static bool parse_int(const char *&p, const char *end,
+                        std::int64_t &value) {
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+      negative = *p == '-';
+      p++;
+    }
+    if (p == end || *p < '0' || *p > '9') {
+      return false;
+    }
+    value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+      value = value * 10 + (*p - '0');
+      p++;
+    }
+    if (negative) {
+      value = -value;
+    }
+    return true;
+  }
+  /** match a statement keyword followed by a space */
+  static bool keyword(const char *&p, const char *end,
+                      const char *word) {
+    std::size_t n = std::strlen(word);
+    if (static_cast<std::size_t>(end - p) <= n ||
+        std::strncmp(p, word, n) != 0 || !is_space(p[n])) {
+      return false;
+    }
+    p += n + 1;
+    return true;
+  }
+  /** rest of the line without surrounding spaces */
+  static std::string rest_of_line(const char *p,
+                                  const char *end) {
+    p = skip_space(p, end);
+    const char *stop = p;
+    while (stop < end && *stop != '\n') {
+      stop++;
+    }
+    while (stop > p && is_space(*(stop - 1))) {
+      stop--;
+    }
+    return std::string(p, stop);
+  }
+  /** space separated words of the rest of the line */
+  static std::vector<std::string>
+  words_of_line(const char *p, const char *end) {
+    std::vector<std::string> words;
+    for (;;) {
+      p = skip_space(p, end);
+      const char *stop = p;
+      while (stop < end && *stop != '\n' && !is_space(*stop)) {
+        stop++;
+      }
+      if (stop == p) {
+        return words;
+      }
+      words.emplace_back(p, stop);
+      p = stop;
+    }
+  }
+  /** directory part of a path, with its trailing slash */
+  static std::string directory_of(const std::string &path) {
+    std::size_t slash = path.find_last_of('/');
+    return slash == std::string::npos
+               ? std::string()
+               : path.substr(0, slash + 1);
+  }
+};
+
+/**
+  Parallel wavefront obj loader.
+
+  The file is read in one piece and split into line aligned
+  chunks, one per worker. Every chunk is parsed on the
+  thread pool into its own position, texture coordinate and
+  face arrays. Face indices that are relative (negative) are
+  kept chunk local until the prefix sums of the position and
+  texture coordinate counts of the previous chunks are known.
+
+  Each chunk then builds and welds its own vertices in
+  parallel. The final merge welds the (much smaller) set of
+  chunk unique vertices into the output vector and remaps the
+  chunk indices to it, again in parallel.
+
+  Only the geometry needed by Vertex is read: v and vt
+  statements and f statements. Polygons are fan triangulated,
+  which matches tinyobj for the convex faces exported by
+  modelling tools.
+
+  usemtl statements tag every triangle with a material, and
+  the output index buffer is sorted by material, keeping file
+  order within a material, so that every material is a single
+  draw range no matter how many shapes use it. The diffuse
+  texture of every material is read from the mtllib files.
+ */
+class obj_loader : obj_syntax {
+  /** a corner whose index does not reference anything*/
+  static constexpr std::int64_t no_index = INT64_MIN;
+  /**
+    chunk local indices are stored minus this base. A
+    relative index may point before the chunk, so the local
+    index can be negative too
+   */
+  static constexpr std::int64_t local_base =
+      std::int64_t(1) << 62;
+
+  struct obj_chunk {
+    const char *begin = nullptr;
+    const char *end = nullptr;
+
+    /** xyz triplets and uv pairs read in this chunk */
+    std::vector<float> positions;
+    std::vector<float> texcoords;
+
+    /**
+      position and texture coordinate index pairs of the
+      triangulated faces. Non negative values are absolute
+      zero based indices, negative values encode a chunk
+      local index as index - local_base.
+     */
+    std::vector<std::int64_t> corners;
+
+    /** mtllib files and usemtl names of this chunk */
+    std::vector<std::string> libraries;
+    std::vector<std::string> material_names;
+
+    /**
+      chunk local material of every triangle: 0 is the one in
+      effect at the start of the chunk, k > 0 is
+      material_names[k - 1]
+     */
+    std::vector<std::uint32_t> triangle_materials;
+    /** triangle count of every chunk local material */
+    std::vector<std::size_t> material_counts;
+    /** material id and output index of the local materials */
+    std::vector<std::uint32_t> material_ids;
+    std::vector<std::size_t> material_offsets;
+
+    /** number of positions and texcoords before this chunk*/
+    std::size_t position_offset = 0;
+    std::size_t texcoord_offset = 0;
+
+    /** chunk local welded vertices and indices */
+    std::vector<Vertex> vertices;
+    std::vector<std::uint32_t> indices;
+    std::vector<std::uint32_t> remap;
+    VertexWeldStats stats;
+  };
+
+  thread_pool &pool;
+
+public:
+  /** combined welding statistics of the last load() */
+  VertexWeldStats stats;
+
+public:
+  explicit obj_loader(thread_pool &p) : pool(p) {}
+
+  /**
+    Load the triangles of the given obj file.
+
+    Vertices and indices are appended to the given vectors.
+    submeshes and materials are replaced by one draw range
+    and one material per material used by the faces; faces
+    before any usemtl get a material with the default
+    texture.
+   */
+  void load(const std::string &path,
+            std::vector<Vertex> &vertices,
+            std::vector<std::uint32_t> &indices,
+            std::vector<Submesh> &submeshes,
+            std::vector<MeshMaterial> &materials) {
+    std::string content = read_file(path);
+    std::vector<obj_chunk> chunks =
+        split(content, pool.size());
+
+    // 1. parse line aligned chunks
+    pool.parallel_for(chunks.size(), [&](std::size_t i) {
+      parse(chunks[i]);
+    });
+
+    // 2. prefix sums of the element counts of every chunk
+    std::size_t position_count = 0;
+    std::size_t texcoord_count = 0;
+    std::size_t corner_count = 0;
+    for (auto &chunk : chunks) {
+      chunk.position_offset = position_count;
+      chunk.texcoord_offset = texcoord_count;
+      position_count += chunk.positions.size() / 3;
+      texcoord_count += chunk.texcoords.size() / 2;
+      corner_count += chunk.corners.size() / 2;
+    }
+    std::vector<float> positions(position_count * 3);
+    std::vector<float> texcoords(texcoord_count * 2);
+    pool.parallel_for(chunks.size(), [&](std::size_t i) {
+      auto &chunk = chunks[i];
+      std::copy(chunk.positions.begin(),
+                chunk.positions.end(),
+                positions.begin() +
+                    chunk.position_offset * 3);
+      std::copy(chunk.texcoords.begin(),
+                chunk.texcoords.end(),
+                texcoords.begin() +
+                    chunk.texcoord_offset * 2);
+      std::vector<float>().swap(chunk.positions);
+      std::vector<float>().swap(chunk.texcoords);
+    });
+    std::size_t first_index = indices.size();
+    std::vector<std::string> names =
+        resolve_materials(chunks, first_index, submeshes);
+    materials = read_materials(path, chunks, names);
+
+    // 3. build and weld vertices per chunk
+    pool.parallel_for(chunks.size(), [&](std::size_t i) {
+      build_vertices(chunks[i], positions, texcoords);
+    });
+
+    // 4. merge chunk vertices into the output
+    std::size_t local_vertex_count = 0;
+    for (auto &chunk : chunks) {
+      local_vertex_count += chunk.vertices.size();
+    }
+    vertex_weld welder(vertices, local_vertex_count);
+    stats = VertexWeldStats{};
+    for (auto &chunk : chunks) {
+      first_index += chunk.indices.size();
+      chunk.remap.resize(chunk.vertices.size());
+      for (std::size_t j = 0; j < chunk.vertices.size();
+           j++) {
+        chunk.remap[j] = welder.weld(chunk.vertices[j]);
+      }
+      stats.probe_count += chunk.stats.probe_count;
+      stats.max_probe_length =
+          std::max(stats.max_probe_length,
+                   chunk.stats.max_probe_length);
+      stats.rehash_count += chunk.stats.rehash_count;
+    }
+    stats.input_count = corner_count;
+    stats.unique_count = welder.stats.unique_count;
+    stats.probe_count += welder.stats.probe_count;
+    stats.max_probe_length =
+        std::max(stats.max_probe_length,
+                 welder.stats.max_probe_length);
+    stats.rehash_count += welder.stats.rehash_count;
+    stats.table_size = welder.stats.table_size;
+
+    // 5. remap chunk indices to the merged vertices and
+    // scatter the triangles into their material range
+    indices.resize(first_index);
+    pool.parallel_for(chunks.size(), [&](std::size_t i) {
+      auto &chunk = chunks[i];
+      for (std::size_t t = 0;
+           t < chunk.triangle_materials.size(); t++) {
+        std::size_t &out =
+            chunk.material_offsets[chunk.triangle_materials[t]];
+        for (std::size_t k = 0; k < 3; k++) {
+          indices[out++] =
+              chunk.remap[chunk.indices[3 * t + k]];
+        }
+      }
+    });
+  }
+
+private:
+  static std::string read_file(const std::string &path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+      throw std::runtime_error("obj file can not be opened: " +
+                               path);
+    }
+    std::string content(
+        static_cast<std::size_t>(file.tellg()), '\0');
+    file.seekg(0);
+    file.read(&content[0],
+              static_cast<std::streamsize>(content.size()));
+    return content;
+  }
+  /**
+    Give the materials used by some triangle an id in order
+    of first use, and the output position of the triangles of
+    every chunk, so that the index buffer ends up sorted by
+    material.
+
+    \return names of the materials by id.
+   */
+  static std::vector<std::string>
+  resolve_materials(std::vector<obj_chunk> &chunks,
+                    std::size_t first_index,
+                    std::vector<Submesh> &submeshes) {
+    std::unordered_map<std::string, std::uint32_t> ids;
+    std::vector<std::string> names;
+    std::vector<std::size_t> counts;
+    std::string current;
+    for (auto &chunk : chunks) {
+      chunk.material_ids.assign(chunk.material_counts.size(),
+                                0);
+      for (std::size_t k = 0; k < chunk.material_counts.size();
+           k++) {
+        if (chunk.material_counts[k] == 0) {
+          continue;
+        }
+        const std::string &name =
+            k == 0 ? current : chunk.material_names[k - 1];
+        auto it = ids.emplace(
+            name, static_cast<std::uint32_t>(names.size()));
+        if (it.second) {
+          names.push_back(name);
+          counts.push_back(0);
+        }
+        chunk.material_ids[k] = it.first->second;
+        counts[it.first->second] += chunk.material_counts[k];
+      }
+      if (!chunk.material_names.empty()) {
+        current = chunk.material_names.back();
+      }
+    }
+    submeshes.clear();
+    std::size_t offset = first_index;
+    for (std::size_t m = 0; m < names.size(); m++) {
+      submeshes.push_back(
+          {static_cast<std::uint32_t>(offset),
+           static_cast<std::uint32_t>(counts[m] * 3),
+           static_cast<std::uint32_t>(m)});
+      offset += counts[m] * 3;
+    }
+    // chunks of the same material follow in file order
+    std::vector<std::size_t> next(names.size());
+    for (std::size_t m = 0; m < names.size(); m++) {
+      next[m] = submeshes[m].first_index;
+    }
+    for (auto &chunk : chunks) {
+      chunk.material_offsets.assign(
+          chunk.material_counts.size(), 0);
+      for (std::size_t k = 0; k < chunk.material_counts.size();
+           k++) {
+        std::size_t &n = next[chunk.material_ids[k]];
+        chunk.material_offsets[k] = n;
+        n += chunk.material_counts[k] * 3;
+      }
+    }
+    return names;
+  }
+  /**
+    Read the diffuse textures of the named materials from the
+    mtllib files. Paths are relative to the file that names
+    them. A missing library or texture leaves the default
+    texture, as the model is still drawable.
+   */
+  static std::vector<MeshMaterial>
+  read_materials(const std::string &path,
+                 const std::vector<obj_chunk> &chunks,
+                 const std::vector<std::string> &names) {
+    std::unordered_map<std::string, std::string> textures;
+    std::string obj_dir = directory_of(path);
+    for (const auto &chunk : chunks) {
+      for (const auto &library : chunk.libraries) {
+        std::string mtl_path = obj_dir + library;
+        std::ifstream file(mtl_path, std::ios::binary);
+        if (!file.is_open()) {
+          continue;
+        }
+        std::string content(
+            (std::istreambuf_iterator<char>(file)),
+            std::istreambuf_iterator<char>());
+        std::string mtl_dir = directory_of(mtl_path);
+        const char *p = content.data();
+        const char *end = p + content.size();
+        std::string material;
+        while (p < end) {
+          p = skip_space(p, end);
+          if (keyword(p, end, "newmtl")) {
+            material = rest_of_line(p, end);
+          } else if (keyword(p, end, "map_Kd")) {
+            // the file name follows the map options
+            auto words = words_of_line(p, end);
+            if (!words.empty()) {
+              textures[material] = mtl_dir + words.back();
+            }
+          }
+          p = next_line(p, end);
+        }
+      }
+    }
+    std::vector<MeshMaterial> materials;
+    for (const auto &name : names) {
+      auto it = textures.find(name);
+      materials.push_back(make_material(
+          it == textures.end() ? std::string() : it->second));
+    }
+    return materials;
+  }
+  /** split content into at most n line aligned chunks */
+  static std::vector<obj_chunk>
+  split(const std::string &content, std::size_t n) {
+    const char *data = content.c_str();
+    const char *end = data + content.size();
+    std::size_t target = content.size() / n + 1;
+    std::vector<obj_chunk> chunks;
+    const char *begin = data;
+    while (begin < end) {
+      const char *stop = begin + std::min<std::size_t>(
+                                     target, end - begin);
+      while (stop < end && *(stop - 1) != '\n') {
+        stop++;
+      }
+      obj_chunk chunk;
+      chunk.begin = begin;
+      chunk.end = stop;
+      chunks.push_back(std::move(chunk));
+      begin = stop;
+    }
+    return chunks;
+  }
+  /**
+    Turn an obj index into the corner encoding.
+
+    \param count number of elements of that kind read so far
+    in this chunk.
+   */
+  static std::int64_t encode(std::int64_t index,
+                             std::size_t count) {
+    if (index > 0) {
+      return index - 1;
+    }
+    if (index < 0) {
+      // below zero when it points into an earlier chunk
+      return static_cast<std::int64_t>(count) + index -
+             local_base;
+    }
+    throw std::runtime_error("obj index 0 is not valid");
+  }
+  static void parse(obj_chunk &chunk) {
+    const char *p = chunk.begin;
+    const char *end = chunk.end;
+    std::vector<std::int64_t> face;
+    std::uint32_t material = 0;
+    chunk.material_counts.assign(1, 0);
+    while (p < end) {
+      p = skip_space(p, end);
+      if (end - p >= 2 && p[0] == 'v' && is_space(p[1])) {
+        p += 2;
+        for (int k = 0; k < 3; k++) {
+          chunk.positions.push_back(parse_float(p, end));
+        }
+      } else if (end - p >= 3 && p[0] == 'v' &&
+                 p[1] == 't' && is_space(p[2])) {
+        p += 3;
+        for (int k = 0; k < 2; k++) {
+          chunk.texcoords.push_back(parse_float(p, end));
+        }
+      } else if (end - p >= 2 && p[0] == 'f' &&
+                 is_space(p[1])) {
+        p += 2;
+        face.clear();
+        std::size_t pcount = chunk.positions.size() / 3;
+        std::size_t tcount = chunk.texcoords.size() / 2;
+        for (;;) {
+          p = skip_space(p, end);
+          std::int64_t v = 0;
+          if (!parse_int(p, end, v)) {
+            break;
+          }
+          std::int64_t vt = no_index;
+          if (p < end && *p == '/') {
+            p++;
+            std::int64_t t = 0;
+            if (parse_int(p, end, t)) {
+              vt = encode(t, tcount);
+            }
+            if (p < end && *p == '/') {
+              // normals are not part of Vertex
+              p++;
+              std::int64_t n = 0;
+              parse_int(p, end, n);
+            }
+          }
+          face.push_back(encode(v, pcount));
+          face.push_back(vt);
+        }
+        // fan triangulation
+        std::size_t corner_count = face.size() / 2;
+        for (std::size_t k = 1; k + 1 < corner_count; k++) {
+          const std::size_t fan[] = {0, k, k + 1};
+          for (std::size_t c : fan) {
+            chunk.corners.push_back(face[2 * c]);
+            chunk.corners.push_back(face[2 * c + 1]);
+          }
+          chunk.triangle_materials.push_back(material);
+          chunk.material_counts[material]++;
+        }
+      } else if (keyword(p, end, "usemtl")) {
+        chunk.material_names.push_back(rest_of_line(p, end));
+        chunk.material_counts.push_back(0);
+        material = static_cast<std::uint32_t>(
+            chunk.material_names.size());
+      } else if (keyword(p, end, "mtllib")) {
+        for (auto &library : words_of_line(p, end)) {
+          chunk.libraries.push_back(std::move(library));
+        }
+      }
+      p = next_line(p, end);
+    }
+  }
+  static std::size_t resolve(std::int64_t index,
+                             std::size_t offset,
+                             std::size_t count) {
+    std::int64_t absolute =
+        index >= 0 ? index
+                   : static_cast<std::int64_t>(offset) +
+                         index + local_base;
+    if (absolute < 0 ||
+        static_cast<std::size_t>(absolute) >= count) {
+      throw std::runtime_error("obj index out of range");
+    }
+    return static_cast<std::size_t>(absolute);
+  }
+  static void
+  build_vertices(obj_chunk &chunk,
+                 const std::vector<float> &positions,
+                 const std::vector<float> &texcoords) {
+    std::size_t corner_count = chunk.corners.size() / 2;
+    chunk.indices.reserve(corner_count);
+    vertex_weld welder(chunk.vertices, corner_count);
+    for (std::size_t i = 0; i < corner_count; i++) {
+      Vertex v{};
+      auto vindex =
+          resolve(chunk.corners[2 * i], chunk.position_offset,
+                  positions.size() / 3);
+      v.pos = {positions[3 * vindex + 0],
+               positions[3 * vindex + 1],
+               positions[3 * vindex + 2]};
+      auto tcorner = chunk.corners[2 * i + 1];
+      if (tcorner != no_index) {
+        auto tindex =
+            resolve(tcorner, chunk.texcoord_offset,
+                    texcoords.size() / 2);
+        v.texCoord = {texcoords[2 * tindex + 0],
+                      1.0f - texcoords[2 * tindex + 1]};
+      }
+      v.color = {1.0f, 1.0f, 1.0f};
+      chunk.indices.push_back(welder.weld(v));
+    }
+    chunk.stats = welder.stats;
+    std::vector<std::int64_t>().swap(chunk.corners);
+  }
+};
+}
@@ -0,0 +1,198 @@
+// streaming wavefront obj loader for models larger than memory
+#pragma once
+#include <external.hpp>
+#include <meshcache.hpp>
+#include <objloader.hpp>
+#include <vertex.hpp>
+#include <vertexweld.hpp>
+
+namespace vtuto {
+
+/** obj files at least this large are streamed */
+const std::uint64_t obj_stream_threshold = 1ull << 30;
+
+/**
+  Sequential streaming obj loader.
+
+  The file is read through a fixed size window, whole lines
+  are parsed as they arrive and the remainder of the window
+  is carried over. Faces are welded on the fly and their
+  indices are flushed in fixed size blocks straight into a
+  mesh cache file, so neither the file content nor the index
+  buffer is ever held in memory. Memory use is bounded by the
+  positions, texture coordinates and unique vertices of the
+  model, which is typically a small fraction of the file.
+
+  The result is only available through the mesh cache, which
+  is memory mapped and uploaded in staging sized chunks. The
+  load time optimization passes and the grouping of faces by
+  material need the whole index buffer, so streamed models
+  are drawn in file order with a single level of detail and
+  the default texture.
+ */
+class obj_stream_loader : obj_syntax {
+  std::size_t window_size;
+  std::size_t index_block_size;
+
+public:
+  /** welding statistics of the last load() */
+  VertexWeldStats stats;
+
+public:
+  explicit obj_stream_loader(
+      std::size_t window = 8 << 20,
+      std::size_t index_block = 1 << 20)
+      : window_size(window), index_block_size(index_block) {}
+
+  /** parse the model and write its mesh cache */
+  void load(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+      throw std::runtime_error("obj file can not be opened: " +
+                               path);
+    }
+    mesh_cache::stream_writer writer(path);
+    std::vector<float> positions;
+    std::vector<float> texcoords;
+    std::vector<Vertex> vertices;
+    std::vector<std::uint32_t> block;
+    block.reserve(index_block_size);
+    // the vertex count is unknown, the table grows as needed
+    vertex_weld welder(vertices, 1 << 16);
+    std::vector<std::int64_t> face;
+
+    std::vector<char> window(window_size);
+    std::size_t carry = 0;
+    for (;;) {
+      // 1. fill the window after the carried partial line
+      file.read(window.data() + carry,
+                static_cast<std::streamsize>(window.size() -
+                                             carry));
+      std::size_t filled =
+          carry + static_cast<std::size_t>(file.gcount());
+      bool last = filled < window.size();
+      const char *begin = window.data();
+      const char *end = begin + filled;
+      const char *stop = end;
+      if (!last) {
+        while (stop > begin && *(stop - 1) != '\n') {
+          stop--;
+        }
+        if (stop == begin) {
+          // a single line longer than the window
+          window.resize(window.size() * 2);
+          carry = filled;
+          continue;
+        }
+      }
+
+      // 2. parse the whole lines of the window
+      const char *p = begin;
+      while (p < stop) {
+        p = skip_space(p, stop);
+        if (stop - p >= 2 && p[0] == 'v' && is_space(p[1])) {
+          p += 2;
+          for (int k = 0; k < 3; k++) {
+            positions.push_back(parse_float(p, stop));
+          }
+        } else if (stop - p >= 3 && p[0] == 'v' &&
+                   p[1] == 't' && is_space(p[2])) {
+          p += 3;
+          for (int k = 0; k < 2; k++) {
+            texcoords.push_back(parse_float(p, stop));
+          }
+        } else if (stop - p >= 2 && p[0] == 'f' &&
+                   is_space(p[1])) {
+          p += 2;
+          parse_face(p, stop, positions, texcoords, face);
+          std::size_t corner_count = face.size() / 2;
+          for (std::size_t k = 1; k + 1 < corner_count; k++) {
+            const std::size_t fan[] = {0, k, k + 1};
+            for (std::size_t c : fan) {
+              block.push_back(welder.weld(make_vertex(
+                  positions, texcoords, face[2 * c],
+                  face[2 * c + 1])));
+            }
+            if (block.size() + 3 > index_block_size) {
+              writer.append_indices(block.data(), block.size());
+              block.clear();
+            }
+          }
+        }
+        p = next_line(p, stop);
+      }
+      if (last) {
+        break;
+      }
+
+      // 3. carry the partial last line over
+      carry = static_cast<std::size_t>(end - stop);
+      std::memmove(window.data(), stop, carry);
+    }
+    writer.append_indices(block.data(), block.size());
+    writer.finish(vertices);
+    stats = welder.stats;
+  }
+
+private:
+  /**
+    Read the corners of a face as absolute, zero based
+    position and texture coordinate index pairs. A missing
+    texture coordinate is -1.
+   */
+  static void parse_face(const char *&p, const char *end,
+                         const std::vector<float> &positions,
+                         const std::vector<float> &texcoords,
+                         std::vector<std::int64_t> &face) {
+    face.clear();
+    auto pcount =
+        static_cast<std::int64_t>(positions.size() / 3);
+    auto tcount =
+        static_cast<std::int64_t>(texcoords.size() / 2);
+    for (;;) {
+      p = skip_space(p, end);
+      std::int64_t v = 0;
+      if (!parse_int(p, end, v)) {
+        break;
+      }
+      std::int64_t vt = -1;
+      if (p < end && *p == '/') {
+        p++;
+        std::int64_t t = 0;
+        if (parse_int(p, end, t)) {
+          vt = resolve(t, tcount);
+        }
+        if (p < end && *p == '/') {
+          // normals are not part of Vertex
+          p++;
+          std::int64_t n = 0;
+          parse_int(p, end, n);
+        }
+      }
+      face.push_back(resolve(v, pcount));
+      face.push_back(vt);
+    }
+  }
+  static std::int64_t resolve(std::int64_t index,
+                              std::int64_t count) {
+    std::int64_t absolute = index > 0 ? index - 1 : count + index;
+    if (index == 0 || absolute < 0 || absolute >= count) {
+      throw std::runtime_error("obj index out of range");
+    }
+    return absolute;
+  }
+  static Vertex make_vertex(const std::vector<float> &positions,
+                            const std::vector<float> &texcoords,
+                            std::int64_t v, std::int64_t vt) {
+    Vertex vertex{};
+    vertex.pos = {positions[3 * v + 0], positions[3 * v + 1],
+                  positions[3 * v + 2]};
+    if (vt >= 0) {
+      vertex.texCoord = {texcoords[2 * vt + 0],
+                         1.0f - texcoords[2 * vt + 1]};
+    }
+    vertex.color = {1.0f, 1.0f, 1.0f};
+    return vertex;
+  }
+};
+}
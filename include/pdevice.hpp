@@ -3,6 +3,7 @@
 
 #include <debug.hpp>
 #include <device.hpp>
+#include <devicecaps.hpp>
 #include <external.hpp>
 #include <support.hpp>
 #include <utils.hpp>
@@ -16,6 +17,8 @@ public:
   VkPhysicalDevice pdevice = VK_NULL_HANDLE;
   VkSurfaceKHR surface;
   VkInstance *instance_ptr;
+  /** queried once the device is picked */
+  DeviceCapabilities capabilities;
 
 public:
   vulkan_device() : instance_ptr(nullptr) {}
@@ -42,10 +45,13 @@ public:
                                devices.data());
 
     for (const auto &device : devices) {
-      //
-      if (is_device_suitable(device)) {
+      // the capabilities of the picked device are kept
+      DeviceCapabilities caps =
+          DeviceCapabilities::query(device);
+      if (is_device_suitable(device, caps)) {
         //
         pdevice = device;
+        capabilities = std::move(caps);
         break;
       }
     }
@@ -62,10 +68,11 @@ public:
       chain
      */
 
-  bool is_device_suitable(VkPhysicalDevice pdev) {
+  bool is_device_suitable(VkPhysicalDevice pdev,
+                          const DeviceCapabilities &caps) {
     QueuFamilyIndices indices =
-        QueuFamilyIndices::find_family_indices(pdev,
-                                               surface);
+        QueuFamilyIndices::find_family_indices(
+            pdev, surface, caps.queue_families);
     bool areExtensionsSupported =
         checkDeviceExtensionSupport(pdev);
 
@@ -79,11 +86,10 @@ public:
           !swapChainSupport.formats.empty() &&
           !swapChainSupport.present_modes.empty();
     }
-    VkPhysicalDeviceProperties dprops{};
-    vkGetPhysicalDeviceProperties(pdev, &dprops);
     bool cond1 = indices.is_complete() &&
            areExtensionsSupported && isSwapChainPossible;
-    bool cond2 = cond1 && (dprops.limits.maxSamplerAnisotropy > 0.0);
+    bool cond2 =
+        cond1 && (caps.limits().maxSamplerAnisotropy > 0.0);
     return cond2;
   }
   void createSurface(GLFWwindow *window) {
@@ -0,0 +1,389 @@
+// quadric error mesh simplification and level of detail chains
+#pragma once
+#include <external.hpp>
+#include <meshcache.hpp>
+#include <meshopt.hpp>
+#include <vertex.hpp>
+
+namespace vtuto {
+
+/** hash of the bit pattern of a position */
+struct position_hash {
+  std::size_t operator()(glm::vec3 p) const {
+    std::uint64_t h = float_bits(p.x);
+    h = h * 0x9e3779b97f4a7c15ull ^ float_bits(p.y);
+    h = h * 0x9e3779b97f4a7c15ull ^ float_bits(p.z);
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 29;
+    return static_cast<std::size_t>(h);
+  }
+};
+
+/**
+  Symmetric 4x4 error quadric (Garland, Heckbert) with the
+  total weight of its planes, so that error() is the weighted
+  mean squared distance to the planes.
+ */
+struct Quadric {
+  double a00 = 0, a01 = 0, a02 = 0, a03 = 0;
+  double a11 = 0, a12 = 0, a13 = 0;
+  double a22 = 0, a23 = 0;
+  double a33 = 0;
+  double weight = 0;
+
+  /** plane n.p + d = 0 with a unit normal n */
+  static Quadric plane(glm::vec3 n, double d, double w) {
+    Quadric q;
+    q.a00 = w * n.x * n.x;
+    q.a01 = w * n.x * n.y;
+    q.a02 = w * n.x * n.z;
+    q.a03 = w * n.x * d;
+    q.a11 = w * n.y * n.y;
+    q.a12 = w * n.y * n.z;
+    q.a13 = w * n.y * d;
+    q.a22 = w * n.z * n.z;
+    q.a23 = w * n.z * d;
+    q.a33 = w * d * d;
+    q.weight = w;
+    return q;
+  }
+  Quadric &operator+=(const Quadric &o) {
+    a00 += o.a00;
+    a01 += o.a01;
+    a02 += o.a02;
+    a03 += o.a03;
+    a11 += o.a11;
+    a12 += o.a12;
+    a13 += o.a13;
+    a22 += o.a22;
+    a23 += o.a23;
+    a33 += o.a33;
+    weight += o.weight;
+    return *this;
+  }
+  /** mean squared distance of p to the planes */
+  double error(glm::vec3 p) const {
+    double x = p.x, y = p.y, z = p.z;
+    double e = a00 * x * x + 2 * a01 * x * y +
+               2 * a02 * x * z + 2 * a03 * x + a11 * y * y +
+               2 * a12 * y * z + 2 * a13 * y + a22 * z * z +
+               2 * a23 * z + a33;
+    return weight > 0 ? std::abs(e) / weight : 0.0;
+  }
+};
+
+/**
+  Simplify an indexed triangle mesh by edge collapses.
+
+  Vertices are collapsed onto one of their neighbours, so the
+  result indexes into the same vertex array and no vertex is
+  created or moved. Collapses are done in passes: every pass
+  sorts the candidate edges by quadric error and greedily
+  applies independent collapses that do not flip a triangle.
+
+  Vertices on open borders and on attribute seams (several
+  vertices sharing a position) are locked, which keeps
+  silhouettes and texture coordinates intact.
+
+  \param target_index_count stop once the result has at most
+  this many indices.
+
+  \param result_error largest quadric error of the applied
+  collapses, as a distance in model units.
+
+  \param ranges optional consecutive draw ranges covering
+  indices, relative to its start. Vertices shared by several
+  ranges are locked as well, so material borders stay in
+  place, and the ranges are updated to the result.
+ */
+inline std::vector<std::uint32_t>
+simplify_mesh(const std::vector<Vertex> &vertices,
+              const std::vector<std::uint32_t> &indices,
+              std::size_t target_index_count,
+              float &result_error,
+              std::vector<Submesh> *ranges = nullptr) {
+  std::size_t vertex_count = vertices.size();
+  std::vector<std::uint32_t> result(indices);
+  result_error = 0.0f;
+  std::vector<Submesh> whole = {
+      {0, static_cast<std::uint32_t>(indices.size()), 0}};
+  std::vector<Submesh> &parts =
+      ranges != nullptr ? *ranges : whole;
+
+  // 1. lock seam and border vertices
+  std::vector<bool> locked(vertex_count, false);
+  std::vector<std::uint32_t> canonical(vertex_count);
+  {
+    std::unordered_map<glm::vec3, std::uint32_t, position_hash>
+        first_at;
+    first_at.reserve(vertex_count);
+    for (std::uint32_t v = 0; v < vertex_count; v++) {
+      auto it = first_at.emplace(vertices[v].pos, v).first;
+      canonical[v] = it->second;
+      if (it->second != v) {
+        locked[v] = true;
+        locked[it->second] = true;
+      }
+    }
+    std::unordered_map<std::uint64_t, std::uint32_t> edges;
+    edges.reserve(indices.size());
+    auto edge_key = [&](std::uint32_t a, std::uint32_t b) {
+      a = canonical[a];
+      b = canonical[b];
+      return a < b ? (std::uint64_t(a) << 32) | b
+                   : (std::uint64_t(b) << 32) | a;
+    };
+    for (std::size_t i = 0; i < indices.size(); i += 3) {
+      for (std::size_t k = 0; k < 3; k++) {
+        edges[edge_key(indices[i + k],
+                       indices[i + (k + 1) % 3])]++;
+      }
+    }
+    for (std::size_t i = 0; i < indices.size(); i += 3) {
+      for (std::size_t k = 0; k < 3; k++) {
+        std::uint32_t a = indices[i + k];
+        std::uint32_t b = indices[i + (k + 1) % 3];
+        if (edges[edge_key(a, b)] == 1) {
+          locked[a] = true;
+          locked[b] = true;
+        }
+      }
+    }
+    std::vector<std::uint32_t> owner(vertex_count, UINT32_MAX);
+    for (std::size_t r = 0; r < parts.size(); r++) {
+      std::size_t begin = parts[r].first_index;
+      for (std::size_t i = begin;
+           i < begin + parts[r].index_count; i++) {
+        std::uint32_t &o = owner[indices[i]];
+        if (o != UINT32_MAX && o != r) {
+          locked[indices[i]] = true;
+        }
+        o = static_cast<std::uint32_t>(r);
+      }
+    }
+  }
+
+  // 2. area weighted plane quadrics of every vertex
+  std::vector<Quadric> quadrics(vertex_count);
+  for (std::size_t i = 0; i < indices.size(); i += 3) {
+    glm::vec3 p0 = vertices[indices[i]].pos;
+    glm::vec3 p1 = vertices[indices[i + 1]].pos;
+    glm::vec3 p2 = vertices[indices[i + 2]].pos;
+    glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+    float len = glm::length(n);
+    if (len == 0.0f) {
+      continue;
+    }
+    n /= len;
+    Quadric q = Quadric::plane(n, -glm::dot(n, p0), len * 0.5);
+    for (std::size_t k = 0; k < 3; k++) {
+      quadrics[indices[i + k]] += q;
+    }
+  }
+
+  struct collapse {
+    std::uint32_t from;
+    std::uint32_t to;
+    double error;
+  };
+  std::vector<collapse> collapses;
+  std::vector<std::uint32_t> remap(vertex_count);
+  std::vector<bool> touched(vertex_count);
+  std::vector<std::size_t> offsets(vertex_count + 1);
+  std::vector<std::uint32_t> adjacency;
+  double max_error = 0.0;
+
+  // 3. collapse passes
+  while (result.size() > target_index_count) {
+    // vertex to triangle adjacency of the current mesh
+    std::fill(offsets.begin(), offsets.end(), 0);
+    for (std::uint32_t v : result) {
+      offsets[v + 1]++;
+    }
+    for (std::size_t v = 0; v < vertex_count; v++) {
+      offsets[v + 1] += offsets[v];
+    }
+    adjacency.resize(result.size());
+    {
+      std::vector<std::size_t> fill(offsets.begin(),
+                                    offsets.end() - 1);
+      for (std::size_t i = 0; i < result.size(); i++) {
+        adjacency[fill[result[i]]++] =
+            static_cast<std::uint32_t>(i / 3);
+      }
+    }
+
+    collapses.clear();
+    for (std::size_t i = 0; i < result.size(); i += 3) {
+      for (std::size_t k = 0; k < 3; k++) {
+        std::uint32_t a = result[i + k];
+        std::uint32_t b = result[i + (k + 1) % 3];
+        Quadric q = quadrics[a];
+        q += quadrics[b];
+        if (!locked[a]) {
+          collapses.push_back({a, b, q.error(vertices[b].pos)});
+        }
+        if (!locked[b]) {
+          collapses.push_back({b, a, q.error(vertices[a].pos)});
+        }
+      }
+    }
+    std::sort(collapses.begin(), collapses.end(),
+              [](const collapse &x, const collapse &y) {
+                return x.error < y.error;
+              });
+
+    for (std::uint32_t v = 0; v < vertex_count; v++) {
+      remap[v] = v;
+    }
+    std::fill(touched.begin(), touched.end(), false);
+    std::size_t removed = 0;
+    std::size_t goal = (result.size() - target_index_count) / 3;
+    for (const collapse &c : collapses) {
+      if (removed >= goal) {
+        break;
+      }
+      if (touched[c.from] || touched[c.to]) {
+        continue;
+      }
+      // reject collapses that flip a remaining triangle
+      bool flips = false;
+      std::size_t vanishing = 0;
+      for (std::size_t a = offsets[c.from];
+           a < offsets[c.from + 1] && !flips; a++) {
+        const std::uint32_t *t = &result[3 * adjacency[a]];
+        if (t[0] == c.to || t[1] == c.to || t[2] == c.to) {
+          vanishing++;
+          continue;
+        }
+        glm::vec3 p[3], q[3];
+        for (std::size_t k = 0; k < 3; k++) {
+          p[k] = vertices[t[k]].pos;
+          q[k] = t[k] == c.from ? vertices[c.to].pos : p[k];
+        }
+        glm::vec3 n0 = glm::cross(p[1] - p[0], p[2] - p[0]);
+        glm::vec3 n1 = glm::cross(q[1] - q[0], q[2] - q[0]);
+        flips = glm::dot(n0, n1) <= 0.0f;
+      }
+      if (flips) {
+        continue;
+      }
+      remap[c.from] = c.to;
+      quadrics[c.to] += quadrics[c.from];
+      max_error = std::max(max_error, c.error);
+      removed += vanishing;
+      // neighbours keep their triangles stable in this pass
+      for (std::size_t a = offsets[c.from];
+           a < offsets[c.from + 1]; a++) {
+        const std::uint32_t *t = &result[3 * adjacency[a]];
+        for (std::size_t k = 0; k < 3; k++) {
+          touched[t[k]] = true;
+        }
+      }
+    }
+    if (removed == 0) {
+      break;
+    }
+
+    // drop the triangles that became degenerate
+    std::size_t out = 0;
+    for (auto &part : parts) {
+      std::size_t begin = part.first_index;
+      std::size_t end = begin + part.index_count;
+      part.first_index = static_cast<std::uint32_t>(out);
+      for (std::size_t i = begin; i < end; i += 3) {
+        std::uint32_t a = remap[result[i]];
+        std::uint32_t b = remap[result[i + 1]];
+        std::uint32_t c = remap[result[i + 2]];
+        if (a != b && b != c && c != a) {
+          result[out++] = a;
+          result[out++] = b;
+          result[out++] = c;
+        }
+      }
+      part.index_count =
+          static_cast<std::uint32_t>(out) - part.first_index;
+    }
+    result.resize(out);
+  }
+  result_error = static_cast<float>(std::sqrt(max_error));
+  return result;
+}
+
+/**
+  Append a chain of simplified levels to the index buffer.
+
+  indices holds the full detail mesh on entry and submeshes
+  its draw ranges. Every level targets half the triangles of
+  the previous one and is appended after it, together with
+  its draw ranges, with every range optimized for the post
+  transform cache. The chain stops when a level no longer
+  gets meaningfully smaller. Every level is simplified from
+  the previous one, so its error is the sum of the errors of
+  the steps, a bound of its distance to the full mesh.
+ */
+inline std::vector<MeshLod>
+build_lod_chain(const std::vector<Vertex> &vertices,
+                std::vector<std::uint32_t> &indices,
+                std::vector<Submesh> &submeshes,
+                std::size_t max_lod_count = 6) {
+  std::vector<MeshLod> lods;
+  lods.push_back(
+      {0, static_cast<std::uint32_t>(indices.size()), 0.0f});
+  std::vector<std::uint32_t> level(indices);
+  std::vector<Submesh> level_ranges(submeshes);
+  float error = 0.0f;
+  while (lods.size() < max_lod_count) {
+    std::size_t target = (level.size() / 3 / 2) * 3;
+    float level_error = 0.0f;
+    std::vector<Submesh> next_ranges(level_ranges);
+    std::vector<std::uint32_t> next = simplify_mesh(
+        vertices, level, target, level_error, &next_ranges);
+    if (next.empty() || next.size() * 10 > level.size() * 9) {
+      break;
+    }
+    optimize_vertex_cache(next, next_ranges, vertices.size());
+    error += level_error;
+    auto first = static_cast<std::uint32_t>(indices.size());
+    lods.push_back(
+        {first, static_cast<std::uint32_t>(next.size()), error});
+    for (Submesh range : next_ranges) {
+      range.first_index += first;
+      submeshes.push_back(range);
+    }
+    indices.insert(indices.end(), next.begin(), next.end());
+    level.swap(next);
+    level_ranges.swap(next_ranges);
+  }
+  return lods;
+}
+
+/**
+  Pick the coarsest level whose error, projected to the
+  screen, stays under the given number of pixels.
+
+  \param distance distance from the camera to the nearest
+  point of the mesh bounds.
+
+  \param pixels_per_unit size in pixels of one model unit at
+  distance 1, proj[1][1] * viewport height / 2.
+ */
+inline std::size_t select_lod(const MeshLod *lods,
+                              std::size_t lod_count,
+                              float distance,
+                              float pixels_per_unit,
+                              float max_pixel_error = 1.0f) {
+  std::size_t selected = 0;
+  distance = std::max(distance, 1e-4f);
+  for (std::size_t i = 1; i < lod_count; i++) {
+    float pixel_error =
+        lods[i].error * pixels_per_unit / distance;
+    if (pixel_error > max_pixel_error) {
+      break;
+    }
+    selected = i;
+  }
+  return selected;
+}
+}
@@ -0,0 +1,147 @@
+// ring of host visible memory staging the uploads
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <external.hpp>
+#include <mutex>
+
+namespace vtuto {
+
+/** range of the staging ring holding an upload */
+struct StagingRange {
+  VkBuffer buffer = VK_NULL_HANDLE;
+  /** offset of the range in the buffer */
+  VkDeviceSize offset = 0;
+  VkDeviceSize size = 0;
+  /** mapped address of the range */
+  void *data = nullptr;
+  /** position of the range in the ring */
+  VkDeviceSize position = 0;
+};
+
+/**
+  Staging memory handed out in the order of the uploads.
+
+  The ring is one persistently mapped buffer. Ranges are
+  taken at the head and released once the fence of the
+  commands reading them signaled, the space is reused when
+  every range before it is released. A range that does not
+  fit before the end of the buffer starts over at its
+  beginning.
+
+  Taking a range waits until there is space for it, so a
+  thread must not wait behind ranges that only it can
+  release. Closing the ring wakes the waiting threads,
+  which then throw.
+ */
+class staging_ring {
+  struct Entry {
+    VkDeviceSize begin;
+    VkDeviceSize end;
+    bool released;
+  };
+  VkBuffer buffer = VK_NULL_HANDLE;
+  std::uint8_t *data = nullptr;
+  VkDeviceSize ring_size = 0;
+  /** positions grow with every range, modulo ring_size */
+  VkDeviceSize head = 0;
+  VkDeviceSize tail = 0;
+  std::deque<Entry> entries;
+  bool closed = false;
+  std::mutex mutex;
+  std::condition_variable released;
+
+public:
+  /** use the mapped buffer of size bytes */
+  void reset(VkBuffer ring_buffer, void *mapped,
+             VkDeviceSize size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    buffer = ring_buffer;
+    data = static_cast<std::uint8_t *>(mapped);
+    ring_size = size;
+    head = tail = 0;
+    entries.clear();
+    closed = false;
+  }
+  VkDeviceSize capacity() const { return ring_size; }
+
+  /**
+    Take size bytes aligned to alignment, a power of two,
+    waiting for earlier ranges to be released.
+   */
+  StagingRange allocate(VkDeviceSize size,
+                        VkDeviceSize alignment = 16) {
+    checkSize(size);
+    std::unique_lock<std::mutex> lock(mutex);
+    StagingRange range;
+    released.wait(lock, [&] {
+      return closed || take(size, alignment, range);
+    });
+    if (closed) {
+      throw std::runtime_error("staging ring is closed");
+    }
+    return range;
+  }
+
+  /** take a range if there is space for it now */
+  bool try_allocate(VkDeviceSize size, StagingRange &range,
+                    VkDeviceSize alignment = 16) {
+    checkSize(size);
+    std::lock_guard<std::mutex> lock(mutex);
+    return !closed && take(size, alignment, range);
+  }
+
+  /** the device no longer reads the range */
+  void release(const StagingRange &range) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (Entry &e : entries) {
+      if (e.begin == range.position) {
+        e.released = true;
+      }
+    }
+    while (!entries.empty() && entries.front().released) {
+      tail = entries.front().end;
+      entries.pop_front();
+    }
+    // an empty ring starts over at the beginning
+    if (entries.empty()) {
+      head = tail = 0;
+    }
+    released.notify_all();
+  }
+
+  /** fail the waiting and the next allocations */
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    released.notify_all();
+  }
+
+private:
+  void checkSize(VkDeviceSize size) const {
+    if (size > ring_size) {
+      throw std::runtime_error(
+          "upload does not fit the staging ring");
+    }
+  }
+  bool take(VkDeviceSize size, VkDeviceSize alignment,
+            StagingRange &range) {
+    VkDeviceSize position =
+        (head + alignment - 1) & ~(alignment - 1);
+    if (position % ring_size + size > ring_size) {
+      position += ring_size - position % ring_size;
+    }
+    if (position + size - tail > ring_size) {
+      return false;
+    }
+    range.buffer = buffer;
+    range.offset = position % ring_size;
+    range.size = size;
+    range.data = data + range.offset;
+    range.position = head;
+    entries.push_back(Entry{head, position + size, false});
+    head = position + size;
+    return true;
+  }
+};
+}
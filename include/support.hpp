@@ -9,6 +9,11 @@ std::vector<const char *> device_extensions = {
 struct QueuFamilyIndices {
   std::optional<uint32_t> graphics_family;
   std::optional<uint32_t> present_family;
+  /**
+    family without graphics that copies, uploads run on it
+    beside the rendering when the device has one
+   */
+  std::optional<uint32_t> transfer_family;
   bool is_complete() {
     return graphics_family.has_value() &&
            present_family.has_value();
@@ -16,43 +21,41 @@ struct QueuFamilyIndices {
   /**
   Find device family indices for given VkPhysicalDevice
 
-  We query the given physical device for physical device
-  family properties. We break away if the device has
-  complete
-  number of indices for given device family.
+  The family properties come from the capabilities of the
+  physical device, only the present support is queried. The
+  graphics and present families are the first that complete
+  them, every family is seen for the transfer one.
   */
 
-  static QueuFamilyIndices
-  find_family_indices(VkPhysicalDevice pdev,
-                      VkSurfaceKHR surface) {
+  static QueuFamilyIndices find_family_indices(
+      VkPhysicalDevice pdev, VkSurfaceKHR surface,
+      const std::vector<VkQueueFamilyProperties>
+          &queueFamilies) {
     QueuFamilyIndices indices;
-    uint32_t familyCount = 0;
-    vkGetPhysicalDeviceQueueFamilyProperties(
-        pdev, &familyCount, nullptr);
-    //
-    std::vector<VkQueueFamilyProperties> queueFamilies(
-        familyCount);
-
-    vkGetPhysicalDeviceQueueFamilyProperties(
-        pdev, &familyCount, queueFamilies.data());
-
     uint32_t i = 0;
     for (const auto &qfamily : queueFamilies) {
       //
-      if (qfamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
-        indices.graphics_family = i;
-      }
-
-      VkBool32 present_support = false;
-      vkGetPhysicalDeviceSurfaceSupportKHR(
-          pdev, i, surface, &present_support);
-
-      if (present_support) {
-        indices.present_family = i;
+      if (!indices.is_complete()) {
+        if (qfamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+          indices.graphics_family = i;
+        }
+
+        VkBool32 present_support = false;
+        vkGetPhysicalDeviceSurfaceSupportKHR(
+            pdev, i, surface, &present_support);
+
+        if (present_support) {
+          indices.present_family = i;
+        }
       }
 
-      if (indices.is_complete()) {
-        break;
+      // prefer a family that only copies over a compute one
+      VkQueueFlags flags = qfamily.queueFlags;
+      if ((flags & VK_QUEUE_TRANSFER_BIT) &&
+          !(flags & VK_QUEUE_GRAPHICS_BIT) &&
+          (!indices.transfer_family.has_value() ||
+           !(flags & VK_QUEUE_COMPUTE_BIT))) {
+        indices.transfer_family = i;
       }
       i++;
     }
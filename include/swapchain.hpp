@@ -6,6 +6,7 @@
 #include <framebuffer.hpp>
 #include <imageview.hpp>
 #include <ldevice.hpp>
+#include <memoryallocator.hpp>
 #include <pdevice.hpp>
 #include <support.hpp>
 #include <utils.hpp>
@@ -77,7 +78,8 @@ public:
 
     QueuFamilyIndices indices =
         QueuFamilyIndices::find_family_indices(
-            physical_dev.pdevice, physical_dev.surface);
+            physical_dev.pdevice, physical_dev.surface,
+            physical_dev.capabilities.queue_families);
     uint32_t qfamily_indices[] = {
         indices.graphics_family.value(),
         indices.present_family.value()};
@@ -182,19 +184,19 @@ public:
       VkRenderPass &render_pass,
       VkPipeline &graphics_pipeline,
       VkPipelineLayout &pipeline_layout,
-      std::vector<VkBuffer> &uniform_buffers,
-      std::vector<VkDeviceMemory> &uniform_buffer_memories,
+      VkBuffer &uniform_buffer,
+      MemoryAllocation &uniform_buffer_memory,
       VkDescriptorPool &descriptor_pool,
       VkImage &depth_image, VkImageView &depth_image_view,
-      VkDeviceMemory &depth_image_memory
+      MemoryAllocation &depth_image_memory,
+      memory_allocator &allocator
       ) {
     // clear out depth image view
     vkDestroyImageView(logical_dev.device(),
                        depth_image_view, nullptr);
     vkDestroyImage(logical_dev.device(), depth_image,
                    nullptr);
-    vkFreeMemory(logical_dev.device(), depth_image_memory,
-                 nullptr);
+    allocator.free(depth_image_memory);
     //
     vkFreeCommandBuffers(
         logical_dev.device(), command_pool,
@@ -218,13 +220,10 @@ public:
     // 3. destroy swap chain
     vkDestroySwapchainKHR(logical_dev.device(), chain,
                           nullptr);
-    // 4. destroy uniform buffers
-    for (std::size_t i = 0; i < simages.size(); i++) {
-      vkDestroyBuffer(logical_dev.device(),
-                      uniform_buffers[i], nullptr);
-      vkFreeMemory(logical_dev.device(),
-                   uniform_buffer_memories[i], nullptr);
-    }
+    // 4. destroy uniform buffer
+    vkDestroyBuffer(logical_dev.device(), uniform_buffer,
+                    nullptr);
+    allocator.free(uniform_buffer_memory);
     // 5. destroy descriptor pool
     vkDestroyDescriptorPool(logical_dev.device(),
                             descriptor_pool, nullptr);
@@ -0,0 +1,244 @@
+// memory mapped cache of block compressed textures
+#pragma once
+#include <bcenc.hpp>
+#include <cstring>
+#include <external.hpp>
+#include <meshcache.hpp>
+#include <mipmap.hpp>
+
+namespace vtuto {
+
+/** range of a mip level in a texture cache file */
+struct TextureCacheLevel {
+  std::uint64_t offset;
+  std::uint64_t size;
+};
+
+/**
+  Header of a texture cache file.
+
+  The layout follows KTX2 in spirit: the source path and
+  the level index follow the header, then the levels of the
+  mip chain, largest first and tightly packed in 4x4 blocks
+  of the given vulkan format, so they can be copied to an
+  image as they are.
+ */
+struct TextureCacheHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t format;
+  std::uint32_t width;
+  std::uint32_t height;
+  std::uint32_t level_count;
+  std::uint32_t path_length;
+  std::uint64_t source_size;
+  std::int64_t source_mtime_ns;
+};
+
+/**
+  Cache of the block compressed mip chain of a texture.
+
+  Like mesh_cache, the file lives next to the source image
+  and is keyed by its path, size and modification time. A
+  valid cache is memory mapped and its levels are copied to
+  the staging memory in one go, so the image is neither
+  decoded nor compressed again.
+ */
+class texture_cache {
+  static constexpr std::uint32_t format_version = 1;
+  static constexpr std::uint64_t data_alignment = 16;
+
+  mapped_file file;
+  TextureCacheHeader header{};
+  std::vector<TextureCacheLevel> level_index;
+
+public:
+  static std::string cache_path(const std::string &source) {
+    return source + ".vttex";
+  }
+
+  /**
+    Map the cache of the given source image.
+
+    \return false if there is no cache or if it is stale.
+   */
+  bool open(const std::string &source) {
+    close();
+    TextureCacheHeader expected{};
+    if (!make_header(source, expected)) {
+      return false;
+    }
+    if (!file.open(cache_path(source))) {
+      return false;
+    }
+    if (file.size() < sizeof(header)) {
+      close();
+      return false;
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    std::uint64_t index_offset =
+        sizeof(header) + header.path_length;
+    bool matches =
+        std::memcmp(header.magic, expected.magic,
+                    sizeof(header.magic)) == 0 &&
+        header.version == expected.version &&
+        header.path_length == expected.path_length &&
+        header.source_size == expected.source_size &&
+        header.source_mtime_ns == expected.source_mtime_ns &&
+        is_block_format(static_cast<VkFormat>(header.format)) &&
+        header.width > 0 && header.height > 0 &&
+        header.level_count > 0 && header.level_count <= 32 &&
+        index_offset + header.level_count *
+                           sizeof(TextureCacheLevel) <=
+            file.size() &&
+        std::memcmp(file.data() + sizeof(header),
+                    source.data(), source.size()) == 0;
+    if (!matches) {
+      close();
+      return false;
+    }
+    level_index.resize(header.level_count);
+    std::memcpy(level_index.data(), file.data() + index_offset,
+                header.level_count * sizeof(TextureCacheLevel));
+    // levels are contiguous, the staging copy is a single one
+    auto format = static_cast<VkFormat>(header.format);
+    std::uint64_t offset = level_index[0].offset;
+    std::vector<MipLevel> expected_levels = mip_chain_layout(
+        header.width, header.height, header.level_count);
+    for (std::size_t l = 0; l < level_index.size(); l++) {
+      const MipLevel &level = expected_levels[l];
+      if (level_index[l].offset != offset ||
+          level_index[l].size !=
+              compressed_size(format, level.width,
+                              level.height)) {
+        close();
+        return false;
+      }
+      offset += level_index[l].size;
+    }
+    if (offset > file.size()) {
+      close();
+      return false;
+    }
+    return true;
+  }
+  void close() {
+    file.close();
+    header = TextureCacheHeader{};
+    level_index.clear();
+  }
+  bool is_open() const { return file.is_open(); }
+  VkFormat format() const {
+    return static_cast<VkFormat>(header.format);
+  }
+
+  /** levels, with offsets relative to the first one */
+  std::vector<MipLevel> levels() const {
+    std::vector<MipLevel> levels = mip_chain_layout(
+        header.width, header.height, header.level_count);
+    for (std::size_t l = 0; l < levels.size(); l++) {
+      levels[l].offset =
+          level_index[l].offset - level_index[0].offset;
+    }
+    return levels;
+  }
+  /** the levels of the chain, one after the other */
+  const char *level_data() const {
+    return file.data() + level_index[0].offset;
+  }
+  VkDeviceSize level_data_size() const {
+    const auto &last = level_index.back();
+    return last.offset + last.size - level_index[0].offset;
+  }
+
+  /**
+    Write the cache of the given source image from a block
+    compressed mip chain, as laid out by levels.
+
+    The file is written under a temporary name and renamed,
+    so a reader never maps a half written cache.
+   */
+  static void write(const std::string &source, VkFormat format,
+                    const std::vector<MipLevel> &levels,
+                    const std::uint8_t *data) {
+    TextureCacheHeader header{};
+    if (!make_header(source, header)) {
+      throw std::runtime_error(
+          "texture cache: can not stat source " + source);
+    }
+    header.format = static_cast<std::uint32_t>(format);
+    header.width = levels[0].width;
+    header.height = levels[0].height;
+    header.level_count =
+        static_cast<std::uint32_t>(levels.size());
+    std::vector<TextureCacheLevel> index;
+    std::uint64_t offset = align_up(
+        sizeof(header) + header.path_length +
+        levels.size() * sizeof(TextureCacheLevel));
+    for (const auto &level : levels) {
+      index.push_back(
+          {offset,
+           compressed_size(format, level.width, level.height)});
+      offset += index.back().size;
+    }
+
+    std::string tmp_path = cache_path(source) + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary);
+    if (!out.is_open()) {
+      throw std::runtime_error(
+          "texture cache: can not open " + tmp_path);
+    }
+    out.write(reinterpret_cast<const char *>(&header),
+              sizeof(header));
+    out.write(source.data(),
+              static_cast<std::streamsize>(source.size()));
+    out.write(reinterpret_cast<const char *>(index.data()),
+              static_cast<std::streamsize>(
+                  index.size() * sizeof(TextureCacheLevel)));
+    while (static_cast<std::uint64_t>(out.tellp()) <
+           index[0].offset) {
+      out.put('\0');
+    }
+    for (std::size_t l = 0; l < levels.size(); l++) {
+      out.write(reinterpret_cast<const char *>(data) +
+                    levels[l].offset,
+                static_cast<std::streamsize>(index[l].size));
+    }
+    out.close();
+    if (!out) {
+      std::remove(tmp_path.c_str());
+      throw std::runtime_error(
+          "texture cache: failed to write " + tmp_path);
+    }
+    if (std::rename(tmp_path.c_str(),
+                    cache_path(source).c_str()) != 0) {
+      std::remove(tmp_path.c_str());
+      throw std::runtime_error(
+          "texture cache: failed to rename " + tmp_path);
+    }
+  }
+
+private:
+  static std::uint64_t align_up(std::uint64_t v) {
+    return (v + data_alignment - 1) & ~(data_alignment - 1);
+  }
+  static bool make_header(const std::string &source,
+                          TextureCacheHeader &header) {
+    struct stat st;
+    if (stat(source.c_str(), &st) != 0) {
+      return false;
+    }
+    std::memcpy(header.magic, "VTTEX\0\0\0",
+                sizeof(header.magic));
+    header.version = format_version;
+    header.path_length =
+        static_cast<std::uint32_t>(source.size());
+    header.source_size = static_cast<std::uint64_t>(st.st_size);
+    header.source_mtime_ns =
+        static_cast<std::int64_t>(st.st_mtim.tv_sec) *
+            1000000000 +
+        st.st_mtim.tv_nsec;
+    return true;
+  }
+};
+}
@@ -0,0 +1,187 @@
+// device memory budget of the streamed textures
+#pragma once
+#include <bcenc.hpp>
+#include <external.hpp>
+#include <meshcache.hpp>
+#include <mipmap.hpp>
+
+namespace vtuto {
+
+/**
+  64 bit FNV-1a of the contents of a file, textures with the
+  same contents share a device image whatever their path.
+ */
+inline std::uint64_t content_hash(const std::string &path) {
+  mapped_file file;
+  if (!file.open(path)) {
+    throw std::runtime_error("texture can not be read: " +
+                             path);
+  }
+  std::uint64_t hash = 14695981039346656037ull;
+  auto bytes =
+      reinterpret_cast<const std::uint8_t *>(file.data());
+  for (std::size_t i = 0; i < file.size(); i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+/** texel bytes of a mip level in the format */
+inline VkDeviceSize level_bytes(VkFormat format,
+                                const MipLevel &level) {
+  if (is_block_format(format)) {
+    return compressed_size(format, level.width, level.height);
+  }
+  return VkDeviceSize(level.width) * level.height * 4;
+}
+
+struct TextureResidencyStats {
+  VkDeviceSize budget = 0;
+  VkDeviceSize resident_bytes = 0;
+  VkDeviceSize peak_bytes = 0;
+  std::size_t texture_count = 0;
+  /** textures with every level resident */
+  std::size_t complete_count = 0;
+  std::size_t evicted_levels = 0;
+  std::size_t restream_count = 0;
+};
+
+inline std::ostream &operator<<(std::ostream &out,
+                                const TextureResidencyStats &s) {
+  return out << "texture residency: "
+             << (s.resident_bytes >> 10) << " of "
+             << (s.budget >> 10) << " KiB, peak "
+             << (s.peak_bytes >> 10) << " KiB, "
+             << s.complete_count << " of " << s.texture_count
+             << " textures complete, " << s.evicted_levels
+             << " levels evicted, " << s.restream_count
+             << " restreams";
+}
+
+/**
+  Texture levels resident on the device against a budget.
+
+  Every texture keeps its levels from first_level() on, the
+  finest ones go first. Textures sampled in a frame are
+  touched, and when the budget is exceeded the levels of
+  the least recently sampled textures are evicted, finest
+  level first, leaving those sampled in the current frame.
+  A texture that is sampled with missing levels wants to be
+  streamed again, and is not evicted until it is resident.
+ */
+class texture_residency {
+  struct Entry {
+    /** texel bytes of every level, empty until resident */
+    std::vector<VkDeviceSize> level_sizes;
+    std::uint32_t first_level = 0;
+    std::uint64_t last_used = 0;
+    bool streaming = false;
+  };
+  std::vector<Entry> entries;
+  /** frames start at 1, 0 is never sampled */
+  std::uint64_t frame = 1;
+  TextureResidencyStats counters;
+
+public:
+  void reset(std::size_t texture_count, VkDeviceSize budget) {
+    entries.assign(texture_count, Entry{});
+    frame = 1;
+    counters = TextureResidencyStats{};
+    counters.budget = budget;
+    counters.texture_count = texture_count;
+  }
+  void next_frame() { frame++; }
+  void touch(std::size_t texture) {
+    entries[texture].last_used = frame;
+  }
+  std::uint32_t first_level(std::size_t texture) const {
+    return entries[texture].first_level;
+  }
+  /** the texture is streamed again */
+  void stream(std::size_t texture) {
+    entries[texture].streaming = true;
+  }
+
+  /** the texture is resident with all of its levels */
+  void set_resident(std::size_t texture,
+                    std::vector<VkDeviceSize> level_sizes) {
+    Entry &e = entries[texture];
+    if (!e.level_sizes.empty()) {
+      counters.resident_bytes -= resident_size(e);
+      counters.restream_count++;
+    }
+    e.level_sizes = std::move(level_sizes);
+    e.first_level = 0;
+    e.streaming = false;
+    counters.resident_bytes += resident_size(e);
+    counters.peak_bytes =
+        std::max(counters.peak_bytes, counters.resident_bytes);
+  }
+
+  /** sampled in this frame while missing levels */
+  bool wants_levels(std::size_t texture) const {
+    const Entry &e = entries[texture];
+    return !e.level_sizes.empty() && e.first_level > 0 &&
+           !e.streaming && e.last_used == frame;
+  }
+
+  /**
+    Evict levels until the budget holds or only textures
+    sampled in this frame are left.
+
+    \return the textures that lost levels, their new
+    first_level() is the number of levels evicted and equals
+    the level count when none is left.
+   */
+  std::vector<std::size_t> evict() {
+    std::vector<std::size_t> order;
+    for (std::size_t t = 0; t < entries.size(); t++) {
+      const Entry &e = entries[t];
+      if (e.first_level < e.level_sizes.size() &&
+          !e.streaming && e.last_used < frame) {
+        order.push_back(t);
+      }
+    }
+    std::sort(order.begin(), order.end(),
+              [this](std::size_t a, std::size_t b) {
+                return entries[a].last_used <
+                       entries[b].last_used;
+              });
+    std::vector<std::size_t> evicted;
+    for (std::size_t t : order) {
+      Entry &e = entries[t];
+      if (counters.resident_bytes <= counters.budget) {
+        break;
+      }
+      while (counters.resident_bytes > counters.budget &&
+             e.first_level < e.level_sizes.size()) {
+        counters.resident_bytes -=
+            e.level_sizes[e.first_level++];
+        counters.evicted_levels++;
+      }
+      evicted.push_back(t);
+    }
+    return evicted;
+  }
+
+  TextureResidencyStats stats() const {
+    TextureResidencyStats s = counters;
+    for (const Entry &e : entries) {
+      if (!e.level_sizes.empty() && e.first_level == 0) {
+        s.complete_count++;
+      }
+    }
+    return s;
+  }
+
+private:
+  static VkDeviceSize resident_size(const Entry &e) {
+    VkDeviceSize size = 0;
+    auto first = e.level_sizes.begin() + e.first_level;
+    for (auto it = first; it != e.level_sizes.end(); ++it) {
+      size += *it;
+    }
+    return size;
+  }
+};
+}
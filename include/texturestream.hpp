@@ -0,0 +1,126 @@
+// textures decoded in the background and uploaded while
+// rendering
+#pragma once
+#include <atlas.hpp>
+#include <external.hpp>
+#include <future>
+#include <memory>
+#include <memoryallocator.hpp>
+#include <meshcache.hpp>
+#include <mipmap.hpp>
+#include <stagingring.hpp>
+
+namespace vtuto {
+
+/** rgba8 texels decoded by stb_image */
+using decoded_image =
+    std::unique_ptr<stbi_uc, void (*)(void *)>;
+
+/**
+  Decode an image file through a mapping of it, as rgba8.
+  \param alpha set if the file has an alpha channel.
+ */
+inline decoded_image decode_image(const std::string &path,
+                                  std::uint32_t &width,
+                                  std::uint32_t &height,
+                                  bool &alpha) {
+  mapped_file source;
+  decoded_image pixels(nullptr, stbi_image_free);
+  int w, h, channels;
+  if (source.open(path)) {
+    pixels.reset(stbi_load_from_memory(
+        reinterpret_cast<const stbi_uc *>(source.data()),
+        static_cast<int>(source.size()), &w, &h, &channels,
+        STBI_rgb_alpha));
+  }
+  if (!pixels) {
+    throw std::runtime_error(
+        "pixel data can not be loaded: " + path);
+  }
+  width = static_cast<std::uint32_t>(w);
+  height = static_cast<std::uint32_t>(h);
+  alpha = channels == 2 || channels == 4;
+  return pixels;
+}
+
+/** size of an image from its header, false if unreadable */
+inline bool image_size(const std::string &path,
+                       std::uint32_t &width,
+                       std::uint32_t &height) {
+  mapped_file source;
+  int w, h, channels;
+  if (!source.open(path) ||
+      stbi_info_from_memory(
+          reinterpret_cast<const stbi_uc *>(source.data()),
+          static_cast<int>(source.size()), &w, &h,
+          &channels) == 0) {
+    return false;
+  }
+  width = static_cast<std::uint32_t>(w);
+  height = static_cast<std::uint32_t>(h);
+  return true;
+}
+
+/**
+  Decode the tiles of an atlas into its rgba8 texels.
+  \param alpha set if any tile has an alpha channel.
+ */
+inline std::vector<std::uint8_t>
+compose_atlas(const AtlasLayout &atlas, bool &alpha) {
+  std::vector<std::uint8_t> texels(
+      std::size_t(atlas.width) * atlas.height * 4, 0);
+  alpha = false;
+  for (const AtlasTile &tile : atlas.tiles) {
+    std::uint32_t width, height;
+    bool tile_alpha;
+    decoded_image pixels =
+        decode_image(tile.source, width, height, tile_alpha);
+    if (width != tile.width || height != tile.height) {
+      throw std::runtime_error("atlas tile changed size: " +
+                               tile.source);
+    }
+    copy_tile(tile, pixels.get(), texels.data(), atlas.width);
+    alpha = alpha || tile_alpha;
+  }
+  return texels;
+}
+
+/** progress of a streamed texture */
+enum class TextureState { decoding, uploading, resident };
+
+/**
+  A texture on its way to the device, an image file or an
+  atlas of them.
+
+  The loader thread decodes the image, fills the staging
+  buffer and creates the image, then decoded is ready. The
+  main thread records the copy on the transfer queue and,
+  when the copy ran on its own family, the ownership
+  acquire on the graphics queue, which signal uploaded.
+ */
+struct TextureStream {
+  std::string path;
+  AtlasLayout atlas;
+  TextureState state = TextureState::decoding;
+  std::future<void> decoded;
+
+  /** filled by the loader thread */
+  VkFormat format = VK_FORMAT_UNDEFINED;
+  std::vector<MipLevel> levels;
+  /** only the first level is staged, the gpu blits the rest */
+  bool gpu_mipmaps = false;
+  /** the decoder writes the chain to the mapped staging */
+  StagingRange staging;
+  /** staging of its own, for textures larger than the ring */
+  VkBuffer staging_buffer = VK_NULL_HANDLE;
+  MemoryAllocation staging_memory;
+  VkImage image = VK_NULL_HANDLE;
+  MemoryAllocation image_memory;
+
+  /** upload commands, acquire is null on a single family */
+  VkCommandBuffer copy_commands = VK_NULL_HANDLE;
+  VkCommandBuffer acquire_commands = VK_NULL_HANDLE;
+  VkSemaphore copied = VK_NULL_HANDLE;
+  VkFence uploaded = VK_NULL_HANDLE;
+};
+}
@@ -0,0 +1,115 @@
+// fixed size worker pool for cpu side loading work
+#pragma once
+#include <condition_variable>
+#include <external.hpp>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+namespace vtuto {
+
+/**
+  Fixed size pool of worker threads.
+
+  Jobs are pushed to a single queue and picked up by the
+  first idle worker. submit() returns a future, so an
+  exception thrown by a job is rethrown on the thread that
+  calls get() on it.
+ */
+class thread_pool {
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> jobs;
+  std::mutex jobs_mutex;
+  std::condition_variable jobs_cv;
+  bool stopping = false;
+
+public:
+  /**
+    \param thread_count number of workers, 0 means one per
+    hardware thread.
+   */
+  explicit thread_pool(std::size_t thread_count = 0) {
+    if (thread_count == 0) {
+      thread_count = std::max(
+          1u, std::thread::hardware_concurrency());
+    }
+    workers.reserve(thread_count);
+    for (std::size_t i = 0; i < thread_count; i++) {
+      workers.emplace_back([this] { work(); });
+    }
+  }
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lock(jobs_mutex);
+      stopping = true;
+    }
+    jobs_cv.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+  std::size_t size() const { return workers.size(); }
+
+  template <class Fn>
+  std::future<void> submit(Fn &&fn) {
+    auto task = std::make_shared<std::packaged_task<void()>>(
+        std::forward<Fn>(fn));
+    std::future<void> result = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(jobs_mutex);
+      jobs.emplace([task] { (*task)(); });
+    }
+    jobs_cv.notify_one();
+    return result;
+  }
+
+  /**
+    Run fn(i) for every i in [0, count) on the pool and wait
+    for all of them. The first exception thrown by a job is
+    rethrown after every job has finished.
+   */
+  template <class Fn>
+  void parallel_for(std::size_t count, Fn fn) {
+    std::vector<std::future<void>> results;
+    results.reserve(count);
+    for (std::size_t i = 0; i < count; i++) {
+      results.push_back(submit([&fn, i] { fn(i); }));
+    }
+    std::exception_ptr error;
+    for (auto &r : results) {
+      try {
+        r.get();
+      } catch (...) {
+        if (!error) {
+          error = std::current_exception();
+        }
+      }
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+private:
+  void work() {
+    for (;;) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(jobs_mutex);
+        jobs_cv.wait(lock,
+                     [this] { return stopping || !jobs.empty(); });
+        if (stopping && jobs.empty()) {
+          return;
+        }
+        job = std::move(jobs.front());
+        jobs.pop();
+      }
+      job();
+    }
+  }
+};
+}
@@ -1,7 +1,7 @@
 #pragma once
 // vertex object
+#include <cstring>
 #include <external.hpp>
-#include <sstream>
 
 struct Vertex {
   glm::vec3 pos;
@@ -75,14 +75,43 @@ inline std::ostream &operator<<(std::ostream &out,
              << " y: " << v.texCoord.y << std::endl;
 }
 
+/**
+  Raw bit pattern of a float for hashing.
+
+  Adding 0.0f folds -0.0f into +0.0f so that two components
+  comparing equal with operator== also hash equally.
+ */
+inline std::uint32_t float_bits(float f) {
+  f += 0.0f;
+  std::uint32_t u;
+  std::memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
 namespace std {
 template <> struct hash<Vertex> {
+  /**
+    Hash the raw bits of the 8 vertex components.
+
+    Each component is folded in FNV-1a fashion, the result is
+    then mixed with the splitmix64 finalizer so that the low
+    bits are usable as a table index.
+   */
   size_t operator()(Vertex const &v) const {
-    //
-    stringstream ss;
-    ss << v;
-    string sv = ss.str();
-    return hash<string>()(sv);
+    const float comps[] = {v.pos.x,      v.pos.y,
+                           v.pos.z,      v.color.x,
+                           v.color.y,    v.color.z,
+                           v.texCoord.x, v.texCoord.y};
+    std::uint64_t h = 14695981039346656037ull;
+    for (float c : comps) {
+      h = (h ^ float_bits(c)) * 1099511628211ull;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return static_cast<size_t>(h);
   }
 };
 };
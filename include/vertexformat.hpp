@@ -0,0 +1,339 @@
+// compact vertex layouts for uploading meshes
+#pragma once
+#include <cstring>
+#include <external.hpp>
+#include <vertex.hpp>
+
+namespace vtuto {
+
+/**
+  Convert a float to an IEEE half, rounding to nearest.
+
+  Values below the smallest normal half flush to zero, values
+  above the largest half become infinity.
+ */
+inline std::uint16_t float_to_half(float f) {
+  std::uint32_t u;
+  std::memcpy(&u, &f, sizeof(u));
+  std::uint32_t sign = (u >> 16) & 0x8000;
+  std::uint32_t em = u & 0x7fffffff;
+  // rebias the exponent from 127 to 15 and round
+  std::uint32_t h = (em - (112u << 23) + (1u << 12)) >> 13;
+  if (em < (113u << 23)) {
+    h = 0;
+  }
+  if (em >= (143u << 23)) {
+    h = 0x7c00;
+  }
+  if (em > (255u << 23)) {
+    h = 0x7e00;
+  }
+  return static_cast<std::uint16_t>(sign | h);
+}
+
+/** [-1, 1] to a signed normalized 16 bit integer */
+inline std::int16_t to_snorm16(float f) {
+  f = std::min(std::max(f, -1.0f), 1.0f);
+  return static_cast<std::int16_t>(std::lround(f * 32767.0f));
+}
+
+/** [0, 1] to an unsigned normalized 16 bit integer */
+inline std::uint16_t to_unorm16(float f) {
+  f = std::min(std::max(f, 0.0f), 1.0f);
+  return static_cast<std::uint16_t>(std::lround(f * 65535.0f));
+}
+
+/** [0, 1] to an unsigned normalized 8 bit integer */
+inline std::uint8_t to_unorm8(float f) {
+  f = std::min(std::max(f, 0.0f), 1.0f);
+  return static_cast<std::uint8_t>(std::lround(f * 255.0f));
+}
+
+/*
+  Attribute encodings. Each one gives the stored type, the
+  vulkan format the vertex shader reads it with and the
+  encoding from the float attribute of Vertex. Three
+  component 16 bit formats are not guaranteed to be usable as
+  vertex input, so 16 bit positions are padded to four
+  components; the shader still reads a vec3.
+ */
+
+struct float_position {
+  using type = glm::vec3;
+  static constexpr VkFormat format = VK_FORMAT_R32G32B32_SFLOAT;
+  static constexpr bool quantized = false;
+  static type encode(glm::vec3 p) { return p; }
+};
+
+/** position in the [-1, 1] box of the mesh bounds */
+struct snorm16_position {
+  using type = std::array<std::int16_t, 4>;
+  static constexpr VkFormat format =
+      VK_FORMAT_R16G16B16A16_SNORM;
+  static constexpr bool quantized = true;
+  static type encode(glm::vec3 p) {
+    return {to_snorm16(p.x), to_snorm16(p.y), to_snorm16(p.z),
+            0};
+  }
+};
+
+/** half position in the [-1, 1] box of the mesh bounds */
+struct half_position {
+  using type = std::array<std::uint16_t, 4>;
+  static constexpr VkFormat format =
+      VK_FORMAT_R16G16B16A16_SFLOAT;
+  static constexpr bool quantized = true;
+  static type encode(glm::vec3 p) {
+    return {float_to_half(p.x), float_to_half(p.y),
+            float_to_half(p.z), 0};
+  }
+};
+
+struct float_color {
+  using type = glm::vec3;
+  static constexpr VkFormat format = VK_FORMAT_R32G32B32_SFLOAT;
+  static type encode(glm::vec3 c) { return c; }
+};
+
+struct unorm8_color {
+  using type = std::array<std::uint8_t, 4>;
+  static constexpr VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
+  static type encode(glm::vec3 c) {
+    return {to_unorm8(c.x), to_unorm8(c.y), to_unorm8(c.z),
+            255};
+  }
+};
+
+struct float_texcoord {
+  using type = glm::vec2;
+  static constexpr VkFormat format = VK_FORMAT_R32G32_SFLOAT;
+  static type encode(glm::vec2 t) { return t; }
+};
+
+/** keeps repeating texture coordinates outside [0, 1] */
+struct half_texcoord {
+  using type = std::array<std::uint16_t, 2>;
+  static constexpr VkFormat format = VK_FORMAT_R16G16_SFLOAT;
+  static type encode(glm::vec2 t) {
+    return {float_to_half(t.x), float_to_half(t.y)};
+  }
+};
+
+/** clamps texture coordinates to [0, 1] */
+struct unorm16_texcoord {
+  using type = std::array<std::uint16_t, 2>;
+  static constexpr VkFormat format = VK_FORMAT_R16G16_UNORM;
+  static type encode(glm::vec2 t) {
+    return {to_unorm16(t.x), to_unorm16(t.y)};
+  }
+};
+
+/**
+  Per mesh transform from quantized positions back to model
+  space. It is folded into the model matrix, so the vertex
+  shader does not need to know about it.
+ */
+struct VertexQuantization {
+  glm::vec3 offset = glm::vec3(0.0f);
+  glm::vec3 scale = glm::vec3(1.0f);
+
+  glm::mat4 dequantize() const {
+    return glm::scale(glm::translate(glm::mat4(1.0f), offset),
+                      scale);
+  }
+};
+
+/*
+  Vertex layouts. A layout gives the binding and attribute
+  descriptions of its vertex streams, built at compile time
+  from the encodings with the same locations as Vertex, so
+  the shaders do not change. The position only descriptions
+  are for pipelines that only need positions, like a depth
+  prepass or a shadow pass. pack_stream() encodes the
+  vertices of one stream.
+ */
+
+/** vertex stored interleaved in a single stream */
+template <class Position, class Color, class TexCoord>
+struct PackedVertex {
+  using position_format = Position;
+  using color_format = Color;
+  using texcoord_format = TexCoord;
+
+  typename Position::type pos;
+  typename Color::type color;
+  typename TexCoord::type texCoord;
+
+  static constexpr VkVertexInputBindingDescription
+  getBindingDescription() {
+    return {0, sizeof(PackedVertex),
+            VK_VERTEX_INPUT_RATE_VERTEX};
+  }
+  static constexpr std::array<VkVertexInputAttributeDescription,
+                              3>
+  getAttributeDescriptions() {
+    return {{{0, 0, Position::format,
+              offsetof(PackedVertex, pos)},
+             {1, 0, Color::format, offsetof(PackedVertex, color)},
+             {2, 0, TexCoord::format,
+              offsetof(PackedVertex, texCoord)}}};
+  }
+
+  static constexpr std::size_t stream_count = 1;
+  static constexpr std::array<VkVertexInputBindingDescription,
+                              1>
+  getBindingDescriptions() {
+    return {{getBindingDescription()}};
+  }
+  /** positions are read with the stride of the whole vertex */
+  static constexpr std::array<VkVertexInputBindingDescription,
+                              1>
+  getPositionBindingDescriptions() {
+    return getBindingDescriptions();
+  }
+  static constexpr std::array<VkVertexInputAttributeDescription,
+                              1>
+  getPositionAttributeDescriptions() {
+    return {{{0, 0, Position::format,
+              offsetof(PackedVertex, pos)}}};
+  }
+  static void pack_stream(std::size_t, const Vertex *vertices,
+                          std::size_t count, void *out,
+                          const VertexQuantization &quantization) {
+    auto *packed = static_cast<PackedVertex *>(out);
+    for (std::size_t i = 0; i < count; i++) {
+      const Vertex &v = vertices[i];
+      packed[i].pos = Position::encode(
+          (v.pos - quantization.offset) / quantization.scale);
+      packed[i].color = Color::encode(v.color);
+      packed[i].texCoord = TexCoord::encode(v.texCoord);
+    }
+  }
+};
+
+/**
+  Vertex stored as two streams, the positions in binding 0
+  and the other attributes in binding 1. Position only
+  pipelines bind the first stream alone and fetch
+  sizeof(PositionStream) bytes per vertex.
+ */
+template <class Position, class Color, class TexCoord>
+struct SplitVertex {
+  using position_format = Position;
+  using color_format = Color;
+  using texcoord_format = TexCoord;
+
+  struct PositionStream {
+    typename Position::type pos;
+  };
+  struct AttributeStream {
+    typename Color::type color;
+    typename TexCoord::type texCoord;
+  };
+
+  static constexpr std::size_t stream_count = 2;
+  static constexpr std::array<VkVertexInputBindingDescription,
+                              2>
+  getBindingDescriptions() {
+    return {{{0, sizeof(PositionStream),
+              VK_VERTEX_INPUT_RATE_VERTEX},
+             {1, sizeof(AttributeStream),
+              VK_VERTEX_INPUT_RATE_VERTEX}}};
+  }
+  static constexpr std::array<VkVertexInputAttributeDescription,
+                              3>
+  getAttributeDescriptions() {
+    return {{{0, 0, Position::format,
+              offsetof(PositionStream, pos)},
+             {1, 1, Color::format,
+              offsetof(AttributeStream, color)},
+             {2, 1, TexCoord::format,
+              offsetof(AttributeStream, texCoord)}}};
+  }
+  static constexpr std::array<VkVertexInputBindingDescription,
+                              1>
+  getPositionBindingDescriptions() {
+    return {{{0, sizeof(PositionStream),
+              VK_VERTEX_INPUT_RATE_VERTEX}}};
+  }
+  static constexpr std::array<VkVertexInputAttributeDescription,
+                              1>
+  getPositionAttributeDescriptions() {
+    return {{{0, 0, Position::format,
+              offsetof(PositionStream, pos)}}};
+  }
+  static void pack_stream(std::size_t stream,
+                          const Vertex *vertices,
+                          std::size_t count, void *out,
+                          const VertexQuantization &quantization) {
+    if (stream == 0) {
+      auto *positions = static_cast<PositionStream *>(out);
+      for (std::size_t i = 0; i < count; i++) {
+        positions[i].pos = Position::encode(
+            (vertices[i].pos - quantization.offset) /
+            quantization.scale);
+      }
+      return;
+    }
+    auto *attributes = static_cast<AttributeStream *>(out);
+    for (std::size_t i = 0; i < count; i++) {
+      attributes[i].color = Color::encode(vertices[i].color);
+      attributes[i].texCoord =
+          TexCoord::encode(vertices[i].texCoord);
+    }
+  }
+};
+
+/**
+  Quantization transform of the given layout for a mesh.
+
+  Quantized position encodings store positions relative to
+  the bounding box of the whole mesh, other encodings use the
+  identity.
+ */
+template <class V>
+VertexQuantization make_quantization(const Vertex *vertices,
+                                     std::size_t count) {
+  VertexQuantization quantization;
+  if (V::position_format::quantized && count > 0) {
+    glm::vec3 lo = vertices[0].pos;
+    glm::vec3 hi = vertices[0].pos;
+    for (std::size_t i = 1; i < count; i++) {
+      lo = glm::min(lo, vertices[i].pos);
+      hi = glm::max(hi, vertices[i].pos);
+    }
+    quantization.offset = (lo + hi) * 0.5f;
+    quantization.scale = glm::max((hi - lo) * 0.5f,
+                                  glm::vec3(1e-20f));
+  }
+  return quantization;
+}
+
+/**
+  Offsets of the streams of count vertices of a layout when
+  they are stored one after the other in a single buffer,
+  aligned for any attribute format. The last entry is the
+  size of the buffer.
+ */
+template <class V>
+std::array<VkDeviceSize, V::stream_count + 1>
+stream_offsets(std::size_t count) {
+  const VkDeviceSize alignment = 16;
+  auto bindings = V::getBindingDescriptions();
+  std::array<VkDeviceSize, V::stream_count + 1> offsets{};
+  for (std::size_t s = 0; s < V::stream_count; s++) {
+    VkDeviceSize end = offsets[s] + count * bindings[s].stride;
+    offsets[s + 1] = (end + alignment - 1) / alignment * alignment;
+  }
+  return offsets;
+}
+
+/**
+  layout of the model vertex buffer: 8 bytes of positions
+  and 8 bytes of attributes per vertex instead of 32 bytes.
+  PackedVertex with the same encodings gives the interleaved
+  layout.
+ */
+using ModelVertex =
+    SplitVertex<snorm16_position, unorm8_color, half_texcoord>;
+}
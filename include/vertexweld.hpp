@@ -0,0 +1,172 @@
+// vertex welding: deduplicates vertices while loading models
+#pragma once
+#include <external.hpp>
+#include <vertex.hpp>
+
+namespace vtuto {
+
+/** statistics gathered while welding vertices */
+struct VertexWeldStats {
+  /** number of vertices given to the welder (one per index)*/
+  std::size_t input_count = 0;
+
+  /** number of distinct vertices kept */
+  std::size_t unique_count = 0;
+
+  /** total number of slots visited over all lookups */
+  std::size_t probe_count = 0;
+
+  /** longest probe sequence of a single lookup */
+  std::size_t max_probe_length = 0;
+
+  /** number of slots in the hash table */
+  std::size_t table_size = 0;
+
+  /** number of times the table had to grow */
+  std::size_t rehash_count = 0;
+
+  /** fraction of input vertices that were duplicates */
+  double dedup_ratio() const {
+    if (input_count == 0) {
+      return 0.0;
+    }
+    return 1.0 - static_cast<double>(unique_count) /
+                     static_cast<double>(input_count);
+  }
+  double mean_probe_length() const {
+    if (input_count == 0) {
+      return 0.0;
+    }
+    return static_cast<double>(probe_count) /
+           static_cast<double>(input_count);
+  }
+};
+
+inline std::ostream &operator<<(std::ostream &out,
+                                const VertexWeldStats &s) {
+  return out << "vertex weld: " << s.input_count
+             << " input vertices, " << s.unique_count
+             << " unique (" << s.dedup_ratio() * 100.0
+             << "% duplicates)" << std::endl
+             << " table size: " << s.table_size
+             << " mean probe length: "
+             << s.mean_probe_length()
+             << " max probe length: " << s.max_probe_length
+             << " rehashes: " << s.rehash_count;
+}
+
+/**
+  Open addressing hash table for welding vertices.
+
+  Each slot stores the upper 32 bits of the vertex hash and
+  the index of the vertex in the output vector, so a lookup
+  only touches the vertex data itself when the stored hash
+  matches. Slots are probed linearly, which keeps a probe
+  sequence within a few cache lines. The table is sized ahead
+  of time from the expected number of input vertices (the
+  index count of the model) so that it never exceeds half
+  load and does not need to grow while loading.
+ */
+class vertex_weld {
+  struct slot {
+    std::uint32_t hash;
+    std::uint32_t index;
+  };
+  static constexpr std::uint32_t empty_slot = UINT32_MAX;
+
+  std::vector<slot> slots;
+  std::size_t mask = 0;
+  std::vector<Vertex> &vertices;
+
+public:
+  VertexWeldStats stats;
+
+public:
+  /**
+    \param vs output vertex vector, unique vertices are
+    appended to it.
+
+    \param expected_count expected number of calls to weld(),
+    usually the total index count of the model.
+   */
+  vertex_weld(std::vector<Vertex> &vs,
+              std::size_t expected_count)
+      : vertices(vs) {
+    resize_table(expected_count * 2);
+    for (std::uint32_t i = 0;
+         i < static_cast<std::uint32_t>(vertices.size());
+         i++) {
+      place(i);
+    }
+  }
+
+  /**
+    Find the given vertex in the table or append it to the
+    output vector.
+
+    \return index of the vertex in the output vector.
+   */
+  std::uint32_t weld(const Vertex &v) {
+    stats.input_count++;
+    if ((vertices.size() + 1) * 2 > slots.size()) {
+      grow();
+    }
+    std::uint64_t h = std::hash<Vertex>()(v);
+    std::uint32_t tag = hash_of(h);
+    std::size_t pos = static_cast<std::size_t>(h) & mask;
+    std::size_t probes = 1;
+    while (slots[pos].index != empty_slot) {
+      const slot &s = slots[pos];
+      if (s.hash == tag && vertices[s.index] == v) {
+        record_probes(probes);
+        return s.index;
+      }
+      pos = (pos + 1) & mask;
+      probes++;
+    }
+    record_probes(probes);
+    auto index = static_cast<std::uint32_t>(vertices.size());
+    slots[pos] = {tag, index};
+    vertices.push_back(v);
+    stats.unique_count++;
+    return index;
+  }
+
+private:
+  static std::uint32_t hash_of(std::uint64_t h) {
+    return static_cast<std::uint32_t>(h >> 32);
+  }
+  void record_probes(std::size_t probes) {
+    stats.probe_count += probes;
+    stats.max_probe_length =
+        std::max(stats.max_probe_length, probes);
+  }
+  void resize_table(std::size_t min_size) {
+    std::size_t size = 16;
+    while (size < min_size) {
+      size <<= 1;
+    }
+    slots.assign(size, slot{0, empty_slot});
+    mask = size - 1;
+    stats.table_size = size;
+  }
+  /** insert an index known to be absent from the table */
+  void place(std::uint32_t index) {
+    std::uint64_t h = std::hash<Vertex>()(vertices[index]);
+    std::size_t pos = static_cast<std::size_t>(h) & mask;
+    while (slots[pos].index != empty_slot) {
+      pos = (pos + 1) & mask;
+    }
+    slots[pos] = {hash_of(h), index};
+  }
+  void grow() {
+    resize_table(slots.size() * 2);
+    for (std::uint32_t i = 0;
+         i < static_cast<std::uint32_t>(vertices.size());
+         i++) {
+      place(i);
+    }
+    stats.rehash_count++;
+  }
+};
+}
@@ -1,4 +1,5 @@
 // main file
+#include <chrono>
 #include <debug.hpp>
 #include <external.hpp>
 #include <hellotriangle.hpp>
@@ -58,9 +59,10 @@ void HelloTriangle::initWindow() {
   window =
       glfwCreateWindow(win_width, win_height,
                        win_title.c_str(), nullptr, nullptr);
-  glfwSetWindowUserPointer(window, nullptr);
+  glfwSetWindowUserPointer(window, this);
   glfwSetFramebufferSizeCallback(
       window, framebuffer_resize_callback);
+  glfwSetMouseButtonCallback(window, mouse_button_callback);
 }
 /**
 Initialize vulkan.
@@ -99,11 +101,19 @@ void HelloTriangle::initVulkan() {
    */
   physical_dev =
       vulkan_device<VkPhysicalDevice>(&instance, window);
+  if (!device_capabilities_path.empty() &&
+      !physical_dev.capabilities.save(
+          device_capabilities_path)) {
+    std::cerr << "could not write "
+              << device_capabilities_path << std::endl;
+  }
 
   /** 4. Create logical device
    */
   logical_dev = vulkan_device<VkDevice>(
       enableValidationLayers, physical_dev);
+  allocator.init(physical_dev.capabilities,
+                 logical_dev.device());
 
   // 5. create swap chain
   swap_chain = swapchain(physical_dev, logical_dev, window);
@@ -138,20 +148,28 @@ void HelloTriangle::initVulkan() {
   // 11. create command pool
   // createCommandPool();
   command_pool = vk_command_pool(physical_dev, logical_dev);
+  transfer_pool = vk_command_pool(
+      logical_dev, logical_dev.transfer_family(),
+      VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+
+  // 11. staging ring of the uploads
+  createStagingRing();
 
   // 12. create depth image
   // createDepthRessources();
 
-  // 13. create texture images
-  createTextureImage();
+  // 13. load the model, its materials name the textures
+  loadModel();
 
-  // 14. create texture image viewer
-  createTextureImageView();
+  // 13. build the bvh of the model for picking
+  createModelBvh();
 
-  // 15. create texture sampler
-  createTextureSampler();
+  // 14. stream the texture images, materials sample a
+  // placeholder until theirs are resident
+  createTextureImage();
 
-  loadModel();
+  // 16. create texture sampler
+  createTextureSampler();
 
   // 16. create vertex buffer
   createVertexBuffer();
@@ -159,9 +177,15 @@ void HelloTriangle::initVulkan() {
   // 17. create index buffer
   createIndexBuffer();
 
+  // 17. create meshlet buffer
+  createMeshletBuffer();
+
   // 18. create uniform buffers
   createUniformBuffer();
 
+  // 18. create meshlet draw buffers
+  createDrawBuffers();
+
   // 19. create descriptor pool
   createDescriptorPool();
 
@@ -294,6 +318,7 @@ void HelloTriangle::renderLoop() {
   //
   while (!glfwWindowShouldClose(window)) {
     glfwPollEvents();
+    updateTextureStreams();
     draw();
   }
   vkDeviceWaitIdle(logical_dev.device());
@@ -305,38 +330,51 @@ void HelloTriangle::renderLoop() {
  */
 void HelloTriangle::cleanUp() {
   //
+  std::cout << residency.stats() << std::endl;
+  destroyTextureStreams();
+  destroyDrawBuffers();
   auto v = cmd_buffers.to_vec();
   swap_chain.destroy(
       logical_dev, command_pool.pool, v,
       swapchain_framebuffers, render_pass,
-      graphics_pipeline, pipeline_layout, uniform_buffers,
-      uniform_buffer_memories, descriptor_pool, depth_image,
-      depth_image_view, depth_image_memory);
+      graphics_pipeline, pipeline_layout, uniform_buffer,
+      uniform_buffer_memory, descriptor_pool, depth_image,
+      depth_image_view, depth_image_memory, allocator);
 
   // destroy texture sampler
   vkDestroySampler(logical_dev.device(), texture_sampler,
                    nullptr);
-  // destroy image view
+  // destroy image views
+  for (auto view : texture_image_views) {
+    vkDestroyImageView(logical_dev.device(), view, nullptr);
+  }
   vkDestroyImageView(logical_dev.device(),
-                     texture_image_view, nullptr);
-  //
-  vkDestroyImage(logical_dev.device(), texture_image,
+                     placeholder_image_view, nullptr);
+  vkDestroyImage(logical_dev.device(), placeholder_image,
                  nullptr);
-  vkFreeMemory(logical_dev.device(), texture_image_memory,
-               nullptr);
+  allocator.free(placeholder_image_memory);
+  //
+  for (std::size_t i = 0; i < texture_images.size(); i++) {
+    vkDestroyImage(logical_dev.device(), texture_images[i],
+                   nullptr);
+    allocator.free(texture_image_memories[i]);
+  }
   //
   vkDestroyDescriptorSetLayout(
       logical_dev.device(), descriptor_set_layout, nullptr);
 
   vkDestroyBuffer(logical_dev.device(), index_buffer,
                   nullptr);
-  vkFreeMemory(logical_dev.device(), index_buffer_memory,
-               nullptr);
+  allocator.free(index_buffer_memory);
+
+  vkDestroyBuffer(logical_dev.device(), meshlet_buffer,
+                  nullptr);
+  allocator.free(meshlet_buffer_memory);
 
   vkDestroyBuffer(logical_dev.device(), vertex_buffer,
                   nullptr);
-  vkFreeMemory(logical_dev.device(), vertex_buffer_memory,
-               nullptr);
+  allocator.free(vertex_buffer_memory);
+  model_cache.close();
 
   for (std::size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
     vkDestroySemaphore(logical_dev.device(),
@@ -349,6 +387,16 @@ void HelloTriangle::cleanUp() {
                    nullptr);
   }
   command_pool.destroy(logical_dev);
+  transfer_pool.destroy(logical_dev);
+  vkDestroyBuffer(logical_dev.device(), staging_ring_buffer,
+                  nullptr);
+  allocator.free(staging_ring_memory);
+  std::vector<MemoryHeapStats> heaps = allocator.stats();
+  for (std::size_t h = 0; h < heaps.size(); h++) {
+    std::cout << "memory heap " << h << ": " << heaps[h]
+              << std::endl;
+  }
+  allocator.destroy();
 
   // 4. destroy logical device
   logical_dev.destroy();
@@ -760,12 +808,13 @@ void HelloTriangle::createGraphicsPipeline() {
   VkPipelineVertexInputStateCreateInfo vxInputInfo{};
   vxInputInfo.sType =
       VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-  auto bindingDescr = Vertex::getBindingDescription();
-  auto attrDescr = Vertex::getAttributeDescriptions();
-  vxInputInfo.vertexBindingDescriptionCount = 1;
+  auto bindingDescr = ModelVertex::getBindingDescriptions();
+  auto attrDescr = ModelVertex::getAttributeDescriptions();
+  vxInputInfo.vertexBindingDescriptionCount =
+      static_cast<uint32_t>(bindingDescr.size());
   vxInputInfo.vertexAttributeDescriptionCount =
       static_cast<uint32_t>(attrDescr.size());
-  vxInputInfo.pVertexBindingDescriptions = &bindingDescr;
+  vxInputInfo.pVertexBindingDescriptions = bindingDescr.data();
   vxInputInfo.pVertexAttributeDescriptions =
       attrDescr.data();
 
@@ -936,21 +985,12 @@ VkFormat HelloTriangle::findSupportedFormat(
     VkImageTiling tiling, VkFormatFeatureFlags features) {
   //
   for (VkFormat candidate : candidates) {
-    VkFormatProperties props;
-    vkGetPhysicalDeviceFormatProperties(
-        physical_dev.device(), candidate, &props);
-    if (tiling == VK_IMAGE_TILING_LINEAR &&
-        (props.linearTilingFeatures & features) ==
-            features) {
-      return candidate;
-    } else if (tiling == VK_IMAGE_TILING_OPTIMAL &&
-               (props.optimalTilingFeatures & features) ==
-                   features) {
+    if (physical_dev.capabilities.supports(candidate, tiling,
+                                           features)) {
       return candidate;
     }
-    throw std::runtime_error(
-        "failed to find supported depth format");
   }
+  throw std::runtime_error("failed to find supported format");
 }
 VkFormat HelloTriangle::findDepthFormat() {
   auto candidates = {
@@ -962,80 +1002,848 @@ VkFormat HelloTriangle::findDepthFormat() {
       VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT;
   return findSupportedFormat(candidates, tiling, features);
 }
+/**
+  Block compressed format for textures with or without
+  alpha, or uncompressed rgba when the device samples none.
+  Opaque textures use BC1, a quarter of the size of BC7.
+ */
+VkFormat HelloTriangle::findTextureFormat(bool alpha) {
+  std::vector<VkFormat> candidates = {
+      VK_FORMAT_BC7_SRGB_BLOCK, VK_FORMAT_BC3_SRGB_BLOCK};
+  if (!alpha) {
+    candidates.insert(candidates.begin(),
+                      VK_FORMAT_BC1_RGB_SRGB_BLOCK);
+  }
+  auto tiling = VK_IMAGE_TILING_OPTIMAL;
+  auto features =
+      VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT |
+      VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+  try {
+    return findSupportedFormat(candidates, tiling, features);
+  } catch (const std::runtime_error &) {
+    return VK_FORMAT_R8G8B8A8_SRGB;
+  }
+}
 bool HelloTriangle::hasStencilSupport(VkFormat format) {
   return format == VK_FORMAT_D32_SFLOAT_S8_UINT ||
          format == VK_FORMAT_D24_UNORM_S8_UINT;
 }
+/**
+  Stream the textures of the model materials. Materials
+  whose files have the same contents share a texture,
+  materials without one use model_texture_path. Every
+  texture is decoded on the loader thread while the
+  placeholder is sampled.
+ */
 void HelloTriangle::createTextureImage() {
-  //
-  int imwidth, imheight, imchannel;
-  const char *mpath = model_texture_path.c_str();
-  stbi_uc *pixels = stbi_load(mpath, &imwidth, &imheight,
-                              &imchannel, STBI_rgb_alpha);
-  VkDeviceSize imsize = imwidth * imheight * 4;
-  if (!pixels) {
-    throw std::runtime_error(
-        "pixel data can not be loaded");
-  }
-  VkBufferUsageFlags usage =
-      VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-  VkMemoryPropertyFlags mem_flags =
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-
-  createBuffer(imsize, usage, mem_flags, staging_buffer,
-               stage_buffer_memory);
-  void *data;
-  vkMapMemory(logical_dev.device(), stage_buffer_memory, 0,
-              imsize, 0, &data);
-  memcpy(data, pixels, static_cast<std::size_t>(imsize));
-  vkUnmapMemory(logical_dev.device(), stage_buffer_memory);
-  //
-  stbi_image_free(pixels);
+  createPlaceholderTexture();
+  MeshView mesh = modelMesh();
+  std::unordered_map<std::string, std::size_t> textures;
+  std::unordered_map<std::uint64_t, std::size_t> contents;
+  std::vector<std::string> paths;
+  material_textures.clear();
+  for (std::size_t m = 0; m < mesh.material_count; m++) {
+    const char *texture = mesh.materials[m].texture;
+    std::string path(texture,
+                     strnlen(texture, sizeof(MeshMaterial)));
+    if (path.empty()) {
+      path = model_texture_path;
+    }
+    auto it = textures.find(path);
+    if (it == textures.end()) {
+      auto content =
+          contents.emplace(content_hash(path), paths.size());
+      if (content.second) {
+        paths.push_back(path);
+      }
+      it = textures.emplace(path, content.first->second).first;
+    }
+    material_textures.push_back(it->second);
+  }
+  // small textures share atlases, which follow the others
+  std::vector<AtlasLayout> atlases = packTextureAtlases(paths);
+  std::size_t count = paths.size() + atlases.size();
+  texture_images.assign(count, VK_NULL_HANDLE);
+  texture_image_memories.assign(count, MemoryAllocation{});
+  texture_formats.assign(count, VK_FORMAT_UNDEFINED);
+  texture_mip_levels.assign(count, 0);
+  texture_image_views.assign(count, VK_NULL_HANDLE);
+  residency.reset(count, texture_budget);
+
+  // the loader writes to the streams, they must not move.
+  // Decoding starts with the first frame, once the buffers
+  // are uploaded, since the loader may wait for space in
+  // the staging ring that only the main thread releases.
+  texture_streams = std::vector<TextureStream>(count);
+  for (std::size_t t = 0; t < count; t++) {
+    TextureStream &stream = texture_streams[t];
+    if (t < paths.size()) {
+      stream.path = paths[t];
+    } else {
+      stream.atlas = std::move(atlases[t - paths.size()]);
+      stream.path = "atlas " + std::to_string(t);
+    }
+  }
+}
+/**
+  Pack the small textures into atlases. A texture joins an
+  atlas if it is at most atlas_tile_limit on both sides,
+  its texture coordinates stay in [0, 1] and it shares no
+  vertex with another texture, so that its vertices can be
+  moved into its tile by vertex_uv_transforms.
+
+  \param paths the distinct textures, those packed are
+  removed and material_textures is renumbered to the
+  remaining ones followed by the atlases.
+  \return the atlases of more than one texture
+ */
+std::vector<AtlasLayout> HelloTriangle::packTextureAtlases(
+    std::vector<std::string> &paths) {
+  MeshView mesh = modelMesh();
+  const auto none = std::numeric_limits<std::size_t>::max();
+  auto vertex = [&](std::size_t i) -> std::size_t {
+    return mesh.index_type == VK_INDEX_TYPE_UINT16
+               ? static_cast<const std::uint16_t *>(
+                     mesh.indices)[i]
+               : static_cast<const std::uint32_t *>(
+                     mesh.indices)[i];
+  };
+
+  // 1. texture of every vertex, textures that share
+  // vertices or repeat can not move
+  std::vector<std::size_t> owners(mesh.vertex_count, none);
+  std::vector<bool> packable(paths.size(), true);
+  for (std::size_t s = 0; s < mesh.submesh_count; s++) {
+    const Submesh &sub = mesh.submeshes[s];
+    std::size_t t = material_textures[sub.material];
+    std::size_t end = sub.first_index + sub.index_count;
+    for (std::size_t i = sub.first_index; i < end; i++) {
+      std::size_t v = vertex(i);
+      if (owners[v] == none) {
+        owners[v] = t;
+      } else if (owners[v] != t) {
+        packable[owners[v]] = false;
+        packable[t] = false;
+      }
+      glm::vec2 uv = mesh.vertices[v].texCoord;
+      if (uv.x < 0.0f || uv.x > 1.0f || uv.y < 0.0f ||
+          uv.y > 1.0f) {
+        packable[t] = false;
+      }
+    }
+  }
+
+  // 2. pack the small ones, a lone tile stays a texture
+  std::vector<AtlasTile> tiles;
+  for (std::size_t t = 0; t < paths.size(); t++) {
+    AtlasTile tile;
+    if (packable[t] &&
+        image_size(paths[t], tile.width, tile.height) &&
+        tile.width <= atlas_tile_limit &&
+        tile.height <= atlas_tile_limit) {
+      tile.texture = t;
+      tile.source = paths[t];
+      tiles.push_back(tile);
+    }
+  }
+  std::vector<AtlasLayout> atlases;
+  for (AtlasLayout &atlas : pack_atlases(std::move(tiles))) {
+    if (atlas.tiles.size() > 1) {
+      atlases.push_back(std::move(atlas));
+    }
+  }
+  vertex_uv_transforms.clear();
+  if (atlases.empty()) {
+    return atlases;
+  }
+
+  // 3. renumber the textures, atlases after the others
+  std::vector<std::size_t> atlas_of(paths.size(), none);
+  std::vector<glm::vec4> transforms(
+      paths.size(), glm::vec4(0.0f, 0.0f, 1.0f, 1.0f));
+  for (std::size_t a = 0; a < atlases.size(); a++) {
+    for (const AtlasTile &tile : atlases[a].tiles) {
+      atlas_of[tile.texture] = a;
+      transforms[tile.texture] = atlases[a].uv_transform(tile);
+    }
+  }
+  std::vector<std::string> kept;
+  std::vector<std::size_t> slots(paths.size());
+  for (std::size_t t = 0; t < paths.size(); t++) {
+    if (atlas_of[t] == none) {
+      slots[t] = kept.size();
+      kept.push_back(paths[t]);
+    }
+  }
+  for (std::size_t t = 0; t < paths.size(); t++) {
+    if (atlas_of[t] != none) {
+      slots[t] = kept.size() + atlas_of[t];
+    }
+  }
+  for (std::size_t &texture : material_textures) {
+    texture = slots[texture];
+  }
+  paths = std::move(kept);
+
+  // 4. move the vertices of the packed textures
+  vertex_uv_transforms.assign(
+      mesh.vertex_count, glm::vec4(0.0f, 0.0f, 1.0f, 1.0f));
+  for (std::size_t v = 0; v < mesh.vertex_count; v++) {
+    if (owners[v] != none) {
+      vertex_uv_transforms[v] = transforms[owners[v]];
+    }
+  }
+  return atlases;
+}
+/**
+  Create the 1x1 grey texture that materials sample until
+  their own is resident.
+ */
+void HelloTriangle::createPlaceholderTexture() {
+  const std::array<std::uint8_t, 4> texel = {128, 128, 128,
+                                             255};
+  StagingRange range = staging.allocate(sizeof(texel));
+  memcpy(range.data, texel.data(), sizeof(texel));
+
+  VkFormat format = VK_FORMAT_R8G8B8A8_SRGB;
+  createImage(1, 1, format, VK_IMAGE_TILING_OPTIMAL,
+              VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                  VK_IMAGE_USAGE_SAMPLED_BIT,
+              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+              placeholder_image, placeholder_image_memory);
+  transitionImageLayout(placeholder_image, format,
+                        VK_IMAGE_LAYOUT_UNDEFINED,
+                        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+  copyBufferToImage(range.buffer, placeholder_image,
+                    mip_chain_layout(1, 1, 1), range.offset);
+  transitionImageLayout(
+      placeholder_image, format,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+  staging.release(range);
+  placeholder_image_view = createImageView(
+      placeholder_image, format, VK_IMAGE_ASPECT_COLOR_BIT);
+}
+/**
+  Decode a texture on the loader thread, stage its mip chain
+  and create its image.
+
+  When the device samples block compressed formats, the
+  chain comes from the texture cache of the image, which is
+  decoded, filtered and compressed on the worker threads the
+  first time. Otherwise the image is staged as rgba and its
+  levels are blitted on the gpu when the format supports
+  linear filtering, or filtered on the cpu and staged with
+  the first one.
+
+  The source and the cache are mapped, and the chain is
+  written straight to the mapped staging buffer: the cache
+  and the decoded image are copied once, the filtered rgba
+  levels and the compressed blocks are written in place.
+ */
+void HelloTriangle::decodeTexture(TextureStream &stream) {
+  // 1. a valid cache is staged without decoding
+  const std::string &path = stream.path;
+  VkFormat &imformat = stream.format;
+  std::vector<MipLevel> &levels = stream.levels;
+  bool &gpu_mipmaps = stream.gpu_mipmaps;
+  texture_cache cache;
+  bool is_atlas = !stream.atlas.tiles.empty();
+  if (!is_atlas && cache.open(path) &&
+      cache.format() ==
+          findTextureFormat(cache.format() !=
+                            VK_FORMAT_BC1_RGB_SRGB_BLOCK)) {
+    imformat = cache.format();
+    levels = cache.levels();
+    gpu_mipmaps = false;
+    VkDeviceSize imsize = cache.level_data_size();
+    void *data = createStagingBuffer(stream, imsize);
+    memcpy(data, cache.level_data(),
+           static_cast<std::size_t>(imsize));
+  } else {
+    // 2. decode the image, or the tiles of the atlas, and
+    // pick the format for the device. Atlases keep the
+    // levels their gutters cover.
+    std::uint32_t imwidth, imheight;
+    std::uint32_t level_count;
+    bool alpha;
+    decoded_image pixels(nullptr, stbi_image_free);
+    std::vector<std::uint8_t> atlas_texels;
+    const std::uint8_t *texels;
+    if (is_atlas) {
+      atlas_texels = compose_atlas(stream.atlas, alpha);
+      texels = atlas_texels.data();
+      imwidth = stream.atlas.width;
+      imheight = stream.atlas.height;
+      level_count = std::min(
+          atlas_mip_levels, mip_level_count(imwidth, imheight));
+    } else {
+      pixels = decode_image(path, imwidth, imheight, alpha);
+      texels = pixels.get();
+      level_count = mip_level_count(imwidth, imheight);
+    }
+    imformat = findTextureFormat(alpha);
+    levels = mip_chain_layout(imwidth, imheight, level_count);
+    auto level_size = static_cast<std::size_t>(
+        levels[0].width * VkDeviceSize(levels[0].height) * 4);
+    gpu_mipmaps = imformat == VK_FORMAT_R8G8B8A8_SRGB &&
+                  supportsLinearBlit(imformat);
+
+    // 3. filter the levels on the cpu unless the gpu blits
+    // them, compressed levels are filtered aside first
+    if (is_block_format(imformat)) {
+      std::vector<std::uint8_t> chain(mip_chain_size(levels));
+      memcpy(chain.data(), texels, level_size);
+      pixels.reset();
+      atlas_texels = {};
+      build_mip_chain(chain.data(), levels);
+      std::vector<MipLevel> compressed =
+          compressed_chain_layout(imformat, levels);
+      VkDeviceSize imsize =
+          compressed_chain_size(imformat, compressed);
+      auto *blocks = static_cast<std::uint8_t *>(
+          createStagingBuffer(stream, imsize));
+      compress_mip_chain(imformat, chain.data(), levels,
+                         compressed, blocks, workers);
+      levels = compressed;
+      // a missing cache only costs the next startup an
+      // encode, atlases are composed every time
+      try {
+        if (!is_atlas) {
+          texture_cache::write(path, imformat, levels, blocks);
+        }
+      } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+      }
+    } else {
+      VkDeviceSize imsize =
+          gpu_mipmaps ? level_size : mip_chain_size(levels);
+      auto *chain = static_cast<std::uint8_t *>(
+          createStagingBuffer(stream, imsize));
+      memcpy(chain, texels, level_size);
+      if (!gpu_mipmaps) {
+        build_mip_chain(chain, levels);
+      }
+    }
+  }
+  auto mip_levels = static_cast<uint32_t>(levels.size());
 
-  // create texture image as vulkan image
-  VkFormat imformat = VK_FORMAT_R8G8B8A8_SRGB;
+  // create texture image as vulkan image, blits read from
+  // the previous level and evictions copy the coarse ones
   VkImageTiling imtiling = VK_IMAGE_TILING_OPTIMAL;
   VkImageUsageFlags imusage =
+      VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
       VK_IMAGE_USAGE_TRANSFER_DST_BIT |
       VK_IMAGE_USAGE_SAMPLED_BIT;
   VkMemoryPropertyFlags improps =
       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
-  createImage(imwidth, imheight, imformat, imtiling,
-              imusage, improps, texture_image,
-              texture_image_memory);
-  //
-  auto format = VK_FORMAT_R8G8B8A8_SRGB;
-  auto old_layout = VK_IMAGE_LAYOUT_UNDEFINED;
-  auto new_layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-  transitionImageLayout(texture_image, format, old_layout,
-                        new_layout);
-  copyBufferToImage(staging_buffer, texture_image,
-                    static_cast<uint32_t>(imwidth),
-                    static_cast<uint32_t>(imheight));
-
-  old_layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-  new_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-  transitionImageLayout(texture_image, format, old_layout,
-                        new_layout);
-
-  vkDestroyBuffer(logical_dev.device(), staging_buffer,
-                  nullptr);
-  vkFreeMemory(logical_dev.device(), stage_buffer_memory,
-               nullptr);
+  createImage(levels[0].width, levels[0].height, imformat,
+              imtiling, imusage, improps, stream.image,
+              stream.image_memory, mip_levels);
+}
+/**
+  Take the staging memory of a stream from the ring, waiting
+  for uploads to complete if it is full, and return its
+  mapping. A texture larger than the ring gets a buffer of
+  its own, which is reported as staging_ring_size is then
+  too small for the textures.
+ */
+void *HelloTriangle::createStagingBuffer(TextureStream &stream,
+                                         VkDeviceSize size) {
+  if (size <= staging.capacity()) {
+    stream.staging = staging.allocate(size);
+    return stream.staging.data;
+  }
+  std::cerr << "staging ring: " << stream.path << " takes "
+            << (size >> 20) << " MiB, more than the "
+            << (staging.capacity() >> 20)
+            << " MiB ring, staged aside" << std::endl;
+  createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+               stream.staging_buffer, stream.staging_memory,
+               VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+  stream.staging.buffer = stream.staging_buffer;
+  stream.staging.size = size;
+  stream.staging.data = stream.staging_memory.data;
+  return stream.staging.data;
+}
+/**
+  Record and submit the upload of a decoded texture.
+
+  The levels are copied on the transfer queue. When it has
+  a family of its own, the copy releases the image to the
+  graphics family, which acquires it once copied is
+  signaled. The graphics side then blits the mip levels if
+  the gpu builds them and signals uploaded.
+ */
+void HelloTriangle::submitTextureUpload(TextureStream &stream) {
+  VkDevice device = logical_dev.device();
+  bool own_family = logical_dev.has_transfer_queue();
+  auto mip_levels = static_cast<uint32_t>(stream.levels.size());
+  auto begin = [device](VkCommandPool pool) {
+    VkCommandBufferAllocateInfo allocInfo{};
+    allocInfo.sType =
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandPool = pool;
+    allocInfo.commandBufferCount = 1;
+    VkCommandBuffer cbuffer;
+    CHECK_VK(vkAllocateCommandBuffers(device, &allocInfo,
+                                      &cbuffer),
+             "failed to allocate texture upload commands");
+    VkCommandBufferBeginInfo binfo{};
+    binfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    binfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(cbuffer, &binfo);
+    return cbuffer;
+  };
+  VkImageMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = stream.image;
+  barrier.subresourceRange.aspectMask =
+      VK_IMAGE_ASPECT_COLOR_BIT;
+  barrier.subresourceRange.baseMipLevel = 0;
+  barrier.subresourceRange.levelCount = mip_levels;
+  barrier.subresourceRange.baseArrayLayer = 0;
+  barrier.subresourceRange.layerCount = 1;
+
+  // 1. copy the staged levels
+  VkCommandBuffer copy = begin(transfer_pool.pool);
+  stream.copy_commands = copy;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.srcAccessMask = 0;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  vkCmdPipelineBarrier(copy, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0,
+                       nullptr, 0, nullptr, 1, &barrier);
+  std::vector<MipLevel> staged = stream.levels;
+  if (stream.gpu_mipmaps) {
+    staged.resize(1);
+  }
+  copyBufferToImage(copy, stream.staging.buffer, stream.image,
+                    staged, stream.staging.offset);
+
+  // 2. hand the image to the graphics family, in the layout
+  // the blits write or the one the shaders read
+  VkPipelineStageFlags use_stage =
+      VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+  VkAccessFlags use_access = VK_ACCESS_SHADER_READ_BIT;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  if (stream.gpu_mipmaps) {
+    use_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    use_access = VK_ACCESS_TRANSFER_READ_BIT |
+                 VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  }
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  VkCommandBuffer graphics = copy;
+  if (own_family) {
+    // the release and the acquire repeat the same barrier
+    barrier.srcQueueFamilyIndex = logical_dev.transfer_family();
+    barrier.dstQueueFamilyIndex =
+        logical_dev.families.graphics_family.value();
+    barrier.dstAccessMask = 0;
+    vkCmdPipelineBarrier(
+        copy, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0,
+        nullptr, 1, &barrier);
+    CHECK_VK(vkEndCommandBuffer(copy),
+             "failed to record texture copy");
+
+    VkSemaphoreCreateInfo semaphoreInfo{};
+    semaphoreInfo.sType =
+        VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    CHECK_VK(vkCreateSemaphore(device, &semaphoreInfo,
+                               nullptr, &stream.copied),
+             "failed to create texture copy semaphore");
+    VkSubmitInfo sinfo{};
+    sinfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    sinfo.commandBufferCount = 1;
+    sinfo.pCommandBuffers = &copy;
+    sinfo.signalSemaphoreCount = 1;
+    sinfo.pSignalSemaphores = &stream.copied;
+    CHECK_VK(vkQueueSubmit(logical_dev.transfer_queue, 1,
+                           &sinfo, VK_NULL_HANDLE),
+             "failed to submit texture copy");
+
+    graphics = begin(command_pool.pool);
+    stream.acquire_commands = graphics;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = use_access;
+    vkCmdPipelineBarrier(graphics, use_stage, use_stage, 0, 0,
+                         nullptr, 0, nullptr, 1, &barrier);
+  } else if (!stream.gpu_mipmaps) {
+    barrier.dstAccessMask = use_access;
+    vkCmdPipelineBarrier(copy, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         use_stage, 0, 0, nullptr, 0, nullptr,
+                         1, &barrier);
+  }
+
+  // 3. blits need the graphics family
+  if (stream.gpu_mipmaps) {
+    generateMipmaps(graphics, stream.image, stream.levels);
+  }
+  CHECK_VK(vkEndCommandBuffer(graphics),
+           "failed to record texture upload");
+  VkFenceCreateInfo fenceInfo{};
+  fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  CHECK_VK(vkCreateFence(device, &fenceInfo, nullptr,
+                         &stream.uploaded),
+           "failed to create texture upload fence");
+  VkSubmitInfo sinfo{};
+  sinfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  sinfo.commandBufferCount = 1;
+  sinfo.pCommandBuffers = &graphics;
+  if (own_family) {
+    sinfo.waitSemaphoreCount = 1;
+    sinfo.pWaitSemaphores = &stream.copied;
+    sinfo.pWaitDstStageMask = &use_stage;
+  }
+  CHECK_VK(vkQueueSubmit(logical_dev.graphics_queue, 1, &sinfo,
+                         stream.uploaded),
+           "failed to submit texture upload");
+  stream.state = TextureState::uploading;
+}
+/** free what the upload of a texture used, not its image */
+void HelloTriangle::freeTextureUpload(TextureStream &stream) {
+  VkDevice device = logical_dev.device();
+  if (stream.copy_commands != VK_NULL_HANDLE) {
+    vkFreeCommandBuffers(device, transfer_pool.pool, 1,
+                         &stream.copy_commands);
+  }
+  if (stream.acquire_commands != VK_NULL_HANDLE) {
+    vkFreeCommandBuffers(device, command_pool.pool, 1,
+                         &stream.acquire_commands);
+  }
+  vkDestroySemaphore(device, stream.copied, nullptr);
+  vkDestroyFence(device, stream.uploaded, nullptr);
+  // uploaded is signaled or the device is idle
+  if (stream.staging_buffer != VK_NULL_HANDLE) {
+    vkDestroyBuffer(device, stream.staging_buffer, nullptr);
+    allocator.free(stream.staging_memory);
+  } else if (stream.staging.data != nullptr) {
+    staging.release(stream.staging);
+  }
+  stream.staging = StagingRange{};
+  stream.copy_commands = VK_NULL_HANDLE;
+  stream.acquire_commands = VK_NULL_HANDLE;
+  stream.copied = VK_NULL_HANDLE;
+  stream.uploaded = VK_NULL_HANDLE;
+  stream.staging_buffer = VK_NULL_HANDLE;
+}
+/**
+  Make an uploaded texture resident, in place of what was
+  left of it after an eviction. The device is idle.
+ */
+void HelloTriangle::finishTextureUpload(std::size_t texture) {
+  TextureStream &stream = texture_streams[texture];
+  freeTextureUpload(stream);
+  destroyTexture(texture);
+  auto mip_levels = static_cast<uint32_t>(stream.levels.size());
+  std::vector<VkDeviceSize> level_sizes;
+  for (const MipLevel &level : stream.levels) {
+    level_sizes.push_back(level_bytes(stream.format, level));
+  }
+  residency.set_resident(texture, level_sizes);
+  texture_images[texture] = stream.image;
+  texture_image_memories[texture] = stream.image_memory;
+  texture_formats[texture] = stream.format;
+  texture_mip_levels[texture] = mip_levels;
+  texture_image_views[texture] =
+      createImageView(stream.image, stream.format,
+                      VK_IMAGE_ASPECT_COLOR_BIT, mip_levels);
+  stream.image = VK_NULL_HANDLE;
+  stream.image_memory = MemoryAllocation{};
+  stream.state = TextureState::resident;
+}
+/**
+  Advance the texture streams, once per frame.
+
+  Decoded textures are submitted and uploaded ones become
+  resident, then levels are evicted if that exceeds the
+  budget. Textures sampled in the last frame with evicted
+  levels are streamed again. Materials whose texture
+  changes rewrite descriptor sets bound by the recorded
+  command buffers, so those are recorded again once the
+  device is idle.
+ */
+void HelloTriangle::updateTextureStreams() {
+  std::vector<std::size_t> uploaded;
+  for (std::size_t t = 0; t < texture_streams.size(); t++) {
+    TextureStream &stream = texture_streams[t];
+    if (stream.state == TextureState::decoding &&
+        !stream.decoded.valid()) {
+      stream.decoded = texture_loader.submit(
+          [this, &stream] { decodeTexture(stream); });
+    } else if (stream.state == TextureState::decoding &&
+        stream.decoded.wait_for(std::chrono::seconds(0)) ==
+            std::future_status::ready) {
+      // rethrows the error of a failed decode
+      stream.decoded.get();
+      submitTextureUpload(stream);
+    } else if (stream.state == TextureState::uploading &&
+               vkGetFenceStatus(logical_dev.device(),
+                                stream.uploaded) ==
+                   VK_SUCCESS) {
+      uploaded.push_back(t);
+    } else if (stream.state == TextureState::resident &&
+               residency.wants_levels(t)) {
+      residency.stream(t);
+      stream.state = TextureState::decoding;
+      stream.decoded = texture_loader.submit(
+          [this, &stream] { decodeTexture(stream); });
+    }
+  }
+  if (uploaded.empty()) {
+    return;
+  }
+  // the views being replaced may still be sampled
+  vkDeviceWaitIdle(logical_dev.device());
+  for (std::size_t t : uploaded) {
+    finishTextureUpload(t);
+  }
+  for (std::size_t t : residency.evict()) {
+    trimTexture(t, residency.first_level(t));
+  }
+  auto v = cmd_buffers.to_vec();
+  vkFreeCommandBuffers(logical_dev.device(), command_pool.pool,
+                       static_cast<uint32_t>(v.size()),
+                       v.data());
+  updateDescriptorSets();
+  createCommandBuffers();
+}
+/** destroy the resident image of a texture, if any */
+void HelloTriangle::destroyTexture(std::size_t texture) {
+  vkDestroyImageView(logical_dev.device(),
+                     texture_image_views[texture], nullptr);
+  vkDestroyImage(logical_dev.device(), texture_images[texture],
+                 nullptr);
+  allocator.free(texture_image_memories[texture]);
+  texture_image_views[texture] = VK_NULL_HANDLE;
+  texture_images[texture] = VK_NULL_HANDLE;
+  texture_mip_levels[texture] = 0;
+}
+/**
+  Keep the levels of a texture from first_level on, copied
+  into a smaller image. Without levels left its materials
+  sample the placeholder. The device is idle.
+ */
+void HelloTriangle::trimTexture(std::size_t texture,
+                                uint32_t first_level) {
+  const std::vector<MipLevel> &levels =
+      texture_streams[texture].levels;
+  auto level_count = static_cast<uint32_t>(levels.size());
+  uint32_t old_count = texture_mip_levels[texture];
+  if (first_level >= level_count) {
+    destroyTexture(texture);
+    return;
+  }
+  // 1. the image holds the levels from old_first on
+  uint32_t old_first = level_count - old_count;
+  uint32_t count = level_count - first_level;
+  VkFormat format = texture_formats[texture];
+  VkImage image;
+  MemoryAllocation image_memory;
+  createImage(levels[first_level].width,
+              levels[first_level].height, format,
+              VK_IMAGE_TILING_OPTIMAL,
+              VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+                  VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                  VK_IMAGE_USAGE_SAMPLED_BIT,
+              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image,
+              image_memory, count);
+
+  // 2. copy the kept levels over
+  VkCommandBuffer cbuffer = beginSignalCommand();
+  std::array<VkImageMemoryBarrier, 2> barriers{};
+  for (auto &barrier : barriers) {
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.subresourceRange.aspectMask =
+        VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.levelCount = count;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+  }
+  barriers[0].image = texture_images[texture];
+  barriers[0].subresourceRange.baseMipLevel =
+      first_level - old_first;
+  barriers[0].oldLayout =
+      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  barriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  barriers[0].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  barriers[1].image = image;
+  barriers[1].subresourceRange.baseMipLevel = 0;
+  barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barriers[1].srcAccessMask = 0;
+  barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  vkCmdPipelineBarrier(cbuffer,
+                       VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                       VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0,
+                       nullptr, 0, nullptr,
+                       static_cast<uint32_t>(barriers.size()),
+                       barriers.data());
+  std::vector<VkImageCopy> regions;
+  for (uint32_t l = 0; l < count; l++) {
+    const MipLevel &level = levels[first_level + l];
+    VkImageCopy region{};
+    region.srcSubresource.aspectMask =
+        VK_IMAGE_ASPECT_COLOR_BIT;
+    region.srcSubresource.mipLevel =
+        first_level - old_first + l;
+    region.srcSubresource.baseArrayLayer = 0;
+    region.srcSubresource.layerCount = 1;
+    region.dstSubresource = region.srcSubresource;
+    region.dstSubresource.mipLevel = l;
+    region.extent = {level.width, level.height, 1};
+    regions.push_back(region);
+  }
+  vkCmdCopyImage(cbuffer, texture_images[texture],
+                 VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image,
+                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                 static_cast<uint32_t>(regions.size()),
+                 regions.data());
+  endSignalCommand(cbuffer);
+  transitionImageLayout(
+      image, format, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, count);
+
+  // 3. replace the image
+  destroyTexture(texture);
+  texture_images[texture] = image;
+  texture_image_memories[texture] = image_memory;
+  texture_mip_levels[texture] = count;
+  texture_image_views[texture] = createImageView(
+      image, format, VK_IMAGE_ASPECT_COLOR_BIT, count);
+}
+/**
+  Wait for the loader thread, then free the textures that
+  did not become resident. The device is idle.
+ */
+void HelloTriangle::destroyTextureStreams() {
+  // a decode waiting for staging space gives up
+  staging.close();
+  for (auto &stream : texture_streams) {
+    if (stream.decoded.valid()) {
+      stream.decoded.wait();
+    }
+    freeTextureUpload(stream);
+    vkDestroyImage(logical_dev.device(), stream.image, nullptr);
+    allocator.free(stream.image_memory);
+  }
+  texture_streams.clear();
+}
+/**
+  Whether images of the format can be blitted with linear
+  filtering in optimal tiling.
+ */
+bool HelloTriangle::supportsLinearBlit(VkFormat format) {
+  VkFormatFeatureFlags features =
+      VK_FORMAT_FEATURE_BLIT_SRC_BIT |
+      VK_FORMAT_FEATURE_BLIT_DST_BIT |
+      VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+  return physical_dev.capabilities.supports(
+      format, VK_IMAGE_TILING_OPTIMAL, features);
+}
+/**
+  Fill the mip levels of an image from its first level.
+
+  Recorded in cbuffer, on the graphics family. All the
+  levels are in transfer destination layout and the first
+  one is written. Every level is blitted from the
+  previous one, which is then moved to the shader read
+  layout, so each level changes layout once it is final.
+ */
+void HelloTriangle::generateMipmaps(
+    VkCommandBuffer cbuffer, VkImage image,
+    const std::vector<MipLevel> &levels) {
+  VkImageMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image;
+  barrier.subresourceRange.aspectMask =
+      VK_IMAGE_ASPECT_COLOR_BIT;
+  barrier.subresourceRange.levelCount = 1;
+  barrier.subresourceRange.baseArrayLayer = 0;
+  barrier.subresourceRange.layerCount = 1;
+
+  auto level_size = [](const MipLevel &level) {
+    return VkOffset3D{static_cast<int32_t>(level.width),
+                      static_cast<int32_t>(level.height), 1};
+  };
+  auto last = static_cast<uint32_t>(levels.size() - 1);
+  for (uint32_t l = 1; l <= last; l++) {
+    // 1. the previous level is written, read it
+    barrier.subresourceRange.baseMipLevel = l - 1;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(cbuffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0,
+                         nullptr, 0, nullptr, 1, &barrier);
+
+    // 2. filter it into this level
+    VkImageBlit blit{};
+    blit.srcOffsets[0] = {0, 0, 0};
+    blit.srcOffsets[1] = level_size(levels[l - 1]);
+    blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    blit.srcSubresource.mipLevel = l - 1;
+    blit.srcSubresource.baseArrayLayer = 0;
+    blit.srcSubresource.layerCount = 1;
+    blit.dstOffsets[0] = {0, 0, 0};
+    blit.dstOffsets[1] = level_size(levels[l]);
+    blit.dstSubresource = blit.srcSubresource;
+    blit.dstSubresource.mipLevel = l;
+    vkCmdBlitImage(cbuffer, image,
+                   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image,
+                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
+                   &blit, VK_FILTER_LINEAR);
+
+    // 3. the previous level is final
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(cbuffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                         0, 0, nullptr, 0, nullptr, 1,
+                         &barrier);
+  }
+  // 4. the last level is only written
+  barrier.subresourceRange.baseMipLevel = last;
+  barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier(cbuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+                       0, nullptr, 0, nullptr, 1, &barrier);
 }
 void HelloTriangle::createImage(
     uint32_t imw, uint32_t imh, VkFormat format,
     VkImageTiling tiling, VkImageUsageFlags imusage,
     VkMemoryPropertyFlags improps, VkImage &vimage,
-    VkDeviceMemory &vimage_memory) {
+    MemoryAllocation &vimage_memory, uint32_t mip_levels) {
   VkImageCreateInfo img_info{};
   img_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
   img_info.imageType = VK_IMAGE_TYPE_2D;
   img_info.extent.width = imw;
   img_info.extent.height = imh;
   img_info.extent.depth = 1;
-  img_info.mipLevels = 1;
+  img_info.mipLevels = mip_levels;
   img_info.arrayLayers = 1;
   img_info.format = format;
   img_info.tiling = tiling;
@@ -1052,23 +1860,17 @@ void HelloTriangle::createImage(
   vkGetImageMemoryRequirements(logical_dev.device(), vimage,
                                &mem_req);
 
-  //
-  VkMemoryAllocateInfo allocInfo{};
-  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocInfo.allocationSize = mem_req.size;
-  allocInfo.memoryTypeIndex =
-      findMemoryType(mem_req.memoryTypeBits, improps);
-
-  CHECK_VK(vkAllocateMemory(logical_dev.device(),
-                            &allocInfo, nullptr,
-                            &vimage_memory),
-           "failed to create image memory");
+  // take a range of a memory block
+  vimage_memory = allocator.allocate(
+      mem_req, findMemoryType(mem_req.memoryTypeBits, improps),
+      tiling == VK_IMAGE_TILING_LINEAR);
   vkBindImageMemory(logical_dev.device(), vimage,
-                    vimage_memory, 0);
+                    vimage_memory.memory, vimage_memory.offset);
 }
 void HelloTriangle::transitionImageLayout(
     VkImage image, VkFormat format,
-    VkImageLayout old_layout, VkImageLayout new_layout) {
+    VkImageLayout old_layout, VkImageLayout new_layout,
+    uint32_t mip_levels) {
   VkCommandBuffer command_buffer = beginSignalCommand();
   //
   VkImageMemoryBarrier barrier{};
@@ -1079,7 +1881,7 @@ void HelloTriangle::transitionImageLayout(
   barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
   barrier.image = image;
   barrier.subresourceRange.baseMipLevel = 0;
-  barrier.subresourceRange.levelCount = 1;
+  barrier.subresourceRange.levelCount = mip_levels;
   barrier.subresourceRange.baseArrayLayer = 0;
   barrier.subresourceRange.layerCount = 1;
 
@@ -1140,32 +1942,47 @@ void HelloTriangle::transitionImageLayout(
   endSignalCommand(command_buffer);
 }
 
-void HelloTriangle::copyBufferToImage(VkBuffer buffer,
-                                      VkImage image,
-                                      uint32_t width,
-                                      uint32_t height) {
+/** copy the levels of a mip chain from the buffer */
+void HelloTriangle::copyBufferToImage(
+    VkBuffer buffer, VkImage image,
+    const std::vector<MipLevel> &levels,
+    VkDeviceSize buffer_offset) {
   VkCommandBuffer cbuffer = beginSignalCommand();
-
-  VkBufferImageCopy region{};
-  region.bufferOffset = 0;
-  region.bufferRowLength = 0;
-  region.bufferImageHeight = 0;
-  region.imageSubresource.aspectMask =
-      VK_IMAGE_ASPECT_COLOR_BIT;
-  region.imageSubresource.mipLevel = 0;
-  region.imageSubresource.baseArrayLayer = 0;
-  region.imageSubresource.layerCount = 1;
-  region.imageOffset = {0, 0, 0};
-  region.imageExtent = {width, height, 1};
+  copyBufferToImage(cbuffer, buffer, image, levels,
+                    buffer_offset);
+  endSignalCommand(cbuffer);
+}
+/** record the copy of the levels of a mip chain */
+void HelloTriangle::copyBufferToImage(
+    VkCommandBuffer cbuffer, VkBuffer buffer, VkImage image,
+    const std::vector<MipLevel> &levels,
+    VkDeviceSize buffer_offset) {
+  std::vector<VkBufferImageCopy> regions;
+  for (std::size_t l = 0; l < levels.size(); l++) {
+    VkBufferImageCopy region{};
+    region.bufferOffset = buffer_offset + levels[l].offset;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask =
+        VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel =
+        static_cast<uint32_t>(l);
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageOffset = {0, 0, 0};
+    region.imageExtent = {levels[l].width, levels[l].height,
+                          1};
+    regions.push_back(region);
+  }
 
   vkCmdCopyBufferToImage(
       cbuffer, buffer, image,
-      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-  endSignalCommand(cbuffer);
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      static_cast<uint32_t>(regions.size()), regions.data());
 }
 VkImageView HelloTriangle::createImageView(
     VkImage image, VkFormat image_format,
-    VkImageAspectFlags aspect_flags) {
+    VkImageAspectFlags aspect_flags, uint32_t mip_levels) {
   VkImageViewCreateInfo createInfo{};
   createInfo.sType =
       VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -1174,7 +1991,7 @@ VkImageView HelloTriangle::createImageView(
   createInfo.format = image_format;
   createInfo.subresourceRange.aspectMask = aspect_flags;
   createInfo.subresourceRange.baseMipLevel = 0;
-  createInfo.subresourceRange.levelCount = 1;
+  createInfo.subresourceRange.levelCount = mip_levels;
   createInfo.subresourceRange.baseArrayLayer = 0;
   createInfo.subresourceRange.layerCount = 1;
   VkImageView imview;
@@ -1183,16 +2000,9 @@ VkImageView HelloTriangle::createImageView(
            "failed to create texture image view");
   return imview;
 }
-void HelloTriangle::createTextureImageView() {
-  //
-  auto imformat = VK_FORMAT_R8G8B8A8_SRGB;
-  texture_image_view = createImageView(
-      texture_image, imformat, VK_IMAGE_ASPECT_COLOR_BIT);
-}
 void HelloTriangle::createTextureSampler() {
-  VkPhysicalDeviceProperties props{};
-  vkGetPhysicalDeviceProperties(physical_dev.device(),
-                                &props);
+  const VkPhysicalDeviceLimits &limits =
+      physical_dev.capabilities.limits();
 
   // sampler create info
   VkSamplerCreateInfo cinfo{};
@@ -1208,12 +2018,17 @@ void HelloTriangle::createTextureSampler() {
 
   //
   cinfo.anisotropyEnable = VK_TRUE;
-  cinfo.maxAnisotropy = props.limits.maxSamplerAnisotropy;
+  cinfo.maxAnisotropy = limits.maxSamplerAnisotropy;
   cinfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
   cinfo.unnormalizedCoordinates = VK_FALSE;
   cinfo.compareEnable = VK_FALSE;
   cinfo.compareOp = VK_COMPARE_OP_ALWAYS;
   cinfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+  // every level can be sampled, textures are streamed so
+  // the view of each one bounds its levels
+  cinfo.minLod = 0.0f;
+  cinfo.maxLod = VK_LOD_CLAMP_NONE;
+  cinfo.mipLodBias = 0.0f;
 
   // create sampler with given information
   CHECK_VK(vkCreateSampler(logical_dev.device(), &cinfo,
@@ -1260,63 +2075,173 @@ void HelloTriangle::endSignalCommand(
                        command_pool.pool, 1, &cbuffer);
 }
 void HelloTriangle::loadModel() {
-  tinyobj::attrib_t attrib;
-  std::vector<tinyobj::shape_t> shapes;
-  std::vector<tinyobj::material_t> materials;
-  std::string warn, err;
-  if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn,
-                        &err, model_path.c_str())) {
-    throw std::runtime_error(warn + err);
-  }
-  std::unordered_map<Vertex, std::uint32_t> uVertices{};
-  for (const auto &shape : shapes) {
-    for (const auto &index : shape.mesh.indices) {
-      Vertex v{};
-      auto stride = 3;
-      auto vindex = index.vertex_index;
-      v.pos = {attrib.vertices[stride * vindex + 0],
-               attrib.vertices[stride * vindex + 1],
-               attrib.vertices[stride * vindex + 2]};
-      auto tex_stride = 2;
-      auto tindex = index.texcoord_index;
-      v.texCoord = {
-          attrib.texcoords[tex_stride * tindex + 0],
-          1.0f - attrib.texcoords[tex_stride * tindex + 1]};
-      v.color = {1.0f, 1.0f, 1.0f};
-
-      if (uVertices.count(v) == 0) {
-        uVertices[v] =
-            static_cast<uint32_t>(vertices.size());
-        vertices.push_back(v);
-      }
-      indices.push_back(uVertices[v]);
+  // a valid cache is mapped and uploaded without parsing
+  if (model_cache.open(model_path)) {
+    std::cout << "mesh cache: mapped "
+              << mesh_cache::cache_path(model_path)
+              << std::endl;
+    return;
+  }
+  // stream models too large to parse in memory into the cache
+  struct stat st;
+  if (stat(model_path.c_str(), &st) == 0 &&
+      static_cast<std::uint64_t>(st.st_size) >=
+          obj_stream_threshold) {
+    obj_stream_loader stream_loader;
+    stream_loader.load(model_path);
+    vertex_weld_stats = stream_loader.stats;
+    std::cout << vertex_weld_stats << std::endl;
+    if (!model_cache.open(model_path)) {
+      throw std::runtime_error(
+          "mesh cache: streamed model can not be mapped");
     }
+    return;
+  }
+  // parse and weld the model on the worker threads
+  obj_loader loader(workers);
+  loader.load(model_path, vertices, indices, submeshes,
+              materials);
+  vertex_weld_stats = loader.stats;
+  std::cout << vertex_weld_stats << std::endl;
+  if (materials.empty()) {
+    // a model without faces still gets a material
+    materials.push_back(make_material(std::string()));
+    submeshes.push_back({0, 0, 0});
+  }
+
+  // reorder triangles for post transform cache reuse, within
+  // the range of their material
+  auto cache_before = analyze_vertex_cache(indices, vertices.size());
+  optimize_vertex_cache(indices, submeshes, vertices.size());
+  auto cache_after = analyze_vertex_cache(indices, vertices.size());
+  std::cout << "vertex cache: " << cache_before << std::endl
+            << " optimized: " << cache_after << std::endl;
+
+  // append simplified levels of detail to the index buffer
+  lods = build_lod_chain(vertices, indices, submeshes);
+
+  // store vertices in the order the triangles fetch them
+  auto fetch_before = analyze_vertex_fetch(
+      indices, vertices.size(), sizeof(Vertex));
+  optimize_vertex_fetch(vertices, indices);
+  auto fetch_after = analyze_vertex_fetch(
+      indices, vertices.size(), sizeof(Vertex));
+  std::cout << "vertex fetch: " << fetch_before << std::endl
+            << " optimized: " << fetch_after << std::endl;
+
+  // halve the index buffer when the vertex count allows it
+  if (fits_short_indices(vertices.size())) {
+    short_indices = narrow_indices(indices);
+    std::vector<std::uint32_t>().swap(indices);
+  }
+
+  // a missing cache only costs the next startup a parse
+  try {
+    mesh_cache::write(model_path, modelMesh());
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+  }
+}
+/**
+  Build the bvh over the finest level of the model on the
+  worker threads.
+ */
+void HelloTriangle::createModelBvh() {
+  MeshView mesh = modelMesh();
+  std::size_t first_index = 0;
+  std::size_t index_count = mesh.index_count;
+  if (mesh.lod_count > 0) {
+    first_index = mesh.lods[0].first_index;
+    index_count = mesh.lods[0].index_count;
+  }
+  model_bvh.build(mesh, first_index, index_count, workers);
+  if (verbose) {
+    std::cout << model_bvh.stats << std::endl;
+  }
+}
+/**
+  Cast a ray through the pixel (x, y) of the window and
+  keep the closest triangle it hits in last_pick.
+ */
+void HelloTriangle::pickTriangle(double x, double y) {
+  int width, height;
+  glfwGetWindowSize(window, &width, &height);
+  if (model_bvh.empty() || width == 0 || height == 0) {
+    return;
+  }
+  // 1. cursor to normalized device coordinates, the
+  // projection flips y so it points down like the window
+  float ndc_x = 2.0f * static_cast<float>(x) / width - 1.0f;
+  float ndc_y = 2.0f * static_cast<float>(y) / height - 1.0f;
+
+  // 2. unproject the near and far plane points to model space
+  glm::mat4 model_from_clip = glm::inverse(clip_from_model);
+  glm::vec4 near_point =
+      model_from_clip * glm::vec4(ndc_x, ndc_y, 0.0f, 1.0f);
+  glm::vec4 far_point =
+      model_from_clip * glm::vec4(ndc_x, ndc_y, 1.0f, 1.0f);
+  Ray ray;
+  ray.origin = glm::vec3(near_point) / near_point.w;
+  ray.direction =
+      glm::vec3(far_point) / far_point.w - ray.origin;
+  ray.t_max = 1.0f;
+
+  // 3. closest hit along the segment
+  RayHit hit;
+  last_pick.reset();
+  if (model_bvh.closest_hit(ray, hit)) {
+    last_pick = hit;
+  }
+  if (!verbose) {
+    return;
+  }
+  if (last_pick) {
+    glm::vec3 p = ray.origin + hit.t * ray.direction;
+    std::cout << "pick: triangle " << hit.triangle << " at ("
+              << p.x << ", " << p.y << ", " << p.z << ")"
+              << std::endl;
+  } else {
+    std::cout << "pick: nothing" << std::endl;
+  }
+}
+/**
+  Mesh data to upload, either from the mapped cache or from
+  the parsed vertices and indices.
+ */
+MeshView HelloTriangle::modelMesh() const {
+  if (model_cache.is_open()) {
+    return model_cache.mesh();
+  }
+  MeshView mesh;
+  mesh.vertices = vertices.data();
+  mesh.vertex_count = vertices.size();
+  if (!short_indices.empty()) {
+    mesh.indices = short_indices.data();
+    mesh.index_count = short_indices.size();
+    mesh.index_type = VK_INDEX_TYPE_UINT16;
+  } else {
+    mesh.indices = indices.data();
+    mesh.index_count = indices.size();
   }
+  mesh.lods = lods.data();
+  mesh.lod_count = lods.size();
+  mesh.submeshes = submeshes.data();
+  mesh.submesh_count = submeshes.size();
+  mesh.materials = materials.data();
+  mesh.material_count = materials.size();
+  return mesh;
 }
 void HelloTriangle::createVertexBuffer() {
   // 1. buffer related info
-  auto device_size = vertices.size() * sizeof(vertices[0]);
-  VkDeviceSize vk_device_size = device_size;
-  auto mem_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-
-  // 2. creating stage buffer
-  VkBuffer staging_buffer;
-  VkDeviceMemory staging_memory;
-  auto stage_usage_flag = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-
-  // create staging buffer
-  createBuffer(device_size, stage_usage_flag, mem_flags,
-               staging_buffer, staging_memory);
-
-  void *data;
-  vkMapMemory(logical_dev.device(), staging_memory, 0,
-              device_size, 0, &data);
-  memcpy(data, vertices.data(),
-         static_cast<size_t>(device_size));
-  vkUnmapMemory(logical_dev.device(), staging_memory);
-
-  // 3. declare vertex buffer
+  MeshView mesh = modelMesh();
+  auto offsets = stream_offsets<ModelVertex>(mesh.vertex_count);
+  vertex_buffer_offsets.assign(offsets.begin(),
+                               offsets.end() - 1);
+  VkDeviceSize device_size = offsets.back();
+  vertex_quantization = make_quantization<ModelVertex>(
+      mesh.vertices, mesh.vertex_count);
+
+  // 2. declare vertex buffer
   auto vertex_usage_flag =
       VK_BUFFER_USAGE_TRANSFER_DST_BIT |
       VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
@@ -1327,34 +2252,42 @@ void HelloTriangle::createVertexBuffer() {
                vertex_mem_flag, vertex_buffer,
                vertex_buffer_memory);
 
-  copyBuffer(staging_buffer, vertex_buffer, device_size);
-
-  vkDestroyBuffer(logical_dev.device(), staging_buffer,
-                  nullptr);
-  vkFreeMemory(logical_dev.device(), staging_memory,
-               nullptr);
+  // 3. pack every stream straight into the staging memory
+  auto bindings = ModelVertex::getBindingDescriptions();
+  for (std::size_t s = 0; s < bindings.size(); s++) {
+    VkDeviceSize stride = bindings[s].stride;
+    uploadBuffer(
+        vertex_buffer, offsets[s], mesh.vertex_count * stride,
+        stride,
+        [&](void *data, VkDeviceSize offset,
+            VkDeviceSize size) {
+          std::size_t first = offset / stride;
+          std::size_t count = size / stride;
+          const Vertex *vertices = mesh.vertices + first;
+          // texture coordinates of atlas tiles are moved
+          std::vector<Vertex> moved;
+          if (!vertex_uv_transforms.empty()) {
+            moved.assign(vertices, vertices + count);
+            for (std::size_t v = 0; v < count; v++) {
+              glm::vec4 tr = vertex_uv_transforms[first + v];
+              moved[v].texCoord =
+                  glm::vec2(tr.x, tr.y) +
+                  moved[v].texCoord * glm::vec2(tr.z, tr.w);
+            }
+            vertices = moved.data();
+          }
+          ModelVertex::pack_stream(s, vertices, count, data,
+                                   vertex_quantization);
+        });
+  }
+  vertex_uv_transforms = {};
 }
 void HelloTriangle::createIndexBuffer() {
   // 1. buffer related info
-  VkDeviceSize size = indices.size() * sizeof(indices[0]);
-
-  VkBuffer staging_buffer;
-  VkDeviceMemory staging_memory;
-  auto stage_usage_flag = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-
-  auto mem_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-
-  // create staging buffer
-  createBuffer(size, stage_usage_flag, mem_flags,
-               staging_buffer, staging_memory);
-  void *data;
-  vkMapMemory(logical_dev.device(), staging_memory, 0, size,
-              0, &data);
-  memcpy(data, indices.data(), static_cast<size_t>(size));
-  vkUnmapMemory(logical_dev.device(), staging_memory);
+  MeshView mesh = modelMesh();
+  VkDeviceSize size = mesh.index_bytes();
 
-  // 3. declare index buffer
+  // 2. declare index buffer
   auto index_usage_flag = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
                           VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
   auto index_mem_flag = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
@@ -1362,51 +2295,272 @@ void HelloTriangle::createIndexBuffer() {
   createBuffer(size, index_usage_flag, index_mem_flag,
                index_buffer, index_buffer_memory);
 
-  copyBuffer(staging_buffer, index_buffer, size);
-  vkDestroyBuffer(logical_dev.device(), staging_buffer,
-                  nullptr);
-  vkFreeMemory(logical_dev.device(), staging_memory,
-               nullptr);
+  // 3. copy the indices chunk by chunk
+  auto indices = static_cast<const char *>(mesh.indices);
+  uploadBuffer(index_buffer, 0, size, mesh.index_size(),
+               [&](void *data, VkDeviceSize offset,
+                   VkDeviceSize chunk) {
+                 memcpy(data, indices + offset,
+                        static_cast<size_t>(chunk));
+               });
 }
-void HelloTriangle::copyBuffer(VkBuffer src, VkBuffer dst,
-                               VkDeviceSize size) {
-  //
-  VkCommandBuffer cbuffer = beginSignalCommand();
+/**
+  Fill a device local buffer through the staging ring.
+
+  The content is produced in chunks of at most half of the
+  ring, rounded down to a multiple of element_size:
+  fill(data, offset, size) writes the bytes [offset, offset
+  + size) of the region starting at dst_offset in the
+  buffer to data. Every chunk is copied by a submission of
+  its own, so the next chunk is filled while it runs, and
+  its range is released once its fence signals.
+ */
+void HelloTriangle::uploadBuffer(
+    VkBuffer dst, VkDeviceSize dst_offset, VkDeviceSize size,
+    VkDeviceSize element_size,
+    const std::function<void(void *, VkDeviceSize,
+                             VkDeviceSize)> &fill) {
+  if (size == 0) {
+    return;
+  }
+  VkDeviceSize chunk_size = std::max(
+      staging.capacity() / 2 / element_size * element_size,
+      element_size);
+  chunk_size = std::min(chunk_size, size);
+
+  struct ChunkCopy {
+    StagingRange range;
+    VkCommandBuffer cbuffer;
+    VkFence copied;
+  };
+  std::deque<ChunkCopy> copies;
+  VkDevice device = logical_dev.device();
+  auto retire = [&] {
+    ChunkCopy &c = copies.front();
+    vkWaitForFences(device, 1, &c.copied, VK_TRUE, UINT64_MAX);
+    vkDestroyFence(device, c.copied, nullptr);
+    vkFreeCommandBuffers(device, command_pool.pool, 1,
+                         &c.cbuffer);
+    staging.release(c.range);
+    copies.pop_front();
+  };
 
-  // start recording commands
-  VkBufferCopy copyRegion{};
-  copyRegion.size = size;
-  vkCmdCopyBuffer(cbuffer, src, dst, 1, &copyRegion);
+  for (VkDeviceSize offset = 0; offset < size;
+       offset += chunk_size) {
+    VkDeviceSize chunk = std::min(chunk_size, size - offset);
+    // 1. take a range, retiring earlier chunks until it fits
+    ChunkCopy c;
+    while (!staging.try_allocate(chunk, c.range)) {
+      if (copies.empty()) {
+        c.range = staging.allocate(chunk);
+        break;
+      }
+      retire();
+    }
 
-  // end signal
-  endSignalCommand(cbuffer);
+    // 2. fill it and submit its copy
+    fill(c.range.data, offset, chunk);
+    c.cbuffer = beginSignalCommand();
+    VkBufferCopy region{};
+    region.srcOffset = c.range.offset;
+    region.dstOffset = dst_offset + offset;
+    region.size = chunk;
+    vkCmdCopyBuffer(c.cbuffer, c.range.buffer, dst, 1, &region);
+    vkEndCommandBuffer(c.cbuffer);
+
+    VkFenceCreateInfo fenceInfo{};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    CHECK_VK(
+        vkCreateFence(device, &fenceInfo, nullptr, &c.copied),
+        "failed to create upload fence");
+    VkSubmitInfo sinfo{};
+    sinfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    sinfo.commandBufferCount = 1;
+    sinfo.pCommandBuffers = &c.cbuffer;
+    CHECK_VK(vkQueueSubmit(logical_dev.graphics_queue, 1,
+                           &sinfo, c.copied),
+             "failed to submit buffer upload");
+    copies.push_back(c);
+  }
+  while (!copies.empty()) {
+    retire();
+  }
 }
-void HelloTriangle::createUniformBuffer() {
-  VkDeviceSize b_size = sizeof(UniformBufferObject);
+/**
+  Build the meshlets of the model and upload their bounds.
+
+  The meshlet buffer is a storage buffer, so the culling can
+  later move to a compute shader reading the same data.
+ */
+void HelloTriangle::createMeshletBuffer() {
+  // 1. cluster every draw range of the uploaded index buffer
+  MeshView mesh = modelMesh();
+  meshlets = build_meshlets(mesh, submesh_meshlets);
+
+  // bounds for batched frustum culling, a submesh sphere
+  // encloses the spheres of its meshlets
+  meshlet_spheres = meshlet_bounds(meshlets);
+  submesh_spheres.clear();
+  for (const auto &range : submesh_meshlets) {
+    glm::vec3 lo(0.0f), hi(0.0f);
+    for (std::size_t i = range.first;
+         i < range.first + range.count; i++) {
+      glm::vec3 r(meshlets[i].radius);
+      lo = i == range.first
+               ? meshlets[i].center - r
+               : glm::min(lo, meshlets[i].center - r);
+      hi = i == range.first
+               ? meshlets[i].center + r
+               : glm::max(hi, meshlets[i].center + r);
+    }
+    glm::vec3 center = (lo + hi) * 0.5f;
+    float radius = 0.0f;
+    for (std::size_t i = range.first;
+         i < range.first + range.count; i++) {
+      radius = std::max(
+          radius, glm::distance(center, meshlets[i].center) +
+                      meshlets[i].radius);
+    }
+    submesh_spheres.push_back(center, radius);
+  }
+  visible_submeshes.resize(mesh.material_count);
+
+  // every material gets room for its meshlets at the level
+  // of detail where it has most of them
+  material_draws.clear();
+  draw_capacity = 0;
+  for (std::size_t m = 0; m < mesh.material_count; m++) {
+    DrawBatch batch{};
+    batch.first_index = mesh.submeshes[m].first_index;
+    batch.index_count = mesh.submeshes[m].index_count;
+    batch.first_draw = static_cast<uint32_t>(draw_capacity);
+    for (std::size_t l = 0; l < mesh.lod_count; l++) {
+      batch.draw_count = std::max(
+          batch.draw_count,
+          submesh_meshlets[l * mesh.material_count + m].count);
+    }
+    draw_capacity += batch.draw_count;
+    material_draws.push_back(batch);
+  }
 
-  uniform_buffers.resize(swap_chain.simages.size());
-  uniform_buffer_memories.resize(swap_chain.simages.size());
+  // bounding sphere of the model
+  glm::vec3 lo(0.0f), hi(0.0f);
+  if (mesh.vertex_count > 0) {
+    lo = hi = mesh.vertices[0].pos;
+  }
+  for (std::size_t i = 0; i < mesh.vertex_count; i++) {
+    lo = glm::min(lo, mesh.vertices[i].pos);
+    hi = glm::max(hi, mesh.vertices[i].pos);
+  }
+  model_center = (lo + hi) * 0.5f;
+  model_radius = glm::length(hi - lo) * 0.5f;
+
+  VkDeviceSize size = static_cast<VkDeviceSize>(
+      std::max<std::size_t>(meshlets.size(), 1) *
+      sizeof(Meshlet));
+
+  // 2. declare meshlet buffer
+  auto meshlet_usage_flag = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  createBuffer(size, meshlet_usage_flag,
+               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+               meshlet_buffer, meshlet_buffer_memory);
+
+  // 3. stage the meshlet data through the ring
+  auto bytes = reinterpret_cast<const char *>(meshlets.data());
+  uploadBuffer(meshlet_buffer, 0,
+               meshlets.size() * sizeof(Meshlet),
+               sizeof(Meshlet),
+               [&](void *data, VkDeviceSize offset,
+                   VkDeviceSize chunk) {
+                 memcpy(data, bytes + offset,
+                        static_cast<size_t>(chunk));
+               });
+}
+/**
+  Create one indirect draw buffer per swapchain image with
+  the command ranges of material_draws. They are rewritten
+  with the visible ranges in updateUniformBuffer.
+ */
+void HelloTriangle::createDrawBuffers() {
+  VkDeviceSize size = static_cast<VkDeviceSize>(
+      std::max<std::size_t>(draw_capacity, 1) *
+      sizeof(VkDrawIndexedIndirectCommand));
+  draw_buffers.resize(swap_chain.simages.size());
+  draw_buffer_memories.resize(swap_chain.simages.size());
   for (std::size_t i = 0; i < swap_chain.simages.size();
        i++) {
-    //
-    auto usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
     auto mem_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-    createBuffer(b_size, usage, mem_flags,
-                 uniform_buffers[i],
-                 uniform_buffer_memories[i]);
+    createBuffer(size, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                 mem_flags, draw_buffers[i],
+                 draw_buffer_memories[i]);
+  }
+}
+void HelloTriangle::destroyDrawBuffers() {
+  for (std::size_t i = 0; i < draw_buffers.size(); i++) {
+    vkDestroyBuffer(logical_dev.device(), draw_buffers[i],
+                    nullptr);
+    allocator.free(draw_buffer_memories[i]);
+  }
+  draw_buffers.clear();
+  draw_buffer_memories.clear();
+}
+/**
+  Create the staging ring, cached memory is preferred since
+  the mip filter and the cache writer read the staged
+  texture levels back.
+ */
+void HelloTriangle::createStagingRing() {
+  createBuffer(staging_ring_size,
+               VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+               VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+               staging_ring_buffer, staging_ring_memory,
+               VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+  staging.reset(staging_ring_buffer, staging_ring_memory.data,
+                staging_ring_size);
+}
+/**
+  Create the uniform buffer of all swapchain images, every
+  image takes a slice aligned to the
+  minUniformBufferOffsetAlignment of the device.
+ */
+void HelloTriangle::createUniformBuffer() {
+  VkDeviceSize alignment = physical_dev.capabilities.limits()
+                               .minUniformBufferOffsetAlignment;
+  uniform_stride = sizeof(UniformBufferObject);
+  if (alignment > 0) {
+    uniform_stride = (uniform_stride + alignment - 1) /
+                     alignment * alignment;
+  }
+  std::size_t image_count = swap_chain.simages.size();
+
+  auto usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+  auto mem_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  createBuffer(uniform_stride * image_count, usage, mem_flags,
+               uniform_buffer, uniform_buffer_memory);
+  // host visible blocks stay mapped, no map per frame
+  auto *data = static_cast<std::uint8_t *>(
+      uniform_buffer_memory.data);
+  uniform_data.resize(image_count);
+  for (std::size_t i = 0; i < image_count; i++) {
+    uniform_data[i] = reinterpret_cast<UniformBufferObject *>(
+        data + i * uniform_stride);
   }
 }
 void HelloTriangle::createDescriptorPool() {
   //
+  auto set_count =
+      static_cast<uint32_t>(texture_images.size());
   std::array<VkDescriptorPoolSize, 2> poolSizes{};
-  poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  poolSizes[0].descriptorCount =
-      static_cast<uint32_t>(swap_chain.simages.size());
+  poolSizes[0].type =
+      VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  poolSizes[0].descriptorCount = set_count;
   poolSizes[1].type =
       VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-  poolSizes[1].descriptorCount =
-      static_cast<uint32_t>(swap_chain.simages.size());
+  poolSizes[1].descriptorCount = set_count;
 
   // create descriptor pool
   VkDescriptorPoolCreateInfo pinfo{};
@@ -1415,8 +2569,7 @@ void HelloTriangle::createDescriptorPool() {
   pinfo.poolSizeCount =
       static_cast<uint32_t>(poolSizes.size());
   pinfo.pPoolSizes = poolSizes.data();
-  pinfo.maxSets =
-      static_cast<uint32_t>(swap_chain.simages.size());
+  pinfo.maxSets = set_count;
 
   CHECK_VK(vkCreateDescriptorPool(logical_dev.device(),
                                   &pinfo, nullptr,
@@ -1424,50 +2577,60 @@ void HelloTriangle::createDescriptorPool() {
            "failed to create descriptor pool");
 }
 void HelloTriangle::createDescriptorSets() {
+  std::size_t set_count = texture_images.size();
   std::vector<VkDescriptorSetLayout> layouts(
-      swap_chain.simages.size(), descriptor_set_layout);
+      set_count, descriptor_set_layout);
   //
   VkDescriptorSetAllocateInfo allocInfo{};
   allocInfo.sType =
       VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
   allocInfo.descriptorPool = descriptor_pool;
   allocInfo.descriptorSetCount =
-      static_cast<uint32_t>(swap_chain.simages.size());
+      static_cast<uint32_t>(set_count);
   allocInfo.pSetLayouts = layouts.data();
 
-  descriptor_sets.resize(swap_chain.simages.size());
+  descriptor_sets.resize(set_count);
   CHECK_VK(vkAllocateDescriptorSets(logical_dev.device(),
                                     &allocInfo,
                                     descriptor_sets.data()),
            "failed to allocate descriptor sets");
-
-  //
-  for (std::size_t i = 0; i < swap_chain.simages.size();
-       i++) {
+  updateDescriptorSets();
+}
+/**
+  Write the descriptor sets, textures that are not resident
+  sample the placeholder.
+ */
+void HelloTriangle::updateDescriptorSets() {
+  // every set shares the uniform buffer, the slice of the
+  // image is selected by the dynamic offset
+  for (std::size_t t = 0; t < descriptor_sets.size(); t++) {
     VkDescriptorBufferInfo binfo{};
-    binfo.buffer = uniform_buffers[i];
+    binfo.buffer = uniform_buffer;
     binfo.offset = 0;
     binfo.range = sizeof(UniformBufferObject);
     //
     VkDescriptorImageInfo imageInfo{};
     imageInfo.imageLayout =
         VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-    imageInfo.imageView = texture_image_view;
+    imageInfo.imageView = texture_image_views[t];
+    if (imageInfo.imageView == VK_NULL_HANDLE) {
+      imageInfo.imageView = placeholder_image_view;
+    }
     imageInfo.sampler = texture_sampler;
     //
     std::array<VkWriteDescriptorSet, 2> dwset{};
 
     dwset[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    dwset[0].dstSet = descriptor_sets[i];
+    dwset[0].dstSet = descriptor_sets[t];
     dwset[0].dstBinding = 0;
     dwset[0].dstArrayElement = 0;
     dwset[0].descriptorType =
-        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     dwset[0].descriptorCount = 1;
     dwset[0].pBufferInfo = &binfo;
     //
     dwset[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    dwset[1].dstSet = descriptor_sets[i];
+    dwset[1].dstSet = descriptor_sets[t];
     dwset[1].dstBinding = 1;
     dwset[1].dstArrayElement = 0;
     dwset[1].descriptorType =
@@ -1489,7 +2652,7 @@ void HelloTriangle::createDescriptorSetLayout() {
   uboLayoutBinding.binding = 0;
   uboLayoutBinding.descriptorCount = 1;
   uboLayoutBinding.descriptorType =
-      VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+      VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   uboLayoutBinding.pImmutableSamplers = nullptr;
   uboLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
@@ -1523,7 +2686,8 @@ void HelloTriangle::createDescriptorSetLayout() {
 void HelloTriangle::createBuffer(
     VkDeviceSize size, VkBufferUsageFlags usage,
     VkMemoryPropertyFlags mem_flags, VkBuffer &buffer,
-    VkDeviceMemory &buffer_memory) {
+    MemoryAllocation &buffer_memory,
+    VkMemoryPropertyFlags preferred_flags) {
   // 1. create buffer info
   VkBufferCreateInfo bufferInfo{};
   bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
@@ -1539,34 +2703,34 @@ void HelloTriangle::createBuffer(
   vkGetBufferMemoryRequirements(logical_dev.device(),
                                 buffer, &memReq);
 
-  // 3. allocate required memory
-  VkMemoryAllocateInfo allocInfo{};
-  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocInfo.allocationSize = memReq.size;
-  allocInfo.memoryTypeIndex =
-      findMemoryType(memReq.memoryTypeBits, mem_flags);
+  // 3. take a range of a memory block, host visible ones
+  // stay mapped
+  buffer_memory = allocator.allocate(
+      memReq,
+      findMemoryType(memReq.memoryTypeBits, mem_flags,
+                     preferred_flags),
+      true);
 
-  CHECK_VK(vkAllocateMemory(logical_dev.device(),
-                            &allocInfo, nullptr,
-                            &buffer_memory),
-           "failed to allocate memory from logical device");
-
-  // 4. map host to device memory
+  // 4. bind the range to the buffer
   vkBindBufferMemory(logical_dev.device(), buffer,
-                     buffer_memory, 0);
+                     buffer_memory.memory,
+                     buffer_memory.offset);
 }
+/**
+  Memory type with the required flags, one that also has the
+  preferred flags if there is one.
+ */
 uint32_t
 HelloTriangle::findMemoryType(uint32_t filter,
-                              VkMemoryPropertyFlags flags) {
+                              VkMemoryPropertyFlags flags,
+                              VkMemoryPropertyFlags preferred) {
   //
-  VkPhysicalDeviceMemoryProperties memProps;
-  vkGetPhysicalDeviceMemoryProperties(physical_dev.device(),
-                                      &memProps);
-  for (uint32_t i = 0; i < memProps.memoryTypeCount; i++) {
-    if ((filter & (1 << i)) &&
-        (memProps.memoryTypes[i].propertyFlags & flags) ==
-            flags) {
-      return i;
+  const DeviceCapabilities &caps = physical_dev.capabilities;
+  for (auto wanted : {flags | preferred, flags}) {
+    uint32_t types = filter & caps.memory_types(wanted);
+    if (types != 0) {
+      // the lowest index, as the device orders them
+      return static_cast<uint32_t>(__builtin_ctz(types));
     }
   }
   throw std::runtime_error(
@@ -1590,13 +2754,44 @@ void HelloTriangle::createCommandBuffers() {
       "failed allocate for registering command buffers");
 
   //
+  // one batch per material, ordered by texture so that the
+  // materials of a texture or atlas bind its set once. The
+  // images share the sets and bind their uniform slice.
+  MeshView mesh = modelMesh();
+  std::size_t material_count = material_draws.size();
+  std::vector<std::size_t> order;
+  for (std::size_t m = 0; m < material_count; m++) {
+    if (material_draws[m].draw_count != 0) {
+      order.push_back(m);
+    }
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [this](std::size_t a, std::size_t b) {
+                     return material_textures[a] <
+                            material_textures[b];
+                   });
+  std::vector<DrawBatch> batches;
+  for (std::size_t m : order) {
+    batches.push_back(material_draws[m]);
+    batches.back().descriptor_set =
+        descriptor_sets[material_textures[m]];
+  }
+  // without multiDrawIndirect every draw is a command
+  const DeviceCapabilities &caps = physical_dev.capabilities;
+  uint32_t draws_per_call = 1;
+  if (caps.features.multiDrawIndirect) {
+    draws_per_call =
+        std::max(caps.limits().maxDrawIndirectCount, 1u);
+  }
   for (std::size_t i = 0; i < cmd_buffers.size(); i++) {
-    //
+    auto uniform_offset =
+        static_cast<uint32_t>(i * uniform_stride);
     auto buffer = vulkan_buffer<VkCommandBuffer>(
         cmd_buffers.get(i), swapchain_framebuffers[i],
         render_pass, swap_chain.sextent, graphics_pipeline,
-        vertex_buffer, index_buffer, indices,
-        descriptor_sets[i], pipeline_layout);
+        vertex_buffer, vertex_buffer_offsets, index_buffer,
+        mesh.index_type, draw_buffers[i], batches,
+        pipeline_layout, uniform_offset, draws_per_call);
   }
 }
 void HelloTriangle::createSyncObjects() {
@@ -1639,13 +2834,14 @@ void HelloTriangle::recreateSwapchain() {
     glfwWaitEvents();
   }
   vkDeviceWaitIdle(logical_dev.device());
+  destroyDrawBuffers();
   auto vs = cmd_buffers.to_vec();
   swap_chain.destroy(
       logical_dev, command_pool.pool, vs,
       swapchain_framebuffers, render_pass,
-      graphics_pipeline, pipeline_layout, uniform_buffers,
-      uniform_buffer_memories, descriptor_pool, depth_image,
-      depth_image_view, depth_image_memory);
+      graphics_pipeline, pipeline_layout, uniform_buffer,
+      uniform_buffer_memory, descriptor_pool, depth_image,
+      depth_image_view, depth_image_memory, allocator);
   swap_chain = swapchain(physical_dev, logical_dev, window);
   // 1. render pass
   createRenderPass();
@@ -1658,6 +2854,7 @@ void HelloTriangle::recreateSwapchain() {
   createFramebuffers();
   // 4. uniform buffer
   createUniformBuffer();
+  createDrawBuffers();
   // 5. descriptor pool
   createDescriptorPool();
   // 6. descriptor pool
@@ -1668,9 +2865,10 @@ void HelloTriangle::recreateSwapchain() {
 void HelloTriangle::updateUniformBuffer(
     uint32_t image_index) {
   UniformBufferObject ubo;
-  glm::mat4 model(1.0f);
-  ubo.model = glm::rotate(model, glm::radians(45.0f),
-                          glm::vec3(0.0f, 0.0f, 1.0f));
+  glm::mat4 model = glm::rotate(
+      glm::mat4(1.0f), glm::radians(45.0f),
+      glm::vec3(0.0f, 0.0f, 1.0f));
+  ubo.model = model * vertex_quantization.dequantize();
   glm::vec3 cam_pos(2.0f);
   glm::vec3 cam_target(0.0f);
   glm::vec3 world_up(0.0f, 0.0f, 1.0f);
@@ -1685,13 +2883,51 @@ void HelloTriangle::updateUniformBuffer(
       near_plane_distance, far_plane_distance);
   ubo.proj[1][1] *= -1;
 
-  void *data;
-  vkMapMemory(logical_dev.device(),
-              uniform_buffer_memories[image_index], 0,
-              sizeof(ubo), 0, &data);
-  memcpy(data, &ubo, sizeof(ubo));
-  vkUnmapMemory(logical_dev.device(),
-                uniform_buffer_memories[image_index]);
+  // composed aside, the mapped memory may be write
+  // combined and slow to read
+  *uniform_data[image_index] = ubo;
+
+  // cull meshlets in model space, meshlet bounds are not
+  // quantized
+  clip_from_model = ubo.proj * ubo.view * model;
+  Frustum frustum = Frustum::from_matrix(clip_from_model);
+  glm::vec3 model_cam_pos(glm::inverse(model) *
+                          glm::vec4(cam_pos, 1.0f));
+
+  // coarsest level whose error stays under a pixel
+  float distance =
+      glm::distance(model_cam_pos, model_center) -
+      model_radius;
+  float pixels_per_unit = std::abs(ubo.proj[1][1]) *
+                          swap_chain.sextent.height * 0.5f;
+  MeshView mesh = modelMesh();
+  std::size_t lod = select_lod(mesh.lods, mesh.lod_count,
+                               distance, pixels_per_unit);
+  auto draws = static_cast<VkDrawIndexedIndirectCommand *>(
+      draw_buffer_memories[image_index].data);
+  std::fill(draws, draws + draw_capacity,
+            VkDrawIndexedIndirectCommand{});
+
+  // the model, then the submeshes of the level, then the
+  // meshlets of the visible submeshes
+  std::size_t material_count = material_draws.size();
+  residency.next_frame();
+  if (frustum.intersects(model_center, model_radius)) {
+    std::size_t submesh_count = cull_spheres(
+        frustum, submesh_spheres, lod * material_count,
+        material_count, visible_submeshes.data());
+    for (std::size_t k = 0; k < submesh_count; k++) {
+      std::size_t submesh = visible_submeshes[k];
+      std::size_t material = submesh - lod * material_count;
+      const DrawBatch &batch = material_draws[material];
+      residency.touch(material_textures[material]);
+      cull_meshlets(meshlets, meshlet_spheres,
+                    submesh_meshlets[submesh], frustum,
+                    model_cam_pos, visible_meshlets,
+                    draws + batch.first_draw,
+                    batch.draw_count);
+    }
+  }
 }
 void HelloTriangle::draw() {
   vkWaitForFences(logical_dev.device(), 1,
@@ -1785,6 +3021,13 @@ extern "C" int main() {
   std::string wtitle = "Vulkan Window Title";
   HelloTriangle hello(wtitle, (uint32_t)WIDTH,
                       (uint32_t)HEIGHT);
+  // any value but 0 turns the diagnostics on
+  const char *verbose = std::getenv("VTUTO_VERBOSE");
+  hello.verbose =
+      verbose != nullptr && std::string(verbose) != "0";
+  if (const char *caps = std::getenv("VTUTO_DEVICE_CAPS")) {
+    hello.device_capabilities_path = caps;
+  }
 
   try {
     hello.run();
@@ -0,0 +1,242 @@
+// benchmark of the bvh queries against a brute force scan,
+// on the model of the application
+#include <bvh.hpp>
+#include <chrono>
+#include <objloader.hpp>
+#include <random>
+
+using namespace vtuto;
+
+namespace {
+
+/** model of the application, or the path given */
+const char *default_model = "./assets/models/viking.obj";
+const std::size_t ray_count = 2000;
+const std::size_t box_count = 200;
+
+int failures = 0;
+
+void check(bool ok, const std::string &what) {
+  if (!ok) {
+    std::cerr << "FAILED: " << what << std::endl;
+    failures++;
+  }
+}
+
+/** wavy grid, used when the model is not there */
+void make_grid(std::vector<Vertex> &vertices,
+               std::vector<std::uint32_t> &indices) {
+  const std::uint32_t n = 200;
+  for (std::uint32_t y = 0; y <= n; y++) {
+    for (std::uint32_t x = 0; x <= n; x++) {
+      Vertex v{};
+      v.pos = glm::vec3(x, y,
+                        2.0f * std::sin(x * 0.1f) *
+                            std::cos(y * 0.13f));
+      vertices.push_back(v);
+    }
+  }
+  for (std::uint32_t y = 0; y < n; y++) {
+    for (std::uint32_t x = 0; x < n; x++) {
+      std::uint32_t i = y * (n + 1) + x;
+      indices.insert(indices.end(), {i, i + 1, i + n + 1});
+      indices.insert(indices.end(),
+                     {i + 1, i + n + 2, i + n + 1});
+    }
+  }
+}
+
+/** the brute force reference, every triangle is tested */
+struct brute_force {
+  const std::vector<Vertex> &vertices;
+  const std::vector<std::uint32_t> &indices;
+
+  glm::vec3 corner(std::size_t t, std::size_t k) const {
+    return vertices[indices[3 * t + k]].pos;
+  }
+  /** same Moller Trumbore test as the bvh */
+  bool intersect(const Ray &ray, std::size_t t,
+                 RayHit &hit) const {
+    glm::vec3 p0 = corner(t, 0);
+    glm::vec3 e1 = corner(t, 1) - p0;
+    glm::vec3 e2 = corner(t, 2) - p0;
+    glm::vec3 q = glm::cross(ray.direction, e2);
+    float det = glm::dot(e1, q);
+    if (std::abs(det) < 1e-12f) {
+      return false;
+    }
+    float inv_det = 1.0f / det;
+    glm::vec3 s = ray.origin - p0;
+    float u = glm::dot(s, q) * inv_det;
+    if (u < 0.0f || u > 1.0f) {
+      return false;
+    }
+    glm::vec3 r = glm::cross(s, e1);
+    float v = glm::dot(ray.direction, r) * inv_det;
+    if (v < 0.0f || u + v > 1.0f) {
+      return false;
+    }
+    float dist = glm::dot(e2, r) * inv_det;
+    if (dist < 0.0f || dist > std::min(hit.t, ray.t_max)) {
+      return false;
+    }
+    hit.t = dist;
+    hit.triangle = static_cast<std::uint32_t>(t);
+    return true;
+  }
+  bool closest_hit(const Ray &ray, RayHit &hit) const {
+    hit = RayHit{};
+    bool found = false;
+    for (std::size_t t = 0; t < indices.size() / 3; t++) {
+      found = intersect(ray, t, hit) || found;
+    }
+    return found;
+  }
+  std::vector<std::uint32_t> overlap(const Aabb &box) const {
+    std::vector<std::uint32_t> result;
+    for (std::size_t t = 0; t < indices.size() / 3; t++) {
+      Aabb bounds;
+      for (std::size_t k = 0; k < 3; k++) {
+        bounds.grow(corner(t, k));
+      }
+      if (box.overlaps(bounds)) {
+        result.push_back(static_cast<std::uint32_t>(t));
+      }
+    }
+    return result;
+  }
+};
+
+/** microseconds per call of query over count items */
+template <class Fn>
+double time_per_call(std::size_t count, Fn &&query) {
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < count; i++) {
+    query(i);
+  }
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / count;
+}
+}
+
+int main(int argc, char **argv) {
+  // 1. the model, or the grid when it is missing
+  std::string path = argc > 1 ? argv[1] : default_model;
+  thread_pool pool;
+  std::vector<Vertex> vertices;
+  std::vector<std::uint32_t> indices;
+  if (std::ifstream(path).good()) {
+    obj_loader loader(pool);
+    std::vector<Submesh> submeshes;
+    std::vector<MeshMaterial> materials;
+    loader.load(path, vertices, indices, submeshes,
+                materials);
+  } else {
+    std::cout << path << " not found, using a grid"
+              << std::endl;
+    path = "grid";
+    make_grid(vertices, indices);
+  }
+  MeshView mesh;
+  mesh.vertices = vertices.data();
+  mesh.vertex_count = vertices.size();
+  mesh.indices = indices.data();
+  mesh.index_count = indices.size();
+  mesh.index_type = VK_INDEX_TYPE_UINT32;
+
+  triangle_bvh bvh;
+  auto start = std::chrono::steady_clock::now();
+  bvh.build(mesh, 0, indices.size(), pool);
+  std::chrono::duration<double, std::milli> build_ms =
+      std::chrono::steady_clock::now() - start;
+  std::cout << path << ": " << bvh.stats << ", built in "
+            << build_ms.count() << " ms" << std::endl;
+
+  // 2. rays from around the model through points of it,
+  // and boxes of a tenth of its size
+  Aabb model;
+  for (const Vertex &v : vertices) {
+    model.grow(v.pos);
+  }
+  glm::vec3 center = (model.lo + model.hi) * 0.5f;
+  glm::vec3 extent = model.hi - model.lo;
+  float radius = glm::length(extent);
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+  auto inside = [&] {
+    return model.lo +
+           extent * glm::vec3(unit(rng), unit(rng), unit(rng));
+  };
+  std::vector<Ray> rays(ray_count);
+  for (Ray &ray : rays) {
+    glm::vec3 dir(unit(rng) - 0.5f, unit(rng) - 0.5f,
+                  unit(rng) - 0.5f);
+    ray.origin = center + glm::normalize(dir) * radius;
+    ray.direction = glm::normalize(inside() - ray.origin);
+  }
+  std::vector<Aabb> boxes(box_count);
+  for (Aabb &box : boxes) {
+    glm::vec3 p = inside();
+    box.grow(p - extent * 0.05f);
+    box.grow(p + extent * 0.05f);
+  }
+
+  // 3. the bvh agrees with the scan
+  brute_force brute{vertices, indices};
+  std::size_t hit_count = 0;
+  for (std::size_t i = 0; i < ray_count; i++) {
+    RayHit hit, expected;
+    bool found = bvh.closest_hit(rays[i], hit);
+    bool expected_found = brute.closest_hit(rays[i], expected);
+    hit_count += expected_found ? 1 : 0;
+    check(found == expected_found &&
+              bvh.raycast(rays[i]) == expected_found,
+          "hit of ray " + std::to_string(i));
+    check(!found || std::abs(hit.t - expected.t) <=
+                        1e-5f * (1.0f + expected.t),
+          "distance of ray " + std::to_string(i));
+  }
+  for (std::size_t i = 0; i < box_count; i++) {
+    std::vector<std::uint32_t> result;
+    bvh.overlap(boxes[i], result);
+    std::sort(result.begin(), result.end());
+    check(result == brute.overlap(boxes[i]),
+          "overlap of box " + std::to_string(i));
+  }
+
+  // 4. time the queries, every result is counted so none
+  // is optimized away
+  RayHit hit;
+  std::vector<std::uint32_t> result;
+  std::size_t found = 0;
+  double closest_us =
+      time_per_call(ray_count, [&](std::size_t i) {
+        found += bvh.closest_hit(rays[i], hit) ? 1 : 0;
+      });
+  double any_us = time_per_call(ray_count, [&](std::size_t i) {
+    found += bvh.raycast(rays[i]) ? 1 : 0;
+  });
+  double overlap_us =
+      time_per_call(box_count, [&](std::size_t i) {
+        result.clear();
+        found += bvh.overlap(boxes[i], result);
+      });
+  double brute_closest_us =
+      time_per_call(ray_count, [&](std::size_t i) {
+        found += brute.closest_hit(rays[i], hit) ? 1 : 0;
+      });
+  double brute_overlap_us =
+      time_per_call(box_count, [&](std::size_t i) {
+        result = brute.overlap(boxes[i]);
+        found += result.size();
+      });
+  std::cout << hit_count << " of " << ray_count
+            << " rays hit, " << found << " results" << std::endl
+            << "closest hit: " << closest_us << " us, brute "
+            << brute_closest_us << " us" << std::endl
+            << "raycast:     " << any_us << " us" << std::endl
+            << "overlap:     " << overlap_us << " us, brute "
+            << brute_overlap_us << " us" << std::endl;
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+// benchmark of the batched sphere culling against the
+// scalar reference
+#include <chrono>
+#include <frustum.hpp>
+#include <random>
+
+using namespace vtuto;
+
+namespace {
+
+const std::size_t sphere_count = 100000;
+const int pass_count = 50;
+
+/** spheres around the origin, a part of them in view */
+SphereSet make_spheres() {
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> position(-50.0f,
+                                                 50.0f);
+  std::uniform_real_distribution<float> radius(0.05f, 2.0f);
+  SphereSet spheres;
+  for (std::size_t i = 0; i < sphere_count; i++) {
+    spheres.push_back(glm::vec3(position(rng), position(rng),
+                                position(rng)),
+                      radius(rng));
+  }
+  return spheres;
+}
+
+using cull_fn = std::size_t (*)(const Frustum &,
+                                const SphereSet &, std::size_t,
+                                std::size_t, std::uint32_t *);
+
+/** milliseconds of one pass over all the spheres */
+double time_passes(cull_fn cull, const Frustum &frustum,
+                   const SphereSet &spheres,
+                   std::vector<std::uint32_t> &visible,
+                   std::size_t &visible_count) {
+  auto start = std::chrono::steady_clock::now();
+  for (int p = 0; p < pass_count; p++) {
+    visible_count = cull(frustum, spheres, 0, spheres.size(),
+                         visible.data());
+  }
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / pass_count;
+}
+}
+
+int main() {
+  SphereSet spheres = make_spheres();
+  glm::mat4 view =
+      glm::lookAt(glm::vec3(0.0f, 0.0f, 60.0f),
+                  glm::vec3(10.0f, 5.0f, 0.0f),
+                  glm::vec3(0.0f, 1.0f, 0.0f));
+  glm::mat4 proj =
+      glm::perspective(glm::radians(45.0f), 1.5f, 0.1f, 80.0f);
+  Frustum frustum = Frustum::from_matrix(proj * view);
+
+  // 1. both give the same survivors, also for ranges that
+  // do not start or end on a batch
+  int failures = 0;
+  std::vector<std::uint32_t> scalar(sphere_count);
+  std::vector<std::uint32_t> batched(sphere_count);
+  const std::size_t ranges[][2] = {
+      {0, sphere_count}, {3, 1000}, {17, 5}, {1, 0}};
+  for (const auto &range : ranges) {
+    std::size_t n = cull_spheres_scalar(
+        frustum, spheres, range[0], range[1], scalar.data());
+    std::size_t m = cull_spheres(frustum, spheres, range[0],
+                                 range[1], batched.data());
+    if (n != m || !std::equal(scalar.begin(),
+                              scalar.begin() + n,
+                              batched.begin())) {
+      std::cerr << "FAILED: survivors of [" << range[0] << ", "
+                << range[0] + range[1] << ") differ"
+                << std::endl;
+      failures++;
+    }
+  }
+
+  // 2. time a pass over all the spheres
+  std::size_t scalar_count = 0, batched_count = 0;
+  double scalar_ms = time_passes(cull_spheres_scalar, frustum,
+                                 spheres, scalar, scalar_count);
+  double batched_ms = time_passes(cull_spheres, frustum,
+                                  spheres, batched,
+                                  batched_count);
+  std::cout << sphere_count << " spheres, " << scalar_count
+            << " visible" << std::endl
+            << "scalar:  " << scalar_ms << " ms" << std::endl
+            << "batched: " << batched_ms << " ms, "
+            << sphere_batch_size << " per batch" << std::endl;
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,63 @@
+// regression tests of the obj loader
+#include <objloader.hpp>
+
+using namespace vtuto;
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string &what) {
+  if (!ok) {
+    std::cerr << "FAILED: " << what << std::endl;
+    failures++;
+  }
+}
+
+/** x of the position of every output index */
+std::vector<float> load_xs(const std::string &path,
+                           const std::string &content) {
+  std::ofstream(path, std::ios::binary) << content;
+  thread_pool pool(2);
+  obj_loader loader(pool);
+  std::vector<Vertex> vertices;
+  std::vector<std::uint32_t> indices;
+  std::vector<Submesh> submeshes;
+  std::vector<MeshMaterial> materials;
+  loader.load(path, vertices, indices, submeshes, materials);
+  std::remove(path.c_str());
+  std::vector<float> xs;
+  for (std::uint32_t i : indices) {
+    xs.push_back(vertices[i].pos.x);
+  }
+  return xs;
+}
+
+/**
+  Relative indices of the second chunk that point into the
+  first one. The long comment ends the first of the two
+  chunks, right after the sixth position.
+ */
+void relative_across_chunks() {
+  std::string first;
+  for (int i = 0; i < 6; i++) {
+    first += "v " + std::to_string(i) + " 0 0\n";
+  }
+  first += "# " + std::string(256, '-') + "\n";
+  std::string relative =
+      first + "v 6 0 0\nv 7 0 0\nf -8 -7 -6\nf -3 -2 -1\n";
+  std::string absolute =
+      first + "v 6 0 0\nv 7 0 0\nf 1 2 3\nf 6 7 8\n";
+
+  std::vector<float> expected = {0, 1, 2, 5, 6, 7};
+  check(load_xs("relative_test.obj", absolute) == expected,
+        "absolute indices");
+  check(load_xs("relative_test.obj", relative) == expected,
+        "relative indices across chunks");
+}
+}
+
+int main() {
+  relative_across_chunks();
+  return failures == 0 ? 0 : 1;
+}